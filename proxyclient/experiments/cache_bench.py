@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, time, gzip, random
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+# memcpy, proxy data checksum and gzip decompression throughput with the L1 D-cache off and on.
+# Timed from the host, with the round trip of an empty request taken out.
+
+from m1n1.setup import *
+
+SIZE = int(sys.argv[1], 0) if len(sys.argv) > 1 else 0x400000
+ROUNDS = 3
+
+def make_data(size):
+    # half text, half noise, so gzip has something to do on both kinds of block
+    rng = random.Random(0)
+    out = bytearray()
+    line = 0
+    while len(out) < size:
+        out += b"".join(b"%08x the quick brown fox jumps over the lazy dog\n" % (line + i)
+                        for i in range(64))
+        out += rng.randbytes(64 * 48)
+        line += 64
+    return bytes(out[:size])
+
+def rtt():
+    start = time.perf_counter()
+    for i in range(16):
+        p.nop()
+    return (time.perf_counter() - start) / 16
+
+def timed(fn):
+    best = None
+    for i in range(ROUNDS):
+        start = time.perf_counter()
+        fn()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return max(best - overhead, 1e-6)
+
+data = make_data(SIZE)
+packed = gzip.compress(data, 6)
+print(f"{SIZE} bytes, {len(packed)} gzipped")
+
+src = u.memalign(0x40, SIZE)
+dst = u.memalign(0x40, SIZE)
+gz = u.memalign(0x40, len(packed))
+iface.writemem(gz, packed, True)
+
+def gzdec():
+    ret = p.gzdec(gz, len(packed), src, SIZE)
+    if ret != SIZE:
+        raise Exception(f"gzdec returned {ret}")
+
+want_csum = iface.checksum(data)
+def csum():
+    got = p.checksum(src, SIZE)
+    if got != want_csum:
+        raise Exception(f"checksum {got:#x}, expected {want_csum:#x}")
+
+tests = [
+    ("gzdec", gzdec),
+    ("checksum", csum),
+    ("memcpy32", lambda: p.memcpy32(dst, src, SIZE)),
+    ("memcpy8", lambda: p.memcpy8(dst, src, SIZE)),
+]
+
+was_on = p.mmu_set_dcache(False)
+overhead = rtt()
+try:
+    results = {}
+    for dcache in (False, True):
+        p.mmu_set_dcache(dcache)
+        gzdec()
+        for name, fn in tests:
+            results.setdefault(name, []).append(SIZE / timed(fn) / 1e6)
+
+    print(f"{'':10} {'D$ off':>12} {'D$ on':>12}")
+    for name, (off, on) in results.items():
+        print(f"{name:10} {off:7.2f} MB/s {on:7.2f} MB/s  x{on / off:.1f}")
+finally:
+    p.mmu_set_dcache(was_on)
+    u.free(src)
+    u.free(dst)
+    u.free(gz)
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, time, struct
+from array import array
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+# Raw USB link throughput, using the source/sink mode of the raw bulk interface.
+# The proxy itself keeps running over the CDC ACM port given by M1N1DEVICE.
+
+from m1n1.setup import *
+
+DURATION = float(sys.argv[1]) if len(sys.argv) > 1 else 5.0
+CHUNK = 0x100000
+
+class BenchDevice(UsbBulkDevice):
+    # synchronous transfers only, so each direction is measured on its own
+    RX_TRANSFERS = 0
+
+cmd_iodev = p.iodev_whoami()
+if not (IODEV.USB0 <= cmd_iodev <= IODEV.USB7):
+    print(f"Proxy is on {cmd_iodev.name}, need a USB CDC port")
+    sys.exit(1)
+bulk_iodev = IODEV.USB_BULK0 + (cmd_iodev - IODEV.USB0)
+
+def pattern(offset, size):
+    return array("I", range(offset // 4, (offset + size) // 4)).tobytes()
+
+stats_buf = u.malloc(0x40)
+
+def device_stats():
+    p.usb_source_sink(bulk_iodev, 1, stats_buf)
+    return struct.unpack("<QQII", iface.readmem(stats_buf, 24))
+
+p.usb_source_sink(bulk_iodev, 1)
+dev = BenchDevice()
+
+try:
+    # host -> device, the device checks every byte
+    blocks = 16
+    data = [pattern(i * CHUNK, CHUNK) for i in range(blocks)]
+    sent = 0
+    start = time.time()
+    while time.time() - start < DURATION:
+        i = sent // CHUNK % blocks
+        if i == 0 and sent:
+            data = [pattern(sent + j * CHUNK, CHUNK) for j in range(blocks)]
+        dev.handle.bulkWrite(dev.ep_out, data[i], 1000)
+        sent += CHUNK
+    elapsed = time.time() - start
+    rx_bytes, _, rx_errors, _ = device_stats()
+    print(f"OUT: {sent / elapsed / 1e6:.2f} MB/s, device saw {rx_bytes} bytes, "
+          f"{rx_errors} errors")
+
+    # device -> host, only the block boundaries are checked to keep the host out of the way
+    got = 0
+    errors = 0
+    start = time.time()
+    while time.time() - start < DURATION:
+        block = dev.handle.bulkRead(dev.ep_in, CHUNK, 1000)
+        n = len(block) // 4
+        first = struct.unpack_from("<I", block, 0)[0]
+        last = struct.unpack_from("<I", block, (n - 1) * 4)[0]
+        if first != (got // 4) & 0xffffffff or last != (got // 4 + n - 1) & 0xffffffff:
+            errors += 1
+        got += len(block)
+    elapsed = time.time() - start
+    _, tx_bytes, _, tx_errors = device_stats()
+    print(f"IN:  {got / elapsed / 1e6:.2f} MB/s, device sent {tx_bytes} bytes, "
+          f"{errors} bad blocks, {tx_errors} errors")
+finally:
+    dev.close()
+    p.usb_source_sink(bulk_iodev, 0)
+    u.free(stats_buf)
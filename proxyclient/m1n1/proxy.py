@@ -33,10 +33,12 @@ class UartRemoteError(UartError):
 
 class Feature(IntFlag):
     DISABLE_DATA_CSUMS = 0x01  # Data transfers don't use checksums
+    DATA_CHANNEL = 0x02        # Memory payloads go over a separate bulk data device
+    GZWRITE = 0x04             # REQ_GZWRITE is supported
 
     @classmethod
     def get_all(cls):
-        return cls.DISABLE_DATA_CSUMS
+        return cls.DISABLE_DATA_CSUMS | cls.DATA_CHANNEL | cls.GZWRITE
 
     def __str__(self):
         return ", ".join(feature.name for feature in self.__class__
@@ -94,6 +96,298 @@ class DART(IntEnum):
 #  If the status is ST_OK returns the data field to caller
 #     Otherwise reports a remote Error
 
+class UsbBulkDevice:
+    """
+    Serial-like wrapper around the vendor-specific raw bulk interface, for talking to the
+    proxy through libusb instead of the CDC ACM tty. Device strings: "usb" or "usb:<serial>".
+    """
+    VID = 0x1209
+    PID = 0x316d
+    INTERFACE_CLASS = 0xff
+
+    RX_TRANSFERS = 8
+    RX_TRANSFER_SIZE = 0x10000
+    TX_CHUNK = 0x100000
+
+    def __init__(self, serial_number=None):
+        import usb1
+        self.usb1 = usb1
+        self.serial_number = serial_number
+        self.timeout = None
+        self.ctx = None
+        self.handle = None
+        self.rx = bytearray()
+        self.transfers = []
+        self.open()
+
+    def _find(self):
+        for device in self.ctx.getDeviceIterator(skip_on_error=True):
+            if device.getVendorID() != self.VID or device.getProductID() != self.PID:
+                continue
+            if self.serial_number is not None:
+                try:
+                    if device.getSerialNumber() != self.serial_number:
+                        continue
+                except self.usb1.USBError:
+                    continue
+            for setting in device.iterSettings():
+                if setting.getClass() == self.INTERFACE_CLASS:
+                    return device, setting
+        return None, None
+
+    def _rx_done(self, transfer):
+        status = transfer.getStatus()
+        if status == self.usb1.TRANSFER_COMPLETED:
+            self.rx += transfer.getBuffer()[:transfer.getActualLength()]
+        elif status in (self.usb1.TRANSFER_CANCELLED, self.usb1.TRANSFER_NO_DEVICE):
+            return
+        try:
+            transfer.submit()
+        except self.usb1.USBError:
+            pass
+
+    @property
+    def is_open(self):
+        return self.handle is not None
+
+    def open(self):
+        if self.ctx is None:
+            self.ctx = self.usb1.USBContext()
+        device, setting = self._find()
+        if device is None:
+            raise serial.SerialException("m1n1 USB bulk interface not found")
+        self.handle = device.open()
+        self.interface = setting.getNumber()
+        try:
+            self._setup(setting)
+        except self.usb1.USBError:
+            self.close()
+            raise
+
+    def _setup(self, setting):
+        self.handle.claimInterface(self.interface)
+        self.ep_in = self.ep_out = None
+        for ep in setting:
+            if ep.getAddress() & 0x80:
+                self.ep_in = ep.getAddress()
+            else:
+                self.ep_out = ep.getAddress()
+
+        self.rx = bytearray()
+        self.transfers = []
+        for i in range(self.RX_TRANSFERS):
+            transfer = self.handle.getTransfer()
+            transfer.setBulk(self.ep_in, self.RX_TRANSFER_SIZE, callback=self._rx_done)
+            transfer.submit()
+            self.transfers.append(transfer)
+
+    def close(self):
+        if self.handle is None:
+            return
+        for transfer in self.transfers:
+            try:
+                transfer.cancel()
+            except self.usb1.USBError:
+                pass
+        while any(t.isSubmitted() for t in self.transfers):
+            try:
+                self.ctx.handleEventsTimeout(0.1)
+            except self.usb1.USBError:
+                break
+        self.transfers = []
+        try:
+            self.handle.releaseInterface(self.interface)
+        except self.usb1.USBError:
+            pass
+        self.handle.close()
+        self.handle = None
+
+    def read(self, size=1):
+        if self.timeout is not None:
+            deadline = time.time() + self.timeout
+        while len(self.rx) < size:
+            if self.timeout is None:
+                left = 1
+            else:
+                left = deadline - time.time()
+                if left <= 0 and self.timeout != 0:
+                    break
+            self.ctx.handleEventsTimeout(max(left, 0))
+            if self.timeout == 0:
+                break
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        return data
+
+    def write(self, data):
+        data = bytes(data)
+        for i in range(0, len(data), self.TX_CHUNK):
+            chunk = data[i:i + self.TX_CHUNK]
+            timeout = 0 if self.timeout is None else max(int(self.timeout * 1000), 1000)
+            self.handle.bulkWrite(self.ep_out, chunk, timeout)
+        return len(data)
+
+    def flushInput(self):
+        pass
+
+    def flushOutput(self):
+        pass
+
+class IOMUX_CH(IntEnum):
+    PROXY = 0
+    CONSOLE = 1
+
+class IOMuxChannel:
+    """Serial-like end of one iomux channel, see IOMux."""
+
+    def __init__(self, mux, chan):
+        self.mux = mux
+        self.chan = chan
+        self.timeout = None
+        self.rx = bytearray()
+        # bytes the target may still send us before we grant more
+        self.unacked = 0
+
+    def read(self, size=1):
+        if self.timeout is not None:
+            deadline = time.time() + self.timeout
+        while len(self.rx) < size:
+            if self.timeout is None:
+                self.mux.poll(1)
+                continue
+            self.mux.poll(max(deadline - time.time(), 0))
+            if time.time() >= deadline:
+                break
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        self.mux.consumed(self.chan, len(data))
+        return data
+
+    def write(self, data):
+        return self.mux.send(self.chan, bytes(data), self.timeout)
+
+    def flushInput(self):
+        self.mux.poll(0)
+        self.mux.consumed(self.chan, len(self.rx))
+        self.rx = bytearray()
+
+    def flushOutput(self):
+        pass
+
+class IOMux:
+    """
+    Host side of the framed iomux (src/iomux.h): demultiplexes one serial device into
+    IOMuxChannel objects and does the credit accounting. Channels with a handler (by default
+    the console, printed to stdout) get their data passed on as it arrives.
+    """
+    MAGIC = 0xa5
+    CREDIT = 0x80
+    MAX_PAYLOAD = 1024
+    HDR = struct.Struct("<BBHH")
+    # how much each channel may have in flight towards us
+    WINDOW = 0x10000
+
+    def __init__(self, dev, handlers=None):
+        self.dev = dev
+        self.rx = bytearray()
+        self.channels = {c: IOMuxChannel(self, c) for c in IOMUX_CH}
+        self.tx_credit = {c: 0 for c in IOMUX_CH}
+        self.handlers = {IOMUX_CH.CONSOLE: self._console}
+        self.handlers.update(handlers or {})
+        self.csum_errors = 0
+        for c in IOMUX_CH:
+            self._grant(c, self.WINDOW)
+
+    def channel(self, chan):
+        return self.channels[IOMUX_CH(chan)]
+
+    @staticmethod
+    def csum(chan, payload):
+        a = b = 0
+        for c in bytes([chan, len(payload) & 0xff, len(payload) >> 8]) + payload:
+            a = (a + c) % 255
+            b = (b + a) % 255
+        return (b << 8) | a
+
+    def _console(self, data):
+        sys.stdout.write(data.decode("utf-8", "replace"))
+        sys.stdout.flush()
+
+    def _frame(self, chan, payload):
+        hdr = self.HDR.pack(self.MAGIC, chan, len(payload), self.csum(chan, payload))
+        self.dev.write(hdr + payload)
+
+    def _grant(self, chan, size):
+        self._frame(chan | self.CREDIT, struct.pack("<I", size))
+
+    def consumed(self, chan, size):
+        ch = self.channels[chan]
+        ch.unacked += size
+        if ch.unacked >= self.WINDOW // 4:
+            self._grant(chan, ch.unacked)
+            ch.unacked = 0
+
+    def _dispatch(self, chan, payload):
+        c = chan & ~self.CREDIT
+        if c not in self.channels:
+            return
+        c = IOMUX_CH(c)
+        if chan & self.CREDIT:
+            self.tx_credit[c] += struct.unpack("<I", payload)[0]
+        elif c in self.handlers:
+            self.handlers[c](payload)
+            self.consumed(c, len(payload))
+        else:
+            self.channels[c].rx += payload
+
+    def poll(self, timeout=0):
+        """Read whatever arrives within timeout and dispatch complete frames."""
+        self.dev.timeout = timeout
+        data = self.dev.read(1)
+        if data:
+            self.dev.timeout = 0
+            data += self.dev.read(max(getattr(self.dev, "in_waiting", 0), 1))
+        self.rx += data
+
+        while True:
+            start = self.rx.find(self.MAGIC)
+            if start < 0:
+                self.rx.clear()
+                return
+            del self.rx[:start]
+            if len(self.rx) < self.HDR.size:
+                return
+            magic, chan, length, csum = self.HDR.unpack_from(self.rx)
+            if length > self.MAX_PAYLOAD:
+                del self.rx[:1]
+                continue
+            if len(self.rx) < self.HDR.size + length:
+                return
+            payload = bytes(self.rx[self.HDR.size:self.HDR.size + length])
+            if csum != self.csum(chan, payload):
+                self.csum_errors += 1
+                del self.rx[:1]
+                continue
+            del self.rx[:self.HDR.size + length]
+            self._dispatch(chan, payload)
+
+    def send(self, chan, data, timeout=None):
+        if timeout is not None:
+            deadline = time.time() + timeout
+        sent = 0
+        while sent < len(data):
+            self.poll(0)
+            block = min(len(data) - sent, self.tx_credit[chan], self.MAX_PAYLOAD)
+            if not block:
+                if timeout is not None and time.time() > deadline:
+                    raise UartTimeout(f"iomux: no credit on {chan!r}")
+                self.poll(0.01)
+                continue
+            self._frame(chan, data[sent:sent + block])
+            self.tx_credit[chan] -= block
+            sent += block
+        return sent
+
 class UartInterface(Reloadable):
     REQ_NOP = 0x00AA55FF
     REQ_PROXY = 0x01AA55FF
@@ -101,6 +395,7 @@ class UartInterface(Reloadable):
     REQ_MEMWRITE = 0x03AA55FF
     REQ_BOOT = 0x04AA55FF
     REQ_EVENT = 0x05AA55FF
+    REQ_GZWRITE = 0x06AA55FF
 
     CHECKSUM_SENTINEL = 0xD0DECADE
     DATA_END_SENTINEL = 0xB0CACC10
@@ -120,12 +415,16 @@ class UartInterface(Reloadable):
     if platform.system() == 'Darwin':
         DEFAULT_UART_DEV="/dev/cu.usbmodemP_01"
 
-    def __init__(self, device=None, debug=False):
+    def __init__(self, device=None, debug=False, data_device=None):
         self.debug = debug
         self.devpath = None
         if device is None:
             device = os.environ.get("M1N1DEVICE", self.DEFAULT_UART_DEV)
-        if isinstance(device, str):
+        if isinstance(device, str) and (device == "usb" or device.startswith("usb:")):
+            self.devpath = device
+            self.baudrate = None
+            device = UsbBulkDevice(device[4:] or None)
+        elif isinstance(device, str):
             baud = self.DEFAULT_BAUD_RATE
             if ":" in device:
                 device, baud = device.rsplit(":", 1)
@@ -144,6 +443,22 @@ class UartInterface(Reloadable):
         #while d != "":
             #d = self.dev.read(1)
         self.dev.timeout = int(os.environ.get("M1N1TIMEOUT", "3"))
+
+        # Optional bulk device for memory payloads, e.g. M1N1DATADEVICE=usb when the
+        # commands go over the CDC ACM tty of the same controller
+        if data_device is None:
+            data_device = os.environ.get("M1N1DATADEVICE", None)
+        if isinstance(data_device, str):
+            if data_device == "usb":
+                data_device = UsbBulkDevice(None)
+            elif data_device.startswith("usb:"):
+                data_device = UsbBulkDevice(data_device[4:] or None)
+            else:
+                raise ValueError(f"Unsupported data device {data_device!r}, "
+                                 "expected usb or usb:<serial>")
+        self.data_dev = data_device
+        if self.data_dev is not None:
+            self.data_dev.timeout = self.dev.timeout
         self.tty_enable = True
         self.handlers = {}
         self.evt_handlers = {}
@@ -164,10 +479,11 @@ class UartInterface(Reloadable):
 
         return self.checksum(data)
 
-    def readfull(self, size):
+    def readfull(self, size, dev=None):
+        dev = dev or self.dev
         d = b''
         while len(d) < size:
-            block = self.dev.read(size - len(d))
+            block = dev.read(size - len(d))
             if not block:
                 raise UartTimeout("Expected %d bytes, got %d bytes"%(size,len(d)))
             d += block
@@ -314,27 +630,44 @@ class UartInterface(Reloadable):
             return self.reply(self.REQ_BOOT)
         except:
             # Over USB, reboots cause a reconnect
-            self.dev.close()
-            print("Waiting for reconnection... ", end="")
+            self.reconnect()
+
+    def reconnect(self, data=True, delay=0):
+        self.dev.close()
+        if self.data_dev is not None:
+            self.data_dev.close()
+        time.sleep(delay)
+        devs = [self.dev]
+        if data and self.data_dev is not None:
+            devs.append(self.data_dev)
+        errors = (serial.serialutil.SerialException, OSError)
+        errors += tuple(d.usb1.USBError for d in devs if isinstance(d, UsbBulkDevice))
+        print("Waiting for reconnection... ", end="")
+        sys.stdout.flush()
+        for i in range(200):
+            print(".", end="")
             sys.stdout.flush()
-            for i in range(200):
-                print(".", end="")
-                sys.stdout.flush()
-                try:
-                    self.dev.open()
-                except serial.serialutil.SerialException:
-                    time.sleep(0.1)
-                else:
-                    break
+            try:
+                for dev in devs:
+                    if not dev.is_open:
+                        dev.open()
+            except errors:
+                # don't retry on top of a half open device
+                dev.close()
+                time.sleep(0.1)
             else:
-                raise UartTimeout("Reconnection timed out")
-            print(" Connected")
+                break
+        else:
+            raise UartTimeout("Reconnection timed out")
+        print(" Connected")
 
     def wait_and_handle_boot(self):
         self.handle_boot(self.wait_boot())
 
     def nop(self):
         features = Feature.get_all()
+        if self.data_dev is None:
+            features &= ~Feature.DATA_CHANNEL
 
         # Send the supported feature flags in the NOP message (has no effect
         # if the target does not support it)
@@ -350,6 +683,12 @@ class UartInterface(Reloadable):
 
         self.enabled_features = features
 
+    @property
+    def payload_dev(self):
+        if self.enabled_features & Feature.DATA_CHANNEL:
+            return self.data_dev
+        return self.dev
+
     def proxyreq(self, req, reboot=False, no_reply=False, pre_reply=None):
         self.cmd(self.REQ_PROXY, req)
         if pre_reply:
@@ -369,8 +708,9 @@ class UartInterface(Reloadable):
         if self.debug:
             print("<< DATA:")
             chexdump(data)
+        dev = self.payload_dev
         for i in range(0, len(data), 8192):
-            self.dev.write(data[i:i + 8192])
+            dev.write(data[i:i + 8192])
             if progress:
                 sys.stdout.write(".")
                 sys.stdout.flush()
@@ -378,11 +718,33 @@ class UartInterface(Reloadable):
             print()
         if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
             # Extra sentinel after the data to make sure no data is lost
-            self.dev.write(struct.pack("<I", self.DATA_END_SENTINEL))
+            dev.write(struct.pack("<I", self.DATA_END_SENTINEL))
 
         # should automatically report a CRC failure
         self.reply(self.REQ_MEMWRITE)
 
+    def gzwritemem(self, addr, payload, dest_size, progress=False):
+        """Write a gzip payload to memory, decompressing it as it arrives.
+
+        Returns the decompressed size.
+        """
+        checksum = self.data_checksum(payload)
+        req = struct.pack("<QQIIQ", addr, len(payload), checksum, 0, dest_size)
+        self.cmd(self.REQ_GZWRITE, req)
+        dev = self.payload_dev
+        for i in range(0, len(payload), 8192):
+            dev.write(payload[i:i + 8192])
+            if progress:
+                sys.stdout.write(".")
+                sys.stdout.flush()
+        if progress:
+            print()
+        if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
+            dev.write(struct.pack("<I", self.DATA_END_SENTINEL))
+
+        reply = self.reply(self.REQ_GZWRITE)
+        return struct.unpack("<IIQ", reply[:16])[2]
+
     def readmem(self, addr, size):
         if size == 0:
             return b""
@@ -391,7 +753,7 @@ class UartInterface(Reloadable):
         self.cmd(self.REQ_MEMREAD, req)
         reply = self.reply(self.REQ_MEMREAD)
         checksum = struct.unpack("<I",reply[:4])[0]
-        data = self.readfull(size)
+        data = self.readfull(size, self.payload_dev)
         if self.debug:
             print(">> DATA:")
             chexdump(data)
@@ -401,7 +763,7 @@ class UartInterface(Reloadable):
 
         if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
             # Extra sentinel after the data to make sure no data was lost
-            sentinel = struct.unpack("<I", self.readfull(4))[0]
+            sentinel = struct.unpack("<I", self.readfull(4, self.payload_dev))[0]
             if sentinel != self.DATA_END_SENTINEL:
                 raise UartChecksumError(f"Reply data sentinel error: Expected "
                     f"{self.DATA_END_SENTINEL:#x}, got {sentinel:#x}")
@@ -411,6 +773,88 @@ class UartInterface(Reloadable):
     def readstruct(self, addr, stype):
         return stype.parse(self.readmem(addr, stype.sizeof()))
 
+    # fastest first, anything the divider can't hit closely enough fails verification
+    AUTOBAUD_RATES = [3000000, 1500000, 1000000, 921600, 500000, 460800, 230400, 115200]
+    AUTOBAUD_PATTERN = 0x00ff55aa
+
+    def _proxy_call(self, opcode, *args, pre_reply=None):
+        args = list(args) + [0] * (6 - len(args))
+        reply = self.proxyreq(struct.pack("<7Q", opcode, *args), pre_reply=pre_reply)
+        rop, status, retval = struct.unpack("<Qqq", reply)
+        if rop != opcode or status != 0:
+            raise UartRemoteError(f"Proxy call 0x{opcode:x} failed ({status})")
+        return retval
+
+    def verify_baud(self, baudrate, count=64, timeout=0.5):
+        """Check that baudrate works both ways without switching to it.
+
+        The target sends count copies of a test pattern at baudrate, we send them back
+        inverted, and both sides return to the current rate for the reply.
+        """
+        pattern = struct.pack("<I", self.AUTOBAUD_PATTERN) * count
+        inverted = bytes(b ^ 0xff for b in pattern)
+        old_baud = self.dev.baudrate
+        host_ok = False
+
+        def exchange():
+            nonlocal host_ok
+            old_timeout = self.dev.timeout
+            self.dev.flush()
+            self.dev.baudrate = baudrate
+            # the target waits 50ms for us to switch before sending
+            self.dev.timeout = timeout + 0.05
+            try:
+                host_ok = self.readfull(len(pattern)) == pattern
+            except UartTimeout:
+                pass
+            if host_ok:
+                self.dev.write(inverted)
+                self.dev.flush()
+            self.dev.baudrate = old_baud
+            self.dev.timeout = old_timeout
+            self.dev.flushInput()
+
+        tty_enable = self.tty_enable
+        self.tty_enable = False
+        try:
+            ret = self._proxy_call(M1N1Proxy.P_SET_BAUD_VERIFY, baudrate, self.AUTOBAUD_PATTERN,
+                                   count, int(timeout * 1000000), pre_reply=exchange)
+        finally:
+            self.tty_enable = tty_enable
+
+        return host_ok and ret > 0
+
+    def autobaud(self, rates=None, count=64, timeout=0.5):
+        """Switch to the fastest rate in rates that passes verify_baud().
+
+        Candidates at or below the current rate are not tried, the current link already works.
+        Returns the rate in use afterwards.
+        """
+        if self.baudrate is None:
+            raise ValueError("autobaud needs a serial device")
+
+        for rate in sorted(rates or self.AUTOBAUD_RATES, reverse=True):
+            if rate <= self.baudrate:
+                break
+            if not self.verify_baud(rate, count, timeout):
+                if self.debug:
+                    print(f"autobaud: {rate} failed")
+                continue
+
+            def change():
+                self.dev.flush()
+                self.dev.baudrate = rate
+
+            self.tty_enable = False
+            try:
+                self._proxy_call(M1N1Proxy.P_SET_BAUD, rate, 16, 0x005aa5f0, pre_reply=change)
+            finally:
+                self.tty_enable = True
+            self.baudrate = rate
+            break
+
+        return self.baudrate
+
 class ProxyError(RuntimeError):
     pass
 
@@ -428,16 +872,39 @@ class AlignmentError(Exception):
 
 class IODEV(IntEnum):
     UART = 0
-    FB = 1
-    USB_VUART = 2
-    USB0 = 3
-    USB1 = 4
-    USB2 = 5
-    USB3 = 6
-    USB4 = 7
-    USB5 = 8
-    USB6 = 9
-    USB7 = 10
+    USB_VUART = 1
+    USB0 = 2
+    USB1 = 3
+    USB2 = 4
+    USB3 = 5
+    USB4 = 6
+    USB5 = 7
+    USB6 = 8
+    USB7 = 9
+    USB_BULK0 = 10
+    USB_BULK1 = 11
+    USB_BULK2 = 12
+    USB_BULK3 = 13
+    USB_BULK4 = 14
+    USB_BULK5 = 15
+    USB_BULK6 = 16
+    USB_BULK7 = 17
+    MUX_PROXY = 18
+    MUX_CONSOLE = 19
+
+class LOG(IntEnum):
+    USB = 0
+    IODEV = 1
+    ADT = 2
+    KBOOT = 3
+    PROXY = 4
+
+class LOG_LEVEL(IntEnum):
+    NONE = 0
+    ERR = 1
+    WARN = 2
+    INFO = 3
+    DEBUG = 4
 
 class USAGE(IntFlag):
     CONSOLE = (1 << 0)
@@ -479,6 +946,12 @@ class M1N1Proxy(Reloadable):
     P_REBOOT = 0x010
     P_SLEEP = 0x011
     P_EL3_CALL = 0x012
+    P_BLOG_GET_RING = 0x013
+    P_BLOG_SET_ECHO = 0x014
+    P_TRACE_GET_RING = 0x015
+    P_TRACE_SET_ENABLE = 0x016
+    P_LOG_SET_LEVEL = 0x017
+    P_SET_BAUD_VERIFY = 0x018
 
     P_WRITE64 = 0x100
     P_WRITE32 = 0x101
@@ -530,9 +1003,11 @@ class M1N1Proxy(Reloadable):
     P_MMU_DISABLE = 0x30d
     P_MMU_RESTORE = 0x30e
     P_MMU_INIT_SECONDARY = 0x30f
+    P_MMU_SET_DCACHE = 0x310
 
     P_XZDEC = 0x400
     P_GZDEC = 0x401
+    P_CHECKSUM = 0x402
 
     P_SMP_START_SECONDARIES = 0x500
     P_SMP_CALL = 0x501
@@ -571,6 +1046,17 @@ class M1N1Proxy(Reloadable):
     P_IODEV_WRITE = 0x904
     P_IODEV_WHOAMI = 0x905
     P_USB_IODEV_VUART_SETUP = 0x906
+    P_USB_GET_STATS = 0x907
+    P_USB_SOURCE_SINK = 0x908
+    P_USB_MSC_START = 0x909
+    P_USB_MSC_STOP = 0x90a
+    P_USB_MSC_STATUS = 0x90b
+    P_USB_SET_BUFFER_SIZE = 0x90c
+    P_IODEV_CONSOLE_DROPPED = 0x90d
+    P_IOMUX_START = 0x90e
+    P_IOMUX_GET_STATS = 0x90f
+    P_IODEV_CONSOLE_GET_RING = 0x910
+    P_IODEV_CONSOLE_RESIZE = 0x911
 
     P_TUNABLES_APPLY_GLOBAL = 0xa00
     P_TUNABLES_APPLY_LOCAL = 0xa01
@@ -642,7 +1128,7 @@ class M1N1Proxy(Reloadable):
         req = struct.pack("<7Q", opcode, *args)
         if self.debug:
             print("<<<< %08x: %08x %08x %08x %08x %08x %08x"%tuple([opcode] + args))
-        reply = self.iface.proxyreq(req, reboot=reboot, no_reply=no_reply, pre_reply=None)
+        reply = self.iface.proxyreq(req, reboot=reboot, no_reply=no_reply, pre_reply=pre_reply)
         if no_reply or reboot and reply is None:
             return
         ret_fmt = "q" if signed else "Q"
@@ -718,6 +1204,7 @@ class M1N1Proxy(Reloadable):
         self.iface.tty_enable = False
         def change():
             self.iface.dev.baudrate = baudrate
+            self.iface.baudrate = baudrate
         try:
             self.request(self.P_SET_BAUD, baudrate, 16, 0x005aa5f0, pre_reply=change)
         finally:
@@ -756,6 +1243,19 @@ class M1N1Proxy(Reloadable):
         if len(args) > 4:
             raise ValueError("Too many arguments")
         return self.request(self.P_EL3_CALL, addr, *args)
+    def blog_get_ring(self):
+        return self.request(self.P_BLOG_GET_RING)
+    def blog_set_echo(self, echo=True):
+        # format new binary log entries to the console from the proxy idle loop
+        self.request(self.P_BLOG_SET_ECHO, echo)
+    def trace_get_ring(self):
+        return self.request(self.P_TRACE_GET_RING)
+    def trace_set_enable(self, enable=True):
+        # enabling discards the previous trace
+        self.request(self.P_TRACE_SET_ENABLE, enable)
+    def log_set_level(self, subsys, level):
+        # returns the previous level, or -1 for an invalid subsystem or level
+        return self.request(self.P_LOG_SET_LEVEL, subsys, level, signed=True)
 
     def write64(self, addr, data):
         '''write 8 byte value to given address'''
@@ -932,6 +1432,8 @@ class M1N1Proxy(Reloadable):
         self.request(self.P_MMU_RESTORE, flags)
     def mmu_init_secondary(self, cpu):
         self.request(self.P_MMU_INIT_SECONDARY, cpu)
+    def mmu_set_dcache(self, enable):
+        return bool(self.request(self.P_MMU_SET_DCACHE, enable))
 
 
     def xzdec(self, inbuf, insize, outbuf=0, outsize=0):
@@ -941,6 +1443,8 @@ class M1N1Proxy(Reloadable):
     def gzdec(self, inbuf, insize, outbuf, outsize):
         return self.request(self.P_GZDEC, inbuf, insize, outbuf,
                             outsize, signed=True)
+    def checksum(self, addr, size):
+        return self.request(self.P_CHECKSUM, addr, size)
 
     def smp_start_secondaries(self):
         self.request(self.P_SMP_START_SECONDARIES)
@@ -1024,6 +1528,51 @@ class M1N1Proxy(Reloadable):
         return IODEV(self.request(self.P_IODEV_WHOAMI))
     def usb_iodev_vuart_setup(self, iodev):
         return self.request(self.P_USB_IODEV_VUART_SETUP, iodev)
+    def usb_get_stats(self, iodev, buf, size, reset=True):
+        return self.request(self.P_USB_GET_STATS, iodev, buf, size, reset)
+    def usb_source_sink(self, iodev, enable, stats_buf=0):
+        return self.request(self.P_USB_SOURCE_SINK, iodev, enable, stats_buf)
+    def usb_msc_start(self, iodev, base, size):
+        # The device re-enumerates with the mass-storage interface in place of the raw bulk
+        # one, which also drops our own connection if it is on the same controller.
+        if base % 64 or size % 64:
+            raise ValueError("MSC window must be 64 byte aligned")
+        self.request(self.P_USB_MSC_START, iodev, base, size, no_reply=True)
+        self.iface.reconnect(data=False, delay=0.5)
+        self.iface.nop()
+    def usb_msc_stop(self, iodev):
+        self.request(self.P_USB_MSC_STOP, iodev, no_reply=True)
+        self.iface.reconnect(delay=0.5)
+        self.iface.nop()
+    def usb_msc_status(self, iodev, buf, size):
+        return self.request(self.P_USB_MSC_STATUS, iodev, buf, size)
+    def usb_set_buffer_size(self, iodev, host2device=0, device2host=0):
+        # 0 keeps the current size; live buffers are reallocated keeping their contents
+        return self.request(self.P_USB_SET_BUFFER_SIZE, iodev, host2device, device2host,
+                            signed=True)
+
+    def iodev_console_dropped(self, iodev, reset=False):
+        # console bytes the iodev lost by falling too far behind
+        return self.request(self.P_IODEV_CONSOLE_DROPPED, iodev, reset)
+
+    def iomux_start(self, iodev=IODEV.UART, handlers=None):
+        """Switch iodev to the framed iomux and move this proxy session onto its proxy
+        channel. Returns the IOMux, whose other channels are then available as well."""
+        ret = self.request(self.P_IOMUX_START, iodev, signed=True)
+        if ret < 0:
+            raise ProxyRemoteError(f"iomux_start failed on {iodev!r}")
+        mux = IOMux(self.iface.dev, handlers)
+        proxy_chan = mux.channel(IOMUX_CH.PROXY)
+        proxy_chan.timeout = self.iface.dev.timeout
+        self.iface.dev = proxy_chan
+        self.iface.mux = mux
+        return mux
+    def iomux_get_stats(self, buf, reset=False):
+        return self.request(self.P_IOMUX_GET_STATS, buf, reset, signed=True)
+    def iodev_console_get_ring(self):
+        return self.request(self.P_IODEV_CONSOLE_GET_RING)
+    def iodev_console_resize(self, size):
+        return self.request(self.P_IODEV_CONSOLE_RESIZE, size, signed=True)
 
     def tunables_apply_global(self, path, prop):
         return self.request(self.P_TUNABLES_APPLY_GLOBAL, path, prop)
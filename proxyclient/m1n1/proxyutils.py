@@ -1,5 +1,5 @@
 # SPDX-License-Identifier: MIT
-import serial, os, struct, sys, time, json, os.path, gzip, functools
+import serial, os, re, struct, sys, time, json, os.path, gzip, functools
 from contextlib import contextmanager
 from construct import *
 
@@ -17,6 +17,90 @@ SIMD_S = Array(32, Array(4, Int32ul))
 SIMD_D = Array(32, Array(2, Int64ul))
 SIMD_Q = Array(32, BytesInteger(16, swapped=True))
 
+# struct usb_dwc2_stats, times are in 24MHz timer ticks
+USB_EP_STATS = Struct(
+    "bytes" / Int64ul,
+    "xfers" / Int32ul,
+    "short_pkts" / Int32ul,
+    "zlps" / Int32ul,
+    "ring_full" / Int32ul,
+    "rearm_gap_max" / Int32ul,
+    "rearm_count" / Int32ul,
+    "rearm_gap_total" / Int64ul,
+)
+
+USB_STATS = Struct(
+    "irq_ticks" / Int64ul,
+    "irq_count" / Int32ul,
+    "num_endpoints" / Int32ul,
+    "ep" / Array(this.num_endpoints, USB_EP_STATS),
+    # per pipe: proxy ACM, vuart ACM, raw bulk
+    "tx_dropped" / Array(3, Int64ul),
+)
+
+# struct usb_msc_status, lba_first > lba_last if nothing was written
+USB_MSC_STATUS = Struct(
+    "base" / Int64ul,
+    "size" / Int64ul,
+    "bytes_read" / Int64ul,
+    "bytes_written" / Int64ul,
+    "commands" / Int32ul,
+    "errors" / Int32ul,
+    "lba_first" / Int32ul,
+    "lba_last" / Int32ul,
+)
+
+# struct iomux_stats
+IOMUX_STATS = Struct(
+    "rx_frames" / Int64ul,
+    "tx_frames" / Int64ul,
+    "csum_errors" / Int32ul,
+    "bad_frames" / Int32ul,
+    "rx_overruns" / Int64ul,
+    "tx_stalls" / Int64ul,
+)
+
+# struct iodev_console_ring
+CONSOLE_RING_MAGIC = 0x534e4f43
+CONSOLE_RING = Struct(
+    "magic" / Int32ul,
+    "size" / Int32ul,
+    "wp" / Int64ul,
+    "buf" / Int64ul,
+)
+
+# struct blog_ring / struct blog_entry
+BLOG_MAGIC = 0x474f4c42
+BLOG_HEADER = Struct(
+    "magic" / Int32ul,
+    "entries" / Int32ul,
+    "head" / Int64ul,
+)
+BLOG_ENTRY = Struct(
+    "ticks" / Int64ul,
+    "fmt" / Int32ul,
+    "args" / Array(5, Int32ul),
+)
+
+# struct trace_ring / struct trace_event
+TRACE_MAGIC = 0x45435254
+TRACE_HEADER = Struct(
+    "magic" / Int32ul,
+    "entries" / Int32ul,
+    "head" / Int64ul,
+    "enabled" / Int32ul,
+    "hz" / Int32ul,
+)
+TRACE_EVENT = Struct(
+    "ticks" / Int64ul,
+    "name" / Int32ul,
+    "type" / Enum(Int16ul, BEGIN=0, END=1, INSTANT=2),
+    "flags" / FlagsEnum(Int16ul, IRQ=1),
+    "args" / Array(2, Int32ul),
+)
+
+BLOG_CONV = re.compile(r"%([-+ 0#]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l|z|j|t)?([diouxXpcs%])")
+
 # This isn't perfect, since multiple versions could have the same
 # iBoot version, but it's good enough
 VERSION_MAP = {
@@ -232,16 +316,30 @@ class ProxyUtils(Reloadable):
         payload = gzip.compress(data, compresslevel=1)
         compressed_size = len(payload)
 
-        with self.heap.guarded_malloc(compressed_size) as compressed_addr:
-            self.iface.writemem(compressed_addr, payload, progress)
-            timeout = self.iface.dev.timeout
-            self.iface.dev.timeout = None
-            try:
-                decompressed_size = self.proxy.gzdec(compressed_addr, compressed_size, dest, len(data))
-            finally:
-                self.iface.dev.timeout = timeout
+        # Older proxies don't know REQ_GZWRITE and would parse the payload as requests
+        if not self.iface.enabled_features & Feature.GZWRITE:
+            with self.heap.guarded_malloc(compressed_size) as compressed_addr:
+                self.iface.writemem(compressed_addr, payload, progress)
+                timeout = self.iface.dev.timeout
+                self.iface.dev.timeout = None
+                try:
+                    decompressed_size = self.proxy.gzdec(compressed_addr, compressed_size, dest,
+                                                         len(data))
+                finally:
+                    self.iface.dev.timeout = timeout
+
+                assert decompressed_size == len(data)
+            return
+
+        # Decompressed on the fly by the proxy, no staging buffer on the heap
+        timeout = self.iface.dev.timeout
+        self.iface.dev.timeout = None
+        try:
+            decompressed_size = self.iface.gzwritemem(dest, payload, len(data), progress)
+        finally:
+            self.iface.dev.timeout = timeout
 
-            assert decompressed_size == len(data)
+        assert decompressed_size == len(data)
 
     def get_adt(self):
         if self.adt_data is not None:
@@ -397,6 +495,165 @@ class ProxyUtils(Reloadable):
     def q(self):
         return self.get_simd(SIMD_Q)
 
+    def usb_stats(self, iodev=None, reset=True):
+        if iodev is None:
+            iodev = self.proxy.iodev_whoami()
+        size = 0x1000
+        buf = self.malloc(size)
+        try:
+            ret = self.proxy.usb_get_stats(iodev, buf, size, reset)
+            if ret < 0 or ret >= 0x80000000:
+                raise ProxyRemoteError(f"usb_get_stats failed for {iodev!r}")
+            return USB_STATS.parse(self.iface.readmem(buf, ret))
+        finally:
+            self.free(buf)
+
+    def usb_msc_status(self, iodev):
+        size = USB_MSC_STATUS.sizeof()
+        buf = self.malloc(size)
+        try:
+            ret = self.proxy.usb_msc_status(iodev, buf, size)
+            if ret < 0 or ret >= 0x80000000:
+                raise ProxyRemoteError(f"mass-storage mode is not active on {iodev!r}")
+            return USB_MSC_STATUS.parse(self.iface.readmem(buf, ret))
+        finally:
+            self.free(buf)
+
+    def iomux_stats(self, reset=False):
+        size = IOMUX_STATS.sizeof()
+        buf = self.malloc(size)
+        try:
+            if self.proxy.iomux_get_stats(buf, reset) < 0:
+                raise ProxyRemoteError("iomux is not active")
+            return IOMUX_STATS.parse(self.iface.readmem(buf, size))
+        finally:
+            self.free(buf)
+
+    def _console_ring(self, ring):
+        hdr = CONSOLE_RING.parse(self.iface.readmem(ring, CONSOLE_RING.sizeof()))
+        if hdr.magic != CONSOLE_RING_MAGIC:
+            raise ProxyError(f"bad console ring magic {hdr.magic:#x}")
+        return hdr
+
+    def console_read(self, since=None):
+        """Pull console output straight out of the target's console ring.
+
+        Returns (data, wp): the bytes written at or after position since (the oldest still in
+        the ring if None), and the position to pass as since next time.
+        """
+        ring = self.proxy.iodev_console_get_ring()
+        hdr = self._console_ring(ring)
+
+        start = max(since or 0, hdr.wp - hdr.size)
+        data = b""
+        pos = start
+        while pos < hdr.wp:
+            off = pos % hdr.size
+            block = min(hdr.wp - pos, hdr.size - off)
+            data += self.iface.readmem(hdr.buf + off, block)
+            pos += block
+
+        # output from IRQ context may have lapped the start while we were reading
+        lost = self._console_ring(ring).wp - hdr.size - start
+        if lost > 0:
+            data = data[lost:]
+
+        return data, hdr.wp
+
+    def console_pull_mode(self, enable=True):
+        """Stop (or resume) pushing console output over the proxy iodev.
+
+        With pull mode on, proxy replies no longer interleave with console output, which then
+        has to be fetched with console_read().
+        """
+        iodev = self.proxy.iodev_whoami()
+        usage = USAGE.UARTPROXY
+        if not enable:
+            usage |= USAGE.CONSOLE
+        self.proxy.iodev_set_usage(iodev, usage)
+
+    def _blog_string(self, addr, cache, limit=256):
+        if addr not in cache:
+            data = b""
+            try:
+                while b"\0" not in data and len(data) < limit:
+                    data += self.iface.readmem(addr + len(data), 64)
+            except Exception:
+                data = b"<bad string %#x>" % addr
+            cache[addr] = data.split(b"\0")[0].decode("ascii", "replace")
+        return cache[addr]
+
+    def _blog_format(self, fmt, args, cache):
+        args = iter(args)
+
+        def conv(m):
+            flags, width, prec, c = m.groups()
+            if c == "%":
+                return "%"
+            arg = next(args, 0)
+            spec = "%" + flags + width + ("." + prec if prec else "")
+            if c in "di":
+                return (spec + "d") % (arg - (1 << 32) if arg & 0x80000000 else arg)
+            if c == "u":
+                return (spec + "d") % arg
+            if c in "oxX":
+                return (spec + c) % arg
+            if c == "p":
+                return "0x%x" % arg
+            if c == "c":
+                return (spec + "c") % chr(arg & 0xff)
+            return (spec + "s") % self._blog_string(arg, cache)
+
+        return BLOG_CONV.sub(conv, fmt)
+
+    def blog_read(self, since=0):
+        """Decode the binary log: yields (index, ticks, text) for entries at or after since.
+
+        Format strings and %s arguments are read from target memory.
+        """
+        ring = self.proxy.blog_get_ring()
+        hdr = BLOG_HEADER.parse(self.iface.readmem(ring, BLOG_HEADER.sizeof()))
+        if hdr.magic != BLOG_MAGIC:
+            raise ProxyError(f"bad blog magic {hdr.magic:#x}")
+
+        esize = BLOG_ENTRY.sizeof()
+        data = self.iface.readmem(ring + BLOG_HEADER.sizeof(), hdr.entries * esize)
+        cache = {}
+        for index in range(max(since, hdr.head - hdr.entries), hdr.head):
+            slot = index % hdr.entries
+            e = BLOG_ENTRY.parse(data[slot * esize:(slot + 1) * esize])
+            fmt = self._blog_string(e.fmt, cache)
+            yield index, e.ticks, self._blog_format(fmt, e.args, cache)
+
+    def blog_dump(self, since=0):
+        """Print the binary log, returns the index to pass as since next time."""
+        index = since
+        for index, ticks, text in self.blog_read(since):
+            print(f"[{ticks}] {text}", end="" if text.endswith("\n") else "\n")
+            index += 1
+        return index
+
+    def trace_read(self):
+        """Read the tracepoint ring.
+
+        Returns (hz, events), oldest first, with event names resolved from target memory.
+        """
+        ring = self.proxy.trace_get_ring()
+        hdr = TRACE_HEADER.parse(self.iface.readmem(ring, TRACE_HEADER.sizeof()))
+        if hdr.magic != TRACE_MAGIC:
+            raise ProxyError(f"bad trace magic {hdr.magic:#x}")
+
+        esize = TRACE_EVENT.sizeof()
+        data = self.iface.readmem(ring + TRACE_HEADER.sizeof(), hdr.entries * esize)
+        cache = {}
+        events = []
+        for index in range(max(0, hdr.head - hdr.entries), hdr.head):
+            slot = index % hdr.entries
+            e = TRACE_EVENT.parse(data[slot * esize:(slot + 1) * esize])
+            e.name = self._blog_string(e.name, cache)
+            events.append(e)
+        return hdr.hz, events
+
     def get_version(self, v):
         if isinstance(v, bytes):
             v = v.split(b"\0")[0].decode("ascii")
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, argparse, json
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description="Convert the tracepoint ring to a Chrome trace "
+                                 "(load it in ui.perfetto.dev or chrome://tracing)")
+parser.add_argument("-s", "--start", action="store_true",
+                    help="start a new trace instead of dumping the current one")
+parser.add_argument("-S", "--stop", action="store_true", help="stop tracing after dumping")
+parser.add_argument("output", nargs="?", default="trace.json", type=pathlib.Path)
+args = parser.parse_args()
+
+from m1n1.setup import *
+
+if args.start:
+    p.trace_set_enable(True)
+    print("Tracing started")
+    sys.exit(0)
+
+hz, events = u.trace_read()
+if args.stop:
+    p.trace_set_enable(False)
+
+PH = {"BEGIN": "B", "END": "E", "INSTANT": "i"}
+
+trace = []
+for e in events:
+    ev = {
+        "name": e.name,
+        "ph": PH[str(e.type)],
+        "ts": e.ticks * 1000000 / hz,
+        "pid": 0,
+        # IRQ handlers get their own track, they interrupt the nesting of the foreground
+        "tid": 1 if e.flags.IRQ else 0,
+        "args": {"arg0": hex(e.args[0]), "arg1": hex(e.args[1])},
+    }
+    if ev["ph"] == "i":
+        ev["s"] = "t"
+    trace.append(ev)
+
+trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": 0, "args": {"name": "main"}})
+trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": 1, "args": {"name": "irq"}})
+
+with args.output.open("w") as f:
+    json.dump({"traceEvents": trace, "displayTimeUnit": "ns"}, f)
+
+print(f"Wrote {len(events)} events to {args.output}")
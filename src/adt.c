@@ -12,16 +12,9 @@
             return err;                                                                            \
     }
 
-// #define DEBUG
+#include "log.h"
 
-#ifdef DEBUG
-#include "utils.h"
-#define dprintf printf
-#else
-#define dprintf(...)                                                                               \
-    do {                                                                                           \
-    } while (0)
-#endif
+#define dprintf(...) log_debug(LOG_ADT, __VA_ARGS__)
 
 int _adt_check_node_offset(const void *adt, int offset)
 {
@@ -304,7 +297,7 @@ int adt_get_reg(const void *adt, int *path, const char *prop, int idx, uintptr_t
     get_cells(&addr, &reg, a_cells);
     get_cells(&size, &reg, s_cells);
 
-    dprintf(" addr=0x%lx size=0x%lx\n", addr, size);
+    dprintf(" addr=0x%llx size=0x%llx\n", addr, size);
 
     while (parent) {
         cur--;
@@ -334,12 +327,12 @@ int adt_get_reg(const void *adt, int *path, const char *prop, int idx, uintptr_t
             get_cells(&p_addr, &ranges, pa_cells);
             get_cells(&c_size, &ranges, s_cells);
 
-            dprintf(" ranges %lx %lx %lx\n", c_addr, p_addr, c_size);
+            dprintf(" ranges %llx %llx %llx\n", c_addr, p_addr, c_size);
 
             if (addr >= c_addr && (addr + size) <= (c_addr + c_size)) {
-                dprintf(" translate %lx", addr);
+                dprintf(" translate %llx", addr);
                 addr = addr - c_addr + p_addr;
-                dprintf(" -> %lx\n", addr);
+                dprintf(" -> %llx\n", addr);
                 break;
             }
         }
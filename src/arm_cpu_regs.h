@@ -40,6 +40,9 @@
 #define CPSR_I BIT(7)
 #define CPSR_F BIT(6)
 
+#define CPSR_MODE_MASK 0x1f
+#define CPSR_MODE_IRQ  0x12
+
 /*
  * Copyright (c) 2016-2024, Arm Limited and Contributors. All rights reserved.
  *
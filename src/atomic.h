@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include "types.h"
+
+/*
+ * Lock-free helpers for state shared with interrupt handlers or other cores. On the Cortex-A5
+ * the read-modify-write ones are LDREX/STREX loops and the _acquire/_release ones a plain
+ * access with a DMB on the right side. Like spin_lock(), the exclusive monitor needs Normal
+ * memory, so the read-modify-write helpers are only usable once the MMU is up.
+ */
+
+#define atomic_load(p)             __atomic_load_n(p, __ATOMIC_RELAXED)
+#define atomic_store(p, v)         __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define atomic_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static inline u32 atomic_add_return(u32 *p, u32 v)
+{
+    return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline u32 atomic_sub_return(u32 *p, u32 v)
+{
+    return __atomic_sub_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline u32 atomic_or(u32 *p, u32 v)
+{
+    return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline u32 atomic_and(u32 *p, u32 v)
+{
+    return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline u32 atomic_xchg(u32 *p, u32 v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+/* store new if *p is old, returns what *p was */
+static inline u32 atomic_cmpxchg(u32 *p, u32 old, u32 new)
+{
+    __atomic_compare_exchange_n(p, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return old;
+}
+
+#endif
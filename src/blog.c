@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "blog.h"
+#include "timer.h"
+#include "utils.h"
+
+struct blog_ring blog_ring = {
+    .magic = BLOG_MAGIC,
+    .entries = BLOG_ENTRIES,
+};
+
+static u64 blog_tail;
+static bool blog_echo;
+
+void blog_record(const char *fmt, u32 a0, u32 a1, u32 a2, u32 a3, u32 a4)
+{
+    u32 flags = irq_save();
+    struct blog_entry *e = &blog_ring.entry[blog_ring.head % BLOG_ENTRIES];
+
+    e->ticks = get_ticks();
+    e->fmt = (uintptr_t)fmt;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    e->args[2] = a2;
+    e->args[3] = a3;
+    e->args[4] = a4;
+    blog_ring.head++;
+    irq_restore(flags);
+}
+
+/* format entries recorded since the last call to the console, called from the idle loop */
+void blog_drain(void)
+{
+    if (!blog_echo || blog_tail == blog_ring.head)
+        return;
+
+    while (blog_tail != blog_ring.head) {
+        struct blog_entry e;
+
+        u32 flags = irq_save();
+        if (blog_ring.head - blog_tail > BLOG_ENTRIES) {
+            u64 lost = blog_ring.head - blog_tail - BLOG_ENTRIES;
+            blog_tail += lost;
+            irq_restore(flags);
+            printf("blog: %llu entries lost\n", lost);
+            continue;
+        }
+        e = blog_ring.entry[blog_tail++ % BLOG_ENTRIES];
+        irq_restore(flags);
+
+        printf("[%llu] ", e.ticks);
+        printf((const char *)e.fmt, e.args[0], e.args[1], e.args[2], e.args[3], e.args[4]);
+    }
+}
+
+void blog_set_echo(bool echo)
+{
+    // Only echo what gets recorded from now on
+    blog_tail = blog_ring.head;
+    blog_echo = echo;
+}
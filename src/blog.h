@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef BLOG_H
+#define BLOG_H
+
+#include "assert.h"
+#include "types.h"
+
+/*
+ * Binary log for paths too timing critical for printf: blog() only stores the format string
+ * pointer, a timestamp and up to BLOG_MAX_ARGS raw 32-bit arguments in a RAM ring. Formatting
+ * happens later, either in the proxy idle loop (see blog_set_echo()) or on the host, which
+ * reads the ring and the format strings through the proxy.
+ *
+ * Since the strings are only looked at later, the format must be a literal and %s arguments
+ * must point to strings that stay around. Every argument is stored and printed as a u32, so
+ * blog() refuses to build with more than BLOG_MAX_ARGS arguments, with wider arguments, or
+ * with a format that does not match them (%llx and friends).
+ */
+
+#define BLOG_MAGIC    0x474f4c42 // "BLOG"
+#define BLOG_ENTRIES  1024
+#define BLOG_MAX_ARGS 5
+
+/* layout shared with the proxyclient */
+struct blog_entry {
+    u64 ticks;
+    u32 fmt;
+    u32 args[BLOG_MAX_ARGS];
+} PACKED;
+
+struct blog_ring {
+    u32 magic;
+    u32 entries;
+    /* number of entries ever recorded, the newest one is at (head - 1) % entries */
+    u64 head;
+    struct blog_entry entry[BLOG_ENTRIES];
+} PACKED;
+
+extern struct blog_ring blog_ring;
+
+void blog_record(const char *fmt, u32 a0, u32 a1, u32 a2, u32 a3, u32 a4);
+void blog_drain(void);
+void blog_set_echo(bool echo);
+
+/* never called, only there for the compiler to check the format against the arguments */
+static inline void __attribute__((format(printf, 1, 2))) __blog_check(const char *fmt, ...)
+{
+    UNUSED(fmt);
+}
+
+/* counts up to 9 arguments, enough to catch going over BLOG_MAX_ARGS */
+#define __blog_nargs(...) __blog_nargs_(, ##__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __blog_nargs_(_, a0, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+
+#define __blog_arg(a)                                                                              \
+    ({                                                                                             \
+        static_assert(sizeof(a) <= sizeof(u32), "blog() arguments must fit in 32 bits");           \
+        (u32)(uintptr_t)(a);                                                                       \
+    })
+#define __blog(fmt, a0, a1, a2, a3, a4, ...)                                                       \
+    blog_record(fmt, __blog_arg(a0), __blog_arg(a1), __blog_arg(a2), __blog_arg(a3),               \
+                __blog_arg(a4))
+#define blog(fmt, ...)                                                                             \
+    do {                                                                                           \
+        static_assert(__blog_nargs(__VA_ARGS__) <= BLOG_MAX_ARGS, "too many blog() arguments");    \
+        _Pragma("GCC diagnostic push");                                                            \
+        _Pragma("GCC diagnostic error \"-Wformat\"");                                              \
+        if (0)                                                                                     \
+            __blog_check("" fmt, ##__VA_ARGS__);                                                   \
+        _Pragma("GCC diagnostic pop");                                                             \
+        __blog("" fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0);                                              \
+    } while (0)
+
+#endif
@@ -21,7 +21,6 @@ void exc_handler(u32 *regs, u32 spsr, int type)
         case EXC_TYPE_DATA_ABORT:
             pc = regs[15] - 4;
             break;
-        case EXC_TYPE_IRQ:
         case EXC_TYPE_FIQ:
             pc = regs[15] - 8;
             break;
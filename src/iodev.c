@@ -1,20 +1,16 @@
 /* SPDX-License-Identifier: MIT */
 
-// #define DEBUG_IODEV
-
 #include "iodev.h"
+#include "log.h"
+#include "malloc.h"
 #include "memory.h"
 #include "string.h"
 
-#ifdef DEBUG_IODEV
-#define dprintf printf
-#else
-#define dprintf(...)                                                                               \
-    do {                                                                                           \
-    } while (0)
-#endif
+#define dprintf(...) log_debug(LOG_IODEV, __VA_ARGS__)
 
-#define CONSOLE_BUFFER_SIZE 8192
+#define CONSOLE_BUFFER_SIZE 65536
+#define CONSOLE_MIN_SIZE    4096
+#define CONSOLE_MAX_SIZE    (16 * 1024 * 1024)
 
 extern struct iodev iodev_uart;
 extern struct iodev iodev_log;
@@ -26,9 +22,21 @@ struct iodev *iodevs[IODEV_NUM] = {
     [IODEV_LOG] = &iodev_log,
 };
 
-char con_buf[CONSOLE_BUFFER_SIZE];
-size_t con_wp;
-size_t con_rp[IODEV_NUM];
+/* boot-time console buffer, iodev_console_resize() moves the ring to the heap */
+static char con_static_buf[CONSOLE_BUFFER_SIZE];
+static char *con_buf = con_static_buf;
+
+static struct iodev_console_ring con_ring = {
+    .magic = CONSOLE_RING_MAGIC,
+    .size = CONSOLE_BUFFER_SIZE,
+};
+
+#define con_wp   con_ring.wp
+#define con_size con_ring.size
+
+static u64 con_rp[IODEV_NUM];
+/* console bytes a device lost because it fell more than a whole con_buf behind */
+static u64 con_dropped[IODEV_NUM];
 
 void iodev_register_device(iodev_id_t id, struct iodev *dev)
 {
@@ -52,11 +60,9 @@ ssize_t iodev_can_read(iodev_id_t id)
     if (!iodevs[id] || !iodevs[id]->ops->can_read)
         return 0;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     ssize_t ret = iodevs[id]->ops->can_read(iodevs[id]->opaque);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
     return ret;
 }
 
@@ -65,11 +71,9 @@ bool iodev_can_write(iodev_id_t id)
     if (!iodevs[id] || !iodevs[id]->ops->can_write)
         return false;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     bool ret = iodevs[id]->ops->can_write(iodevs[id]->opaque);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
     return ret;
 }
 
@@ -78,11 +82,9 @@ ssize_t iodev_read(iodev_id_t id, void *buf, size_t length)
     if (!iodevs[id] || !iodevs[id]->ops->read)
         return -1;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     ssize_t ret = iodevs[id]->ops->read(iodevs[id]->opaque, buf, length);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
     return ret;
 }
 
@@ -91,11 +93,54 @@ ssize_t iodev_write(iodev_id_t id, const void *buf, size_t length)
     if (!iodevs[id] || !iodevs[id]->ops->write)
         return -1;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     ssize_t ret = iodevs[id]->ops->write(iodevs[id]->opaque, buf, length);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
+    return ret;
+}
+
+/* Write what the device takes without blocking, devices that can't do that take nothing */
+ssize_t iodev_try_write(iodev_id_t id, const void *buf, size_t length)
+{
+    if (!iodevs[id])
+        return -1;
+    if (!iodevs[id]->ops->try_write)
+        return 0;
+
+    spin_lock(&iodevs[id]->lock);
+    ssize_t ret = iodevs[id]->ops->try_write(iodevs[id]->opaque, buf, length);
+    spin_unlock(&iodevs[id]->lock);
+    return ret;
+}
+
+/*
+ * Write all segments as one unit: nothing else gets between them on the device. Drivers
+ * without writev get the segments queued one by one, with the last one written.
+ */
+ssize_t iodev_writev(iodev_id_t id, const struct iodev_iov *iov, int iovcnt)
+{
+    if (!iodevs[id] || iovcnt <= 0)
+        return -1;
+
+    spin_lock(&iodevs[id]->lock);
+
+    ssize_t ret = 0;
+    if (iodevs[id]->ops->writev) {
+        ret = iodevs[id]->ops->writev(iodevs[id]->opaque, iov, iovcnt);
+    } else {
+        for (int i = 0; i < iovcnt && ret >= 0; i++) {
+            ssize_t wrote;
+
+            if (i < iovcnt - 1)
+                wrote = iodev_queue(id, iov[i].buf, iov[i].len);
+            else
+                wrote = iodev_write(id, iov[i].buf, iov[i].len);
+
+            ret = wrote < 0 ? wrote : ret + wrote;
+        }
+    }
+
+    spin_unlock(&iodevs[id]->lock);
     return ret;
 }
 
@@ -104,11 +149,9 @@ ssize_t iodev_queue(iodev_id_t id, const void *buf, size_t length)
     if (!iodevs[id] || !iodevs[id]->ops->queue)
         return iodev_write(id, buf, length);
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     ssize_t ret = iodevs[id]->ops->queue(iodevs[id]->opaque, buf, length);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
     return ret;
 }
 
@@ -117,11 +160,9 @@ void iodev_flush(iodev_id_t id)
     if (!iodevs[id] || !iodevs[id]->ops->flush)
         return;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
     iodevs[id]->ops->flush(iodevs[id]->opaque);
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
 }
 
 void iodev_lock(iodev_id_t id)
@@ -129,8 +170,7 @@ void iodev_lock(iodev_id_t id)
     if (!iodevs[id])
         return;
 
-    if (mmu_active())
-        spin_lock(&iodevs[id]->lock);
+    spin_lock(&iodevs[id]->lock);
 }
 
 void iodev_unlock(iodev_id_t id)
@@ -138,122 +178,114 @@ void iodev_unlock(iodev_id_t id)
     if (!iodevs[id])
         return;
 
-    if (mmu_active())
-        spin_unlock(&iodevs[id]->lock);
+    spin_unlock(&iodevs[id]->lock);
 }
 
 int in_iodev = 0;
 
 static DECLARE_SPINLOCK(console_lock);
 
-void iodev_console_write(const void *buf, size_t length)
+/*
+ * Feed pending console output to the console devices. Unless sync is set this only hands each
+ * device what it takes without blocking, a device that falls more than a whole buffer behind
+ * loses the oldest output and has it accounted in con_dropped. Called with the console lock
+ * held and in_iodev raised.
+ */
+static void iodev_console_drain(bool sync)
 {
-    bool do_lock = mmu_active();
-
-    if (!do_lock && !is_boot_cpu()) {
-        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "*", 1);
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
-        }
-        return;
-    }
-
-    if (do_lock)
-        spin_lock(&console_lock);
-
-    if (in_iodev) {
-        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "+", 1);
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
-        }
-        if (do_lock)
-            spin_unlock(&console_lock);
-        return;
-    }
-    in_iodev++;
-
-    dprintf("  iodev_console_write() wp=%d\n", con_wp);
     for (iodev_id_t id = 0; id < IODEV_NUM; id++) {
         if (!iodevs[id])
             continue;
 
         if (!(iodevs[id]->usage & USAGE_CONSOLE)) {
             /* Drop buffer */
-            con_rp[id] = con_wp + length;
+            con_rp[id] = con_wp;
             continue;
         }
 
-        if (!iodev_can_write(id))
+        if (con_wp - con_rp[id] > con_size) {
+            con_dropped[id] += con_wp - con_rp[id] - con_size;
+            con_rp[id] = con_wp - con_size;
+        }
+
+        /* devices that can only block are left to iodev_console_kick() and _flush() */
+        if (!sync && !iodevs[id]->ops->try_write)
             continue;
 
-        if (con_wp > CONSOLE_BUFFER_SIZE)
-            con_rp[id] = max(con_wp - CONSOLE_BUFFER_SIZE, con_rp[id]);
+        if (!iodev_can_write(id))
+            continue;
 
-        dprintf("  rp=%d\n", con_rp[id]);
-        // Flush existing buffer to device if possible
+        dprintf("  rp=%llu\n", con_rp[id]);
         while (con_rp[id] < con_wp) {
-            size_t buf_rp = con_rp[id] % CONSOLE_BUFFER_SIZE;
-            size_t block = min(con_wp - con_rp[id], CONSOLE_BUFFER_SIZE - buf_rp);
+            size_t buf_rp = con_rp[id] % con_size;
+            size_t block = min(con_wp - con_rp[id], (u64)(con_size - buf_rp));
 
             dprintf("  write buf %d\n", block);
-            ssize_t ret = iodev_write(id, &con_buf[buf_rp], block);
+            ssize_t ret = sync ? iodev_write(id, &con_buf[buf_rp], block)
+                               : iodev_try_write(id, &con_buf[buf_rp], block);
 
             if (ret <= 0)
-                goto next_dev;
+                break;
 
             con_rp[id] += ret;
         }
+    }
+}
 
-        const u8 *p = buf;
-        size_t wrote = 0;
-
-        // Write the current buffer
-        while (wrote < length) {
-            ssize_t ret = iodev_write(id, p, length - wrote);
+void iodev_console_write(const void *buf, size_t length)
+{
+    if (!mmu_active() && !is_boot_cpu()) {
+        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "*", 1);
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
+        }
+        return;
+    }
 
-            if (ret <= 0)
-                goto next_dev;
+    /* IRQs stay off so output from the IRQ vector can't tear the ring update */
+    u32 flags = spin_lock_irqsave(&console_lock);
 
-            con_rp[id] += ret;
-            wrote += ret;
-            p += ret;
+    if (in_iodev) {
+        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "+", 1);
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
         }
-
-    next_dev:;
+        spin_unlock_irqrestore(&console_lock, flags);
+        return;
     }
+    in_iodev++;
+
+    dprintf("  iodev_console_write() wp=%llu\n", con_wp);
 
-    // Update console buffer
+    // Output only goes into the console buffer, devices are fed as they can take it
 
-    if (length > CONSOLE_BUFFER_SIZE) {
-        buf += (length - CONSOLE_BUFFER_SIZE);
-        con_wp += (length - CONSOLE_BUFFER_SIZE);
-        length = CONSOLE_BUFFER_SIZE;
+    if (length > con_size) {
+        buf += (length - con_size);
+        con_wp += (length - con_size);
+        length = con_size;
     }
 
     while (length) {
-        size_t buf_wp = con_wp % CONSOLE_BUFFER_SIZE;
-        size_t block = min(length, CONSOLE_BUFFER_SIZE - buf_wp);
+        size_t buf_wp = con_wp % con_size;
+        size_t block = min(length, con_size - buf_wp);
         memcpy(&con_buf[buf_wp], buf, block);
         buf += block;
         con_wp += block;
         length -= block;
     }
 
+    iodev_console_drain(false);
+
     in_iodev--;
-    if (do_lock)
-        spin_unlock(&console_lock);
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void iodev_handle_events(iodev_id_t id)
 {
-    bool do_lock = mmu_active();
-
-    if (do_lock)
-        spin_lock(&console_lock);
+    spin_lock(&console_lock);
 
     if (in_iodev) {
-        if (do_lock)
-            spin_unlock(&console_lock);
+        spin_unlock(&console_lock);
         return;
     }
 
@@ -267,13 +299,26 @@ void iodev_handle_events(iodev_id_t id)
     if (iodev_can_write(id))
         iodev_console_write(NULL, 0);
 
-    if (do_lock)
-        spin_unlock(&console_lock);
+    spin_unlock(&console_lock);
+}
+
+/* blocking drain, for the foreground only */
+static void iodev_console_sync(void)
+{
+    spin_lock(&console_lock);
+
+    if (!in_iodev) {
+        in_iodev++;
+        iodev_console_drain(true);
+        in_iodev--;
+    }
+
+    spin_unlock(&console_lock);
 }
 
 void iodev_console_kick(void)
 {
-    iodev_console_write(NULL, 0);
+    iodev_console_sync();
 
     for (iodev_id_t id = 0; id < IODEV_NUM; id++) {
         if (!iodevs[id])
@@ -285,8 +330,11 @@ void iodev_console_kick(void)
     }
 }
 
+/* Synchronously push out all pending console output, for panics and before reboot */
 void iodev_console_flush(void)
 {
+    iodev_console_sync();
+
     for (iodev_id_t id = 0; id < IODEV_NUM; id++) {
         if (!iodevs[id])
             continue;
@@ -297,6 +345,64 @@ void iodev_console_flush(void)
     }
 }
 
+/* the host pulls console output from here with readmem() */
+struct iodev_console_ring *iodev_console_get_ring(void)
+{
+    con_ring.buf = (uintptr_t)con_buf;
+    return &con_ring;
+}
+
+/* move the console ring to a new buffer of size bytes, keeping as much recent output as fits */
+int iodev_console_resize(size_t size)
+{
+    if (size < CONSOLE_MIN_SIZE || size > CONSOLE_MAX_SIZE)
+        return -1;
+
+    char *new_buf = malloc(size);
+    if (!new_buf)
+        return -1;
+
+    /* console output from the IRQ vector must not land in the old buffer mid copy */
+    u32 flags = spin_lock_irqsave(&console_lock);
+
+    char *old_buf = con_buf;
+    u32 old_size = con_size;
+    u64 keep = min(con_wp, (u64)min(size, old_size));
+
+    /* positions stay the same, so at most three spans: either ring may wrap once */
+    for (u64 pos = con_wp - keep; pos < con_wp;) {
+        size_t src = pos % old_size;
+        size_t dst = pos % size;
+        size_t block = min(con_wp - pos, (u64)min(old_size - src, size - dst));
+
+        memcpy(&new_buf[dst], &old_buf[src], block);
+        pos += block;
+    }
+
+    con_buf = new_buf;
+    con_ring.buf = (uintptr_t)new_buf;
+    con_size = size;
+
+    spin_unlock_irqrestore(&console_lock, flags);
+
+    if (old_buf != con_static_buf)
+        free(old_buf);
+
+    return 0;
+}
+
+u64 iodev_console_dropped(iodev_id_t id, bool reset)
+{
+    if (id >= IODEV_NUM)
+        return 0;
+
+    u64 dropped = con_dropped[id];
+    if (reset)
+        con_dropped[id] = 0;
+
+    return dropped;
+}
+
 void iodev_set_usage(iodev_id_t id, iodev_usage_t usage)
 {
     if (iodevs[id])
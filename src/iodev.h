@@ -7,12 +7,15 @@
 #include "utils.h"
 
 #define USB_IODEV_COUNT 8
+#define IOMUX_CHANNELS  2
 
 typedef enum _iodev_id_t {
     IODEV_UART,
     IODEV_USB_VUART,
     IODEV_USB0,
-    IODEV_MAX = IODEV_USB0 + USB_IODEV_COUNT,
+    IODEV_USB_BULK0 = IODEV_USB0 + USB_IODEV_COUNT,
+    IODEV_MUX0 = IODEV_USB_BULK0 + USB_IODEV_COUNT, // logical channels of the iomux
+    IODEV_MAX = IODEV_MUX0 + IOMUX_CHANNELS,
     IODEV_LOG = IODEV_MAX, // hidden log buffer iodev
     IODEV_NUM,
 } iodev_id_t;
@@ -22,12 +25,25 @@ typedef enum _iodev_usage_t {
     USAGE_UARTPROXY = BIT(1),
 } iodev_usage_t;
 
+/* one segment of a vectored write */
+struct iodev_iov {
+    const void *buf;
+    size_t len;
+};
+
 struct iodev_ops {
     ssize_t (*can_read)(void *opaque);
     bool (*can_write)(void *opaque);
     ssize_t (*read)(void *opaque, void *buf, size_t length);
     ssize_t (*write)(void *opaque, const void *buf, size_t length);
+    /*
+     * optional, like write but returns early instead of waiting for the device. Console devices
+     * without it only get output from iodev_console_kick() and iodev_console_flush().
+     */
+    ssize_t (*try_write)(void *opaque, const void *buf, size_t length);
     ssize_t (*queue)(void *opaque, const void *buf, size_t length);
+    /* optional, queues all segments and then starts the device like write */
+    ssize_t (*writev)(void *opaque, const struct iodev_iov *iov, int iovcnt);
     void (*flush)(void *opaque);
     void (*handle_events)(void *opaque);
 };
@@ -47,15 +63,31 @@ ssize_t iodev_can_read(iodev_id_t id);
 bool iodev_can_write(iodev_id_t id);
 ssize_t iodev_read(iodev_id_t id, void *buf, size_t length);
 ssize_t iodev_write(iodev_id_t id, const void *buf, size_t length);
+ssize_t iodev_try_write(iodev_id_t id, const void *buf, size_t length);
 ssize_t iodev_queue(iodev_id_t id, const void *buf, size_t length);
+ssize_t iodev_writev(iodev_id_t id, const struct iodev_iov *iov, int iovcnt);
 void iodev_flush(iodev_id_t id);
 void iodev_handle_events(iodev_id_t id);
 void iodev_lock(iodev_id_t id);
 void iodev_unlock(iodev_id_t id);
 
+#define CONSOLE_RING_MAGIC 0x534e4f43 // "CONS"
+
+/* console ring header, layout shared with the proxyclient */
+struct iodev_console_ring {
+    u32 magic;
+    u32 size;
+    /* bytes ever written, the newest one is at buf[(wp - 1) % size] */
+    u64 wp;
+    u64 buf;
+} PACKED;
+
 void iodev_console_write(const void *buf, size_t length);
 void iodev_console_kick(void);
 void iodev_console_flush(void);
+u64 iodev_console_dropped(iodev_id_t id, bool reset);
+struct iodev_console_ring *iodev_console_get_ring(void);
+int iodev_console_resize(size_t size);
 
 iodev_usage_t iodev_get_usage(iodev_id_t id);
 void iodev_set_usage(iodev_id_t id, iodev_usage_t usage);
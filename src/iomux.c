@@ -0,0 +1,459 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "iomux.h"
+#include "assert.h"
+#include "ringbuffer.h"
+#include "string.h"
+#include "timer.h"
+#include "utils.h"
+
+static_assert(IOMUX_CH_MAX == IOMUX_CHANNELS, "iomux channel count mismatch");
+static_assert(sizeof(struct iomux_hdr) == 6, "Invalid iomux_hdr size");
+
+/* host to device buffering; channels without one are output only and drop what they get */
+static const size_t iomux_rx_size[IOMUX_CH_MAX] = {
+    [IOMUX_CH_PROXY] = 16384,
+};
+
+/* complete frames waiting for phys, room for a few full size ones */
+#define IOMUX_TX_SIZE 8192
+
+/* how long a blocking write waits for credit from the host before it gives up */
+#define IOMUX_TX_TIMEOUT_MS 1000
+
+static const iodev_usage_t iomux_usage[IOMUX_CH_MAX] = {
+    [IOMUX_CH_PROXY] = USAGE_UARTPROXY,
+    [IOMUX_CH_CONSOLE] = USAGE_CONSOLE,
+};
+
+struct iomux_chan {
+    u8 id;
+    ringbuffer_t *rx;
+    /* payload bytes the host still accepts on this channel */
+    u32 tx_credit;
+    /* bytes read from rx since the last grant, the first grant is the whole ring */
+    u32 rx_consumed;
+    struct iodev iodev;
+};
+
+static struct {
+    bool active;
+    /* some context is reading or writing phys, everybody else only queues frames */
+    bool busy;
+    iodev_id_t phys;
+    iodev_usage_t phys_usage;
+    struct iomux_chan chan[IOMUX_CH_MAX];
+    struct iomux_stats stats;
+    ringbuffer_t *tx;
+    size_t rx_len;
+    u8 rx_buf[sizeof(struct iomux_hdr) + IOMUX_MAX_PAYLOAD] ALIGNED(4);
+} iomux;
+
+static u16 iomux_csum(const struct iomux_hdr *hdr, const u8 *data)
+{
+    u32 a = 0, b = 0;
+    u8 head[3] = {hdr->chan, hdr->len, hdr->len >> 8};
+
+    for (size_t i = 0; i < sizeof(head); i++) {
+        a = (a + head[i]) % 255;
+        b = (b + a) % 255;
+    }
+    for (size_t i = 0; i < hdr->len; i++) {
+        a = (a + data[i]) % 255;
+        b = (b + a) % 255;
+    }
+
+    return (b << 8) | a;
+}
+
+/*
+ * Queue a whole frame for phys, or nothing if it does not fit. Called with IRQs masked, so
+ * frames from the IRQ vector never end up in the middle of another one.
+ */
+static bool iomux_queue_frame(u8 chan, const void *data, u16 len)
+{
+    struct iomux_hdr hdr = {IOMUX_MAGIC, chan, len, 0};
+
+    if (ringbuffer_get_free(iomux.tx) < sizeof(hdr) + len)
+        return false;
+
+    hdr.csum = iomux_csum(&hdr, data);
+    ringbuffer_write((const u8 *)&hdr, sizeof(hdr), iomux.tx);
+    ringbuffer_write(data, len, iomux.tx);
+    iomux.stats.tx_frames++;
+    return true;
+}
+
+static bool iomux_get_phys(void)
+{
+    u32 flags = irq_save();
+    bool got = !iomux.busy;
+    iomux.busy = true;
+    irq_restore(flags);
+
+    return got;
+}
+
+/*
+ * Write out the queued frames with IRQs enabled and let go of phys. Frames the IRQ vector
+ * queues meanwhile are picked up before the release.
+ */
+static void iomux_put_phys(void)
+{
+    const u8 *data;
+    size_t len;
+
+    while (true) {
+        while ((len = ringbuffer_peek(iomux.tx, &data))) {
+            iodev_write(iomux.phys, data, len);
+            ringbuffer_consume(iomux.tx, len);
+        }
+
+        u32 flags = irq_save();
+        if (!ringbuffer_get_used(iomux.tx)) {
+            iomux.busy = false;
+            irq_restore(flags);
+            return;
+        }
+        irq_restore(flags);
+    }
+}
+
+/* write out the queued frames unless some other context already owns phys */
+static void iomux_kick(void)
+{
+    if (iomux_get_phys())
+        iomux_put_phys();
+}
+
+static void iomux_dispatch(const struct iomux_hdr *hdr, const u8 *data)
+{
+    u8 id = hdr->chan & ~IOMUX_CREDIT;
+
+    if (id >= IOMUX_CH_MAX) {
+        iomux.stats.bad_frames++;
+        return;
+    }
+
+    struct iomux_chan *ch = &iomux.chan[id];
+    iomux.stats.rx_frames++;
+
+    if (hdr->chan & IOMUX_CREDIT) {
+        u32 credit;
+
+        if (hdr->len != sizeof(credit)) {
+            iomux.stats.bad_frames++;
+            return;
+        }
+        memcpy(&credit, data, sizeof(credit));
+        ch->tx_credit += credit;
+        return;
+    }
+
+    size_t wrote = ch->rx ? ringbuffer_write(data, hdr->len, ch->rx) : 0;
+    iomux.stats.rx_overruns += hdr->len - wrote;
+}
+
+/* drop skip bytes and everything up to the next possible frame start */
+static void iomux_resync(size_t skip)
+{
+    u8 *next = memchr(iomux.rx_buf + skip, IOMUX_MAGIC, iomux.rx_len - skip);
+
+    if (!next) {
+        iomux.rx_len = 0;
+        return;
+    }
+
+    iomux.rx_len -= next - iomux.rx_buf;
+    memmove(iomux.rx_buf, next, iomux.rx_len);
+}
+
+static void iomux_parse(void)
+{
+    const struct iomux_hdr *hdr = (void *)iomux.rx_buf;
+
+    while (iomux.rx_len) {
+        if (hdr->magic != IOMUX_MAGIC) {
+            iomux_resync(1);
+            continue;
+        }
+        if (iomux.rx_len < sizeof(*hdr))
+            return;
+        if (hdr->len > IOMUX_MAX_PAYLOAD) {
+            iomux.stats.bad_frames++;
+            iomux_resync(1);
+            continue;
+        }
+
+        size_t size = sizeof(*hdr) + hdr->len;
+        if (iomux.rx_len < size)
+            return;
+
+        if (iomux_csum(hdr, iomux.rx_buf + sizeof(*hdr)) != hdr->csum) {
+            iomux.stats.csum_errors++;
+            iomux_resync(1);
+            continue;
+        }
+
+        iomux_dispatch(hdr, iomux.rx_buf + sizeof(*hdr));
+        iomux.rx_len -= size;
+        memmove(iomux.rx_buf, iomux.rx_buf + size, iomux.rx_len);
+    }
+}
+
+/* bytes needed to complete the header or frame at the start of rx_buf */
+static size_t iomux_rx_want(void)
+{
+    const struct iomux_hdr *hdr = (void *)iomux.rx_buf;
+
+    if (iomux.rx_len < sizeof(*hdr))
+        return sizeof(*hdr) - iomux.rx_len;
+
+    return sizeof(*hdr) + hdr->len - iomux.rx_len;
+}
+
+/* take in whatever the physical device has and hand out credit for drained rings */
+static void iomux_poll(void)
+{
+    ssize_t avail;
+
+    /* console output from the IRQ vector must not parse under the interrupted poll */
+    if (!iomux_get_phys())
+        return;
+
+    while ((avail = iodev_can_read(iomux.phys)) > 0) {
+        size_t want = min((size_t)avail, iomux_rx_want());
+        ssize_t got = iodev_read(iomux.phys, iomux.rx_buf + iomux.rx_len, want);
+
+        if (got <= 0)
+            break;
+
+        iomux.rx_len += got;
+        iomux_parse();
+    }
+
+    for (int i = 0; i < IOMUX_CH_MAX; i++) {
+        struct iomux_chan *ch = &iomux.chan[i];
+
+        if (!ch->rx || ch->rx_consumed < ch->rx->len / 4)
+            continue;
+
+        u32 credit = ch->rx_consumed;
+        u32 flags = irq_save();
+        if (iomux_queue_frame(i | IOMUX_CREDIT, &credit, sizeof(credit)))
+            ch->rx_consumed = 0;
+        irq_restore(flags);
+    }
+
+    iomux_put_phys();
+}
+
+/*
+ * Send as much of buf as the host has credit for and the TX queue takes. With wait set, keep
+ * waiting for more until the host has granted nothing for IOMUX_TX_TIMEOUT_MS.
+ */
+static size_t iomux_send(struct iomux_chan *ch, const u8 *buf, size_t len, bool wait)
+{
+    u64 timeout = (u64)IOMUX_TX_TIMEOUT_MS * get_hz() / 1000;
+    u64 deadline = get_ticks() + timeout;
+    size_t sent = 0;
+    bool stalled = false;
+
+    while (sent < len) {
+        iomux_poll();
+
+        u32 flags = irq_save();
+        size_t block = min(len - sent, min((size_t)ch->tx_credit, (size_t)IOMUX_MAX_PAYLOAD));
+        if (block && iomux_queue_frame(ch->id, buf + sent, block)) {
+            ch->tx_credit -= block;
+            sent += block;
+        } else {
+            block = 0;
+        }
+        irq_restore(flags);
+
+        iomux_kick();
+
+        if (block) {
+            deadline = get_ticks() + timeout;
+            continue;
+        }
+        if (!wait)
+            break;
+        if (!stalled)
+            iomux.stats.tx_stalls++;
+        stalled = true;
+        if (get_ticks() > deadline)
+            break;
+    }
+
+    return sent;
+}
+
+static ssize_t iomux_iodev_can_read(void *opaque)
+{
+    struct iomux_chan *ch = opaque;
+
+    iomux_poll();
+    return ch->rx ? ringbuffer_get_used(ch->rx) : 0;
+}
+
+static bool iomux_iodev_can_write(void *opaque)
+{
+    struct iomux_chan *ch = opaque;
+
+    iomux_poll();
+    return ch->tx_credit != 0;
+}
+
+static ssize_t iomux_iodev_read(void *opaque, void *buf, size_t len)
+{
+    struct iomux_chan *ch = opaque;
+    size_t recvd = 0;
+
+    if (!ch->rx)
+        return -1;
+
+    while (recvd < len) {
+        iomux_poll();
+
+        size_t got = ringbuffer_read(buf + recvd, len - recvd, ch->rx);
+        ch->rx_consumed += got;
+        recvd += got;
+    }
+
+    return recvd;
+}
+
+static ssize_t iomux_iodev_write(void *opaque, const void *buf, size_t len)
+{
+    size_t sent = iomux_send(opaque, buf, len, true);
+
+    return (sent || !len) ? (ssize_t)sent : -1;
+}
+
+/* console output: what the host has no credit for stays with the caller */
+static ssize_t iomux_iodev_try_write(void *opaque, const void *buf, size_t len)
+{
+    return iomux_send(opaque, buf, len, false);
+}
+
+static void iomux_iodev_flush(void *opaque)
+{
+    UNUSED(opaque);
+    if (!iomux_get_phys())
+        return;
+    iomux_put_phys();
+    iodev_flush(iomux.phys);
+}
+
+static void iomux_iodev_handle_events(void *opaque)
+{
+    UNUSED(opaque);
+    iomux_poll();
+}
+
+static const struct iodev_ops iodev_iomux_ops = {
+    .can_read = iomux_iodev_can_read,
+    .can_write = iomux_iodev_can_write,
+    .read = iomux_iodev_read,
+    .write = iomux_iodev_write,
+    .try_write = iomux_iodev_try_write,
+    .flush = iomux_iodev_flush,
+    .handle_events = iomux_iodev_handle_events,
+};
+
+static void iomux_free_rings(void)
+{
+    for (int i = 0; i < IOMUX_CH_MAX; i++) {
+        if (iomux.chan[i].rx)
+            ringbuffer_free(iomux.chan[i].rx);
+        iomux.chan[i].rx = NULL;
+    }
+    if (iomux.tx)
+        ringbuffer_free(iomux.tx);
+    iomux.tx = NULL;
+}
+
+/*
+ * Take over phys: from the next byte on, both directions are framed. The caller's reply (for
+ * the proxy op) still goes out raw, the first frames are the credit grants sent once the
+ * proxy polls its new channel.
+ */
+int iomux_start(iodev_id_t phys)
+{
+    if (iomux.active || phys >= IODEV_MUX0)
+        return -1;
+
+    memset(&iomux, 0, sizeof(iomux));
+
+    iomux.tx = ringbuffer_alloc(IOMUX_TX_SIZE);
+    if (!iomux.tx) {
+        printf("iomux: out of memory\n");
+        return -1;
+    }
+
+    for (int i = 0; i < IOMUX_CH_MAX; i++) {
+        struct iomux_chan *ch = &iomux.chan[i];
+
+        ch->id = i;
+        if (iomux_rx_size[i]) {
+            ch->rx = ringbuffer_alloc(iomux_rx_size[i]);
+            if (!ch->rx) {
+                printf("iomux: out of memory\n");
+                iomux_free_rings();
+                return -1;
+            }
+            ch->rx_consumed = ch->rx->len;
+        }
+
+        ch->iodev.ops = &iodev_iomux_ops;
+        ch->iodev.usage = iomux_usage[i];
+        ch->iodev.opaque = ch;
+        spin_init(&ch->iodev.lock);
+    }
+
+    iomux.phys = phys;
+    iomux.phys_usage = iodev_get_usage(phys);
+    iodev_set_usage(phys, 0);
+    iomux.active = true;
+
+    for (int i = 0; i < IOMUX_CH_MAX; i++)
+        iodev_register_device(IODEV_MUX0 + i, &iomux.chan[i].iodev);
+
+    return 0;
+}
+
+/* hand the physical device back, unframed */
+void iomux_shutdown(void)
+{
+    if (!iomux.active)
+        return;
+
+    for (int i = 0; i < IOMUX_CH_MAX; i++)
+        iodev_unregister_device(IODEV_MUX0 + i);
+
+    iomux_kick();
+    iodev_flush(iomux.phys);
+    iodev_set_usage(iomux.phys, iomux.phys_usage);
+    iomux.active = false;
+    iomux_free_rings();
+
+    if (iomux.stats.csum_errors || iomux.stats.rx_overruns)
+        printf("iomux: %u checksum errors, %llu bytes overrun\n", iomux.stats.csum_errors,
+               iomux.stats.rx_overruns);
+}
+
+int iomux_get_stats(struct iomux_stats *stats, bool reset)
+{
+    if (!iomux.active)
+        return -1;
+
+    u32 flags = irq_save();
+    memcpy(stats, &iomux.stats, sizeof(*stats));
+    if (reset)
+        memset(&iomux.stats, 0, sizeof(iomux.stats));
+    irq_restore(flags);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef IOMUX_H
+#define IOMUX_H
+
+#include "iodev.h"
+#include "types.h"
+
+/*
+ * Framed multiplexer that carries several logical channels over one physical iodev, for
+ * setups where a single UART has to take proxy traffic and console output at once.
+ * The channels are registered as IODEV_MUX0 + iomux_chan_t and behave like any other iodev.
+ *
+ * Every frame is a struct iomux_hdr followed by len bytes of payload. csum is a Fletcher-16
+ * over chan, len (little endian) and the payload; the receiver hunts for IOMUX_MAGIC and drops
+ * anything that does not check out. Flow control is credit based in both directions: a side
+ * only sends as many payload bytes on a channel as the other side granted with credit frames
+ * (IOMUX_CREDIT set in chan, payload is a u32 byte count to add).
+ */
+
+#define IOMUX_MAGIC       0xa5
+#define IOMUX_CREDIT      BIT(7)
+#define IOMUX_MAX_PAYLOAD 1024
+
+typedef enum {
+    IOMUX_CH_PROXY,
+    IOMUX_CH_CONSOLE,
+    IOMUX_CH_MAX,
+} iomux_chan_t;
+
+struct iomux_hdr {
+    u8 magic;
+    u8 chan;
+    u16 len;
+    u16 csum;
+} PACKED;
+
+/* counters, layout shared with the proxyclient */
+struct iomux_stats {
+    u64 rx_frames;
+    u64 tx_frames;
+    u32 csum_errors;
+    u32 bad_frames;
+    u64 rx_overruns;
+    u64 tx_stalls;
+} PACKED;
+
+int iomux_start(iodev_id_t phys);
+void iomux_shutdown(void);
+int iomux_get_stats(struct iomux_stats *stats, bool reset);
+
+#endif
@@ -9,6 +9,7 @@
 #include "exception.h"
 #include "firmware.h"
 #include "iodev.h"
+#include "log.h"
 #include "malloc.h"
 #include "memory.h"
 #include "types.h"
@@ -33,13 +34,13 @@ int dt_set_gpu(void *dt);
 
 #define bail(...)                                                                                  \
     do {                                                                                           \
-        printf(__VA_ARGS__);                                                                       \
+        log_err(LOG_KBOOT, __VA_ARGS__);                                                           \
         return -1;                                                                                 \
     } while (0)
 
 #define bail_cleanup(...)                                                                          \
     do {                                                                                           \
-        printf(__VA_ARGS__);                                                                       \
+        log_err(LOG_KBOOT, __VA_ARGS__);                                                           \
         ret = -1;                                                                                  \
         goto err;                                                                                  \
     } while (0)
@@ -64,7 +65,7 @@ static int dt_set_rng_seed_adt(int node)
 
     random_seed = adt_getprop(adt, anode, "random-seed", &seed_length);
     if (random_seed) {
-        printf("ADT: %d bytes of random seed available\n", seed_length);
+        log_info(LOG_KBOOT, "ADT: %d bytes of random seed available\n", seed_length);
 
         if (seed_length >= sizeof(u64)) {
             u64 kaslr_seed;
@@ -85,19 +86,19 @@ static int dt_set_rng_seed_adt(int node)
             if (fdt_setprop_u64(dt, node, "kaslr-seed", kaslr_seed))
                 bail("FDT: couldn't set kaslr-seed\n");
 
-            printf("FDT: KASLR seed initialized\n");
+            log_info(LOG_KBOOT, "FDT: KASLR seed initialized\n");
         } else {
-            printf("ADT: not enough random data for kaslr-seed\n");
+            log_warn(LOG_KBOOT, "ADT: not enough random data for kaslr-seed\n");
         }
 
         if (seed_length) {
             if (fdt_setprop(dt, node, "rng-seed", random_seed, seed_length))
                 bail("FDT: couldn't set rng-seed\n");
 
-            printf("FDT: Passing %d bytes of random seed\n", seed_length);
+            log_info(LOG_KBOOT, "FDT: Passing %d bytes of random seed\n", seed_length);
         }
     } else {
-        printf("ADT: no random-seed available!\n");
+        log_warn(LOG_KBOOT, "ADT: no random-seed available!\n");
     }
 
     return 0;
@@ -106,14 +107,14 @@ static int dt_set_rng_seed_adt(int node)
 static int dt_set_fb(void)
 {
     if (!cur_boot_args.video.base) {
-        printf("FDT: Framebuffer unavailable, skipping framebuffer initialization");
+        log_warn(LOG_KBOOT, "FDT: Framebuffer unavailable, skipping framebuffer initialization");
         return 0;
     }
 
     int fb = fdt_path_offset(dt, "/chosen/framebuffer");
 
     if (fb < 0) {
-        printf("FDT: No framebuffer found\n");
+        log_warn(LOG_KBOOT, "FDT: No framebuffer found\n");
         return 0;
     }
 
@@ -153,7 +154,8 @@ static int dt_set_fb(void)
             format = "r5g6b5";
             break;
         default:
-            printf("FDT: unsupported fb depth %u, not enabling\n", cur_boot_args.video.depth);
+            log_warn(LOG_KBOOT, "FDT: unsupported fb depth %u, not enabling\n",
+                     cur_boot_args.video.depth);
             return 0; // Do not error out, but don't set the FB
     }
 
@@ -162,7 +164,7 @@ static int dt_set_fb(void)
 
     fdt_delprop(dt, fb, "status"); // may fail if it does not exist
 
-    printf("FDT: %s base 0x%x size 0x%x\n", fbname, fb_base, fb_size);
+    log_info(LOG_KBOOT, "FDT: %s base 0x%x size 0x%x\n", fbname, fb_base, fb_size);
 
     // We do not need to reserve the framebuffer, as it will be excluded from the usable RAM
     // range already.
@@ -173,7 +175,7 @@ static int dt_set_fb(void)
         if (dcp >= 0)
             if (fdt_appendprop_u32(dt, dcp, "apple,notch-height",
                                    cur_boot_args.video.height - fb_height))
-                printf("FDT: couldn't set apple,notch-height\n");
+                log_warn(LOG_KBOOT, "FDT: couldn't set apple,notch-height\n");
     }
 
     return 0;
@@ -194,7 +196,7 @@ static int dt_set_chosen(void)
         const char *value = chosen_params[i][1];
         if (fdt_setprop(dt, node, name, value, strlen(value) + 1) < 0)
             bail("FDT: couldn't set chosen.%s property\n", name);
-        printf("FDT: %s = '%s'\n", name, value);
+        log_info(LOG_KBOOT, "FDT: %s = '%s'\n", name, value);
     }
 
     if (initrd_start && initrd_size) {
@@ -208,7 +210,7 @@ static int dt_set_chosen(void)
         if (fdt_add_mem_rsv(dt, (uintptr_t)initrd_start, initrd_size))
             bail("FDT: couldn't add reservation for the initrd\n");
 
-        printf("FDT: initrd at %p size 0x%zx\n", initrd_start, initrd_size);
+        log_info(LOG_KBOOT, "FDT: initrd at %p size 0x%zx\n", initrd_start, initrd_size);
     }
 
     if (dt_set_fb())
@@ -248,8 +250,9 @@ static int dt_set_memory(void)
     uintptr_t dram_min = cur_boot_args.phys_base;
     uintptr_t dram_max = cur_boot_args.phys_base + cur_boot_args.mem_size;
 
-    printf("FDT: DRAM at 0x%x size 0x%x\n", dram_base, dram_size);
-    printf("FDT: Usable memory is 0x%x..0x%x (0x%x)\n", dram_min, dram_max, dram_max - dram_min);
+    log_info(LOG_KBOOT, "FDT: DRAM at 0x%x size 0x%x\n", dram_base, dram_size);
+    log_info(LOG_KBOOT, "FDT: Usable memory is 0x%x..0x%x (0x%x)\n", dram_min, dram_max,
+             dram_max - dram_min);
 
     struct {
         fdt32_t start;
@@ -259,7 +262,7 @@ static int dt_set_memory(void)
 
     int resv_node = fdt_path_offset(dt, "/reserved-memory");
     if (resv_node < 0) {
-        printf("FDT: '/reserved-memory' not found\n");
+        log_warn(LOG_KBOOT, "FDT: '/reserved-memory' not found\n");
     } else {
         int node;
 
@@ -303,8 +306,8 @@ static int dt_set_memory(void)
                 continue;
             }
 
-            printf("FDT: Adding reserved-memory node %s (%x..%x) to RAM map\n", name, resv_start,
-                   resv_end);
+            log_info(LOG_KBOOT, "FDT: Adding reserved-memory node %s (%x..%x) to RAM map\n", name,
+                     resv_start, resv_end);
 
             if (num_regions >= MAX_MEM_REGIONS) {
                 bail("FDT: Out of memory regions for reserved-memory\n");
@@ -323,8 +326,8 @@ static int dt_set_memory(void)
             bail("FDT: initrd %p...0x%x is not page aligned\n", initrd_start,
                  (uintptr_t)initrd_start + initrd_size);
 
-        printf("FDT: Adding initrd %p...0x%x to RAM map\n", initrd_start,
-               (uintptr_t)initrd_start + initrd_size);
+        log_info(LOG_KBOOT, "FDT: Adding initrd %p...0x%x to RAM map\n", initrd_start,
+                 (uintptr_t)initrd_start + initrd_size);
 
         memreg[num_regions].start = cpu_to_fdt32((uintptr_t)initrd_start);
         memreg[num_regions++].size = cpu_to_fdt32(initrd_size);
@@ -336,7 +339,7 @@ static int dt_set_memory(void)
     if (((uintptr_t)dt | dt_bufsize) & (PAGE_SIZE - 1))
         bail("FDT: FDT %p...0x%x is not page aligned\n", dt, (uintptr_t)initrd_start + initrd_size);
 
-    printf("FDT: Adding FDT %p...0x%x to RAM map\n", dt, (uintptr_t)dt + dt_bufsize);
+    log_info(LOG_KBOOT, "FDT: Adding FDT %p...0x%x to RAM map\n", dt, (uintptr_t)dt + dt_bufsize);
 
     memreg[num_regions].start = cpu_to_fdt32((uintptr_t)initrd_start);
     memreg[num_regions++].size = cpu_to_fdt32(initrd_size);
@@ -366,7 +369,7 @@ static int dt_set_serial_number(void)
     const char *serial_number = adt_getprop(adt, adt_root, "serial-number", &sn_len);
     if (fdt_setprop_string(dt, fdt_root, "serial-number", serial_number))
         bail("FDT: unable to set device serial number!\n");
-    printf("FDT: reporting device serial number: %s\n", serial_number);
+    log_info(LOG_KBOOT, "FDT: reporting device serial number: %s\n", serial_number);
 
     return 0;
 }
@@ -385,7 +388,7 @@ static void dt_set_uboot_dm_preloc(int node)
 
     fdt32_t *phandles = calloc(pds_size, 1);
     if (!phandles) {
-        printf("FDT: out of memory\n");
+        log_err(LOG_KBOOT, "FDT: out of memory\n");
         return;
     }
     memcpy(phandles, pds, pds_size);
@@ -554,6 +557,8 @@ static ssize_t log_console_iodev_write(void *opaque, const void *buf, size_t len
 const struct iodev_ops iodev_log_ops = {
     .can_write = log_console_iodev_can_write,
     .write = log_console_iodev_write,
+    /* only a memcpy, so it is safe from the non-blocking console drain too */
+    .try_write = log_console_iodev_write,
 };
 
 struct iodev iodev_log = {
@@ -639,9 +644,9 @@ int kboot_prepare_dt(void *fdt)
 
     u32 dt_remain = dt_bufsize - fdt_totalsize(dt);
     if (dt_remain < SZ_16K)
-        printf("FDT: free dt buffer space low, %u bytes left\n", dt_remain);
+        log_warn(LOG_KBOOT, "FDT: free dt buffer space low, %u bytes left\n", dt_remain);
 
-    printf("FDT prepared at %p\n", dt);
+    log_info(LOG_KBOOT, "FDT prepared at %p\n", dt);
 
     return 0;
 }
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "log.h"
+
+u8 log_levels[LOG_SUBSYS_MAX] = {
+    [LOG_USB] = LOG_INFO,
+    [LOG_IODEV] = LOG_INFO,
+    [LOG_ADT] = LOG_INFO,
+    [LOG_KBOOT] = LOG_INFO,
+    [LOG_PROXY] = LOG_INFO,
+};
+
+/* returns the previous level */
+int log_set_level(log_subsys_t subsys, log_level_t level)
+{
+    if (subsys >= LOG_SUBSYS_MAX || level > LOG_DEBUG)
+        return -1;
+
+    int old = log_levels[subsys];
+    log_levels[subsys] = level;
+    return old;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "types.h"
+#include "utils.h"
+
+/*
+ * Per-subsystem log levels, adjustable at runtime with P_LOG_SET_LEVEL. A message is printed
+ * if its level is at or below the level of its subsystem, a filtered out call site costs one
+ * load and a branch that is predicted not taken.
+ */
+
+typedef enum {
+    LOG_USB,
+    LOG_IODEV,
+    LOG_ADT,
+    LOG_KBOOT,
+    LOG_PROXY,
+    LOG_SUBSYS_MAX,
+} log_subsys_t;
+
+typedef enum {
+    LOG_NONE,
+    LOG_ERR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+} log_level_t;
+
+extern u8 log_levels[LOG_SUBSYS_MAX];
+
+int log_set_level(log_subsys_t subsys, log_level_t level);
+
+#define log_enabled(subsys, level) __builtin_expect(log_levels[subsys] >= (level), 0)
+
+#define log_printf(subsys, level, ...)                                                             \
+    do {                                                                                           \
+        if (log_enabled(subsys, level))                                                            \
+            printf(__VA_ARGS__);                                                                   \
+    } while (0)
+
+#define log_err(subsys, ...)   log_printf(subsys, LOG_ERR, __VA_ARGS__)
+#define log_warn(subsys, ...)  log_printf(subsys, LOG_WARN, __VA_ARGS__)
+#define log_info(subsys, ...)  log_printf(subsys, LOG_INFO, __VA_ARGS__)
+#define log_debug(subsys, ...) log_printf(subsys, LOG_DEBUG, __VA_ARGS__)
+
+#endif
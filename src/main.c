@@ -11,6 +11,7 @@
 #include "exception.h"
 #include "firmware.h"
 #include "heapblock.h"
+#include "iomux.h"
 #include "memory.h"
 #include "payload.h"
 #include "string.h"
@@ -20,6 +21,7 @@
 #include "uartproxy.h"
 #include "usb.h"
 #include "utils.h"
+#include "vic.h"
 #include "vsprintf.h"
 #include "wdt.h"
 #include "xnuboot.h"
@@ -118,6 +120,8 @@ void mini_main(void)
     mmu_init();
     clkrstgen_init();
     timer_init();
+    vic_init();
+    uart_irq_init();
 
     printf("Initialization complete.\n");
 
@@ -129,10 +133,14 @@ void mini_main(void)
     printf("Preparing to run next stage at %p...\n", next_stage.entry);
 
     exception_shutdown();
+    iomux_shutdown();
     usb_iodev_shutdown();
+    uart_irq_shutdown();
+    vic_shutdown();
     mmu_shutdown();
 
     printf("Vectoring to next stage...\n");
+    iodev_console_flush();
 
     next_stage.entry(next_stage.args[0], next_stage.args[1], next_stage.args[2],
                      next_stage.args[3]);
@@ -2,22 +2,44 @@
 #include "adt.h"
 #include "arm_cpu_regs.h"
 #include "assert.h"
+#include "heapblock.h"
+#include "malloc.h"
 #include "string.h"
 #include "types.h"
 #include "utils.h"
 #include "xnuboot.h"
 
-#define CACHE_LINE_SIZE 64
+// Cortex-A5 L1 D-cache line
+#define CACHE_LINE_SIZE 32
+
+/*
+ * Non-cacheable pool for DMA buffers, one 1MB section mapped Normal Non-cacheable and handed
+ * out in DMA_POOL_PAGE units. dma_pool_used[] holds the length in pages of each allocation at
+ * its first page and DMA_PAGE_TAIL on the rest.
+ */
+#define DMA_POOL_SIZE  SZ_1M
+#define DMA_POOL_PAGE  SZ_4K
+#define DMA_POOL_PAGES (DMA_POOL_SIZE / DMA_POOL_PAGE)
+#define DMA_PAGE_TAIL  0xffff
+
+static u8 *dma_pool;
+static u16 dma_pool_used[DMA_POOL_PAGES];
+
+static bool dma_in_pool(const void *p)
+{
+    return dma_pool && (u8 *)p >= dma_pool && (u8 *)p < dma_pool + DMA_POOL_SIZE;
+}
 
 #define CACHE_RANGE_OP(func, op)                                                                   \
     void func(void *addr, size_t length)                                                           \
     {                                                                                              \
-        u64 p = (u64)addr;                                                                         \
-        u64 end = p + length;                                                                      \
+        uintptr_t p = ALIGN_DOWN((uintptr_t)addr, CACHE_LINE_SIZE);                                \
+        uintptr_t end = (uintptr_t)addr + length;                                                  \
         while (p < end) {                                                                          \
             cacheop(op, p);                                                                        \
             p += CACHE_LINE_SIZE;                                                                  \
         }                                                                                          \
+        sysop("dsb");                                                                              \
     }
 
 CACHE_RANGE_OP(ic_ivau_range, "mcr p15, 0, %0, c7, c5, 1")
@@ -92,6 +114,14 @@ void mmu_init(void)
     mmu_add_mapping(cur_boot_args.phys_base, cur_boot_args.phys_base,
                     ALIGN_UP(cur_boot_args.mem_size, BIT(24)), AP_RW_ALL,
                     ATTR_BUFFERABLE | ATTR_CACHEABLE | ATTR_SHARABLE);
+
+    if (!dma_pool)
+        dma_pool = heapblock_alloc_aligned(DMA_POOL_SIZE, DMA_POOL_SIZE);
+    if (dma_pool)
+        mmu_add_mapping((u32)dma_pool, (u32)dma_pool, DMA_POOL_SIZE, AP_RW_ALL, ATTR_NORMAL_NC);
+    else
+        printf("MMU: failed to carve out the DMA pool\n");
+
     write_dacr(0x55555555); // enable client access for all domains
     write_ttbr0((u32)__pgtables);
     write_ttbcr(0);
@@ -100,11 +130,16 @@ void mmu_init(void)
     dc_cvac_range(__pgtables, sizeof(__pgtables));
 
     u32 sctlr = read_sctlr();
+
+    // stale lines from before would shadow what was written uncached since
+    dcsw_op_all((sctlr & SCTLR_C) ? DCSW_OP_DCCISW : DCSW_OP_DCISW);
+
     u32 sctlr2 = sctlr & ~(SCTLR_A);
-    sctlr2 |= (SCTLR_Z | SCTLR_M | SCTLR_I /*| SCTLR_C*/);
+    sctlr2 |= (SCTLR_Z | SCTLR_M | SCTLR_I | SCTLR_C);
     printf("MMU: SCTLR %x -> %x\n", sctlr, sctlr2);
     write_sctlr(sctlr2);
-    printf("MMU: Running with caches and translation enabled\n");
+    sysop("isb");
+    printf("MMU: Running with caches and translation enabled, DMA pool at %p\n", dma_pool);
 }
 
 void mmu_shutdown(void)
@@ -134,3 +169,87 @@ void mmu_restore(u32 state)
 {
     write_sctlr(state);
 }
+
+/* turn the D-cache off or back on with the MMU left up, returns whether it was on */
+bool mmu_set_dcache(bool enable)
+{
+    u32 sctlr = read_sctlr();
+    bool was = !!(sctlr & SCTLR_C);
+
+    if (!(sctlr & SCTLR_M) || was == enable)
+        return was;
+
+    u32 flags = irq_save();
+    if (enable) {
+        dcsw_op_all(DCSW_OP_DCISW);
+        write_sctlr(sctlr | SCTLR_C);
+    } else {
+        dcsw_op_all(DCSW_OP_DCCISW);
+        write_sctlr(sctlr & ~SCTLR_C);
+    }
+    sysop("isb");
+    irq_restore(flags);
+
+    return was;
+}
+
+/*
+ * allocate from the non-cacheable pool, or the heap while the D-cache is off. With the cache on
+ * and no pool there is nothing coherent to hand out.
+ */
+void *dma_alloc(size_t size, size_t align)
+{
+    if (!dma_pool) {
+        if (read_sctlr() & SCTLR_C)
+            return NULL;
+        return memalign(max(align, (size_t)CACHE_LINE_SIZE), size);
+    }
+
+    size_t pages = ALIGN_UP(max(size, (size_t)1), DMA_POOL_PAGE) / DMA_POOL_PAGE;
+    size_t step = max(align, (size_t)DMA_POOL_PAGE) / DMA_POOL_PAGE;
+
+    for (size_t first = 0; first + pages <= DMA_POOL_PAGES; first += step) {
+        size_t i;
+
+        for (i = 0; i < pages; i++)
+            if (dma_pool_used[first + i])
+                break;
+        if (i < pages)
+            continue;
+
+        dma_pool_used[first] = pages;
+        for (i = 1; i < pages; i++)
+            dma_pool_used[first + i] = DMA_PAGE_TAIL;
+        return dma_pool + first * DMA_POOL_PAGE;
+    }
+
+    printf("MMU: DMA pool exhausted (%u bytes)\n", size);
+    return NULL;
+}
+
+void dma_free(void *p)
+{
+    if (!p)
+        return;
+
+    if (!dma_in_pool(p)) {
+        free(p);
+        return;
+    }
+
+    size_t first = ((u8 *)p - dma_pool) / DMA_POOL_PAGE;
+    size_t pages = dma_pool_used[first];
+
+    assert(pages && pages != DMA_PAGE_TAIL);
+    for (size_t i = 0; i < pages; i++)
+        dma_pool_used[first + i] = 0;
+}
+
+/* whether the device and the CPU see the same data at p without cache maintenance */
+bool dma_is_coherent(const void *p)
+{
+    if (!(read_sctlr() & SCTLR_C))
+        return true;
+
+    return dma_in_pool(p);
+}
@@ -20,6 +20,9 @@ extern u32 __pgtables[4096];
 #define ATTR_NG         BIT(17)
 #define ATTR_NS         BIT(19)
 
+// TEX=001 C=0 B=0
+#define ATTR_NORMAL_NC FIELD_PREP(ATTR_TEX, 1)
+
 #define AP_NONE          0
 #define AP_RW_PL1        0b1
 #define AP_RW_PL1_RO_PL0 0b10
@@ -33,6 +36,15 @@ void mmu_shutdown(void);
 void mmu_shutdown(void);
 u32 mmu_disable(void);
 void mmu_restore(u32 state);
+bool mmu_set_dcache(bool enable);
+
+/*
+ * Buffers the USB controller DMAs to and from. They come out of a non-cacheable pool, so
+ * unlike other memory they need no cache maintenance around transfers.
+ */
+void *dma_alloc(size_t size, size_t align);
+void dma_free(void *p);
+bool dma_is_coherent(const void *p);
 
 void ic_ivau_range(void *addr, size_t length);
 void dc_ivac_range(void *addr, size_t length);
@@ -4,17 +4,22 @@
 
 #include "proxy.h"
 #include "assert.h"
+#include "blog.h"
 #include "exception.h"
 #include "heapblock.h"
 #include "iodev.h"
+#include "iomux.h"
 #include "kboot.h"
+#include "log.h"
 #include "malloc.h"
 #include "memory.h"
 #include "smp.h"
 #include "string.h"
+#include "trace.h"
 #include "types.h"
 #include "uart.h"
 #include "uartproxy.h"
+#include "usb.h"
 #include "utils.h"
 #include "xnuboot.h"
 
@@ -49,7 +54,7 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             break;
         case P_SET_BAUD: {
             int cnt = request->args[1];
-            printf("Changing baud rate to %llu...\n", request->args[0]);
+            log_info(LOG_PROXY, "Changing baud rate to %llu...\n", request->args[0]);
             uart_setbaud(request->args[0]);
             while (cnt--) {
                 uart_putbyte(request->args[2]);
@@ -59,6 +64,10 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             }
             break;
         }
+        case P_SET_BAUD_VERIFY:
+            reply->retval = uart_verify_baud(request->args[0], request->args[1], request->args[2],
+                                             request->args[3]);
+            break;
         case P_UDELAY:
             udelay(request->args[0]);
             break;
@@ -85,6 +94,22 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_SLEEP:
         case P_EL3_CALL:
             reply->status = S_BADCMD;
+            break;
+        case P_BLOG_GET_RING:
+            reply->retval = (uintptr_t)&blog_ring;
+            break;
+        case P_BLOG_SET_ECHO:
+            blog_set_echo(request->args[0]);
+            break;
+        case P_TRACE_GET_RING:
+            reply->retval = (uintptr_t)&trace_ring;
+            break;
+        case P_TRACE_SET_ENABLE:
+            trace_set_enable(request->args[0]);
+            break;
+        case P_LOG_SET_LEVEL:
+            reply->retval = log_set_level(request->args[0], request->args[1]);
+            break;
         case P_WRITE64:
             exc_guard = GUARD_SKIP;
             write64(request->args[0], request->args[1]);
@@ -268,6 +293,9 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             break;
         case P_MMU_INIT_SECONDARY:
             break;
+        case P_MMU_SET_DCACHE:
+            reply->retval = mmu_set_dcache(request->args[0]);
+            break;
 
         case P_XZDEC: {
             uint32_t destlen, srclen;
@@ -291,6 +319,9 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
                 reply->retval = destlen;
             break;
         }
+        case P_CHECKSUM:
+            reply->retval = uartproxy_checksum((void *)request->args[0], request->args[1]);
+            break;
 
         case P_SMP_START_SECONDARIES:
             smp_start_secondaries();
@@ -369,8 +400,48 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_IODEV_WHOAMI:
             reply->retval = uartproxy_iodev;
             break;
-
         case P_USB_IODEV_VUART_SETUP:
+            reply->retval = usb_iodev_vuart_setup(request->args[0]);
+            break;
+        case P_USB_GET_STATS:
+            reply->retval = usb_iodev_get_stats(request->args[0], (void *)request->args[1],
+                                                request->args[2], request->args[3]);
+            break;
+        case P_USB_SOURCE_SINK:
+            reply->retval = usb_iodev_source_sink(request->args[0], request->args[1],
+                                                  (void *)request->args[2]);
+            break;
+        case P_USB_MSC_START:
+            reply->retval = usb_iodev_msc_start(request->args[0], (void *)request->args[1],
+                                                request->args[2]);
+            break;
+        case P_USB_MSC_STOP:
+            reply->retval = usb_iodev_msc_stop(request->args[0]);
+            break;
+        case P_USB_MSC_STATUS:
+            reply->retval =
+                usb_iodev_msc_status(request->args[0], (void *)request->args[1], request->args[2]);
+            break;
+        case P_USB_SET_BUFFER_SIZE:
+            reply->retval =
+                usb_iodev_set_buffer_size(request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_IODEV_CONSOLE_DROPPED:
+            reply->retval = iodev_console_dropped(request->args[0], request->args[1]);
+            break;
+        case P_IOMUX_START:
+            reply->retval = iomux_start(request->args[0]);
+            break;
+        case P_IOMUX_GET_STATS:
+            reply->retval = iomux_get_stats((void *)request->args[0], request->args[1]);
+            break;
+        case P_IODEV_CONSOLE_GET_RING:
+            reply->retval = (uintptr_t)iodev_console_get_ring();
+            break;
+        case P_IODEV_CONSOLE_RESIZE:
+            reply->retval = iodev_console_resize(request->args[0]);
+            break;
+
         case P_TUNABLES_APPLY_GLOBAL:
         case P_TUNABLES_APPLY_LOCAL:
         case P_TUNABLES_APPLY_LOCAL_ADDR:
@@ -25,6 +25,12 @@ typedef enum {
     P_REBOOT,
     P_SLEEP,
     P_EL3_CALL,
+    P_BLOG_GET_RING,
+    P_BLOG_SET_ECHO,
+    P_TRACE_GET_RING,
+    P_TRACE_SET_ENABLE,
+    P_LOG_SET_LEVEL,
+    P_SET_BAUD_VERIFY,
 
     P_WRITE64 = 0x100, // Generic register functions
     P_WRITE32,
@@ -76,9 +82,11 @@ typedef enum {
     P_MMU_DISABLE,
     P_MMU_RESTORE,
     P_MMU_INIT_SECONDARY,
+    P_MMU_SET_DCACHE,
 
     P_XZDEC = 0x400, // Decompression and data processing ops
     P_GZDEC,
+    P_CHECKSUM,
 
     P_SMP_START_SECONDARIES = 0x500, // SMP and system management ops
     P_SMP_CALL,
@@ -117,6 +125,17 @@ typedef enum {
     P_IODEV_WRITE,
     P_IODEV_WHOAMI,
     P_USB_IODEV_VUART_SETUP,
+    P_USB_GET_STATS,
+    P_USB_SOURCE_SINK,
+    P_USB_MSC_START,
+    P_USB_MSC_STOP,
+    P_USB_MSC_STATUS,
+    P_USB_SET_BUFFER_SIZE,
+    P_IODEV_CONSOLE_DROPPED,
+    P_IOMUX_START,
+    P_IOMUX_GET_STATS,
+    P_IODEV_CONSOLE_GET_RING,
+    P_IODEV_CONSOLE_RESIZE,
 
     P_TUNABLES_APPLY_GLOBAL = 0xa00,
     P_TUNABLES_APPLY_LOCAL,
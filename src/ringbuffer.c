@@ -1,22 +1,52 @@
 #include "ringbuffer.h"
+#include "atomic.h"
 #include "malloc.h"
+#include "string.h"
 #include "types.h"
+#include "utils.h"
+
+/*
+ * The USB controller DMAs straight to and from ring memory, so the buffer starts on a cache line
+ * and, being a power of two, ends on one too. Cache maintenance on it then never touches
+ * unrelated heap data.
+ */
+#define RINGBUFFER_ALIGN 64
+
+/*
+ * Single producer, single consumer ring. The size is a power of two and the indices run
+ * freely, they are only masked to address the buffer, so a full ring uses every byte and is
+ * still told apart from an empty one.
+ *
+ * Each side only writes its own index and reads the other one, and publishes its index after
+ * the data it covers (producer) or after it is done with the data (consumer), with release
+ * stores paired with acquire loads on the other side. That keeps it safe without locks when
+ * one side runs in interrupt context or on another core.
+ */
 
 ringbuffer_t *ringbuffer_alloc(size_t len)
 {
+    size_t size = 1;
+
+    if (!len)
+        return NULL;
+
+    while (size < len)
+        size <<= 1;
+
     ringbuffer_t *bfr = calloc(1, sizeof(*bfr));
     if (!bfr)
         return NULL;
 
-    bfr->buffer = calloc(len, 1);
+    bfr->buffer = memalign(RINGBUFFER_ALIGN, size);
     if (!bfr->buffer) {
         free(bfr);
         return NULL;
     }
+    memset(bfr->buffer, 0, size);
 
     bfr->read = 0;
     bfr->write = 0;
-    bfr->len = len;
+    bfr->len = size;
 
     return bfr;
 }
@@ -28,19 +58,73 @@ void ringbuffer_free(ringbuffer_t *bfr)
     free(bfr);
 }
 
+size_t ringbuffer_peek(ringbuffer_t *bfr, const u8 **data)
+{
+    size_t read = bfr->read;
+    // Don't read the data before the index that covers it
+    size_t used = atomic_load_acquire(&bfr->write) - read;
+    size_t offset = read & (bfr->len - 1);
+
+    *data = &bfr->buffer[offset];
+    return min(used, bfr->len - offset);
+}
+
+void ringbuffer_consume(ringbuffer_t *bfr, size_t len)
+{
+    size_t read = bfr->read + len;
+
+    // Finish reading the data before handing it back to the producer
+    atomic_store_release(&bfr->read, read);
+
+    if (bfr->low.cb && len) {
+        size_t used = atomic_load(&bfr->write) - read;
+
+        if (used <= bfr->low.level && used + len > bfr->low.level)
+            bfr->low.cb(bfr, bfr->low.opaque);
+    }
+}
+
+size_t ringbuffer_reserve(ringbuffer_t *bfr, u8 **data)
+{
+    size_t write = bfr->write;
+    // Don't overwrite data the consumer may still be reading
+    size_t room = bfr->len - (write - atomic_load_acquire(&bfr->read));
+    size_t offset = write & (bfr->len - 1);
+
+    *data = &bfr->buffer[offset];
+    return min(room, bfr->len - offset);
+}
+
+void ringbuffer_commit(ringbuffer_t *bfr, size_t len)
+{
+    size_t write = bfr->write + len;
+
+    // Make the data visible before the index that covers it
+    atomic_store_release(&bfr->write, write);
+
+    if (bfr->high.cb && len) {
+        size_t used = write - atomic_load(&bfr->read);
+
+        if (used >= bfr->high.level && used - len < bfr->high.level)
+            bfr->high.cb(bfr, bfr->high.opaque);
+    }
+}
+
 size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr)
 {
-    size_t read;
+    size_t read = 0;
 
-    for (read = 0; read < len; ++read) {
-        if (bfr->read == bfr->write)
-            break;
+    // At most two spans: up to the end of the buffer, then from its start
+    while (read < len) {
+        const u8 *data;
+        size_t block = min(ringbuffer_peek(bfr, &data), len - read);
 
-        *target = bfr->buffer[bfr->read];
-        target++;
+        if (!block)
+            break;
 
-        bfr->read++;
-        bfr->read %= bfr->len;
+        memcpy(target + read, data, block);
+        ringbuffer_consume(bfr, block);
+        read += block;
     }
 
     return read;
@@ -48,31 +132,42 @@ size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr)
 
 size_t ringbuffer_write(const u8 *src, size_t len, ringbuffer_t *bfr)
 {
-    size_t written;
+    size_t written = 0;
 
-    for (written = 0; written < len; ++written) {
-        if (((bfr->write + 1) % bfr->len) == bfr->read)
-            break;
+    while (written < len) {
+        u8 *data;
+        size_t block = min(ringbuffer_reserve(bfr, &data), len - written);
 
-        bfr->buffer[bfr->write] = *src;
-        src++;
+        if (!block)
+            break;
 
-        bfr->write++;
-        bfr->write %= bfr->len;
+        memcpy(data, src + written, block);
+        ringbuffer_commit(bfr, block);
+        written += block;
     }
 
     return written;
 }
 
-size_t ringbuffer_get_used(ringbuffer_t *bfr)
+void ringbuffer_set_low_watermark(ringbuffer_t *bfr, size_t level, ringbuffer_watermark_t cb,
+                                  void *opaque)
 {
-    size_t read = bfr->read;
-    size_t write = bfr->write;
+    bfr->low.level = level;
+    bfr->low.cb = cb;
+    bfr->low.opaque = opaque;
+}
 
-    if (write < read)
-        write += bfr->len;
+void ringbuffer_set_high_watermark(ringbuffer_t *bfr, size_t level, ringbuffer_watermark_t cb,
+                                   void *opaque)
+{
+    bfr->high.level = level;
+    bfr->high.cb = cb;
+    bfr->high.opaque = opaque;
+}
 
-    return write - read;
+size_t ringbuffer_get_used(ringbuffer_t *bfr)
+{
+    return atomic_load(&bfr->write) - atomic_load(&bfr->read);
 }
 
 size_t ringbuffer_get_free(ringbuffer_t *bfr)
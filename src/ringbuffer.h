@@ -3,19 +3,52 @@
 
 #include "types.h"
 
-typedef struct {
+typedef struct ringbuffer ringbuffer_t;
+
+typedef void (*ringbuffer_watermark_t)(ringbuffer_t *bfr, void *opaque);
+
+/* len is a power of two, read and write are free running and only masked on access */
+struct ringbuffer {
     u8 *buffer;
     size_t len;
     size_t read;
     size_t write;
-} ringbuffer_t;
 
+    /* called from the side that moved its index across level */
+    struct {
+        size_t level;
+        ringbuffer_watermark_t cb;
+        void *opaque;
+    } low, high;
+};
+
+/* len is rounded up to a power of two */
 ringbuffer_t *ringbuffer_alloc(size_t len);
 void ringbuffer_free(ringbuffer_t *bfr);
 
 size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr);
 size_t ringbuffer_write(const u8 *src, size_t len, ringbuffer_t *bfr);
 
+/*
+ * Zero-copy access: peek/reserve return the longest contiguous span of data/free space at the
+ * current position, which the caller then hands back with consume/commit. A span that wraps
+ * takes two rounds.
+ */
+size_t ringbuffer_peek(ringbuffer_t *bfr, const u8 **data);
+void ringbuffer_consume(ringbuffer_t *bfr, size_t len);
+size_t ringbuffer_reserve(ringbuffer_t *bfr, u8 **data);
+void ringbuffer_commit(ringbuffer_t *bfr, size_t len);
+
+/*
+ * The low watermark fires when the consumer drains the ring to level bytes or less, the high
+ * watermark when the producer fills it to level bytes or more. Set them up before the ring is
+ * shared, a NULL cb disables them.
+ */
+void ringbuffer_set_low_watermark(ringbuffer_t *bfr, size_t level, ringbuffer_watermark_t cb,
+                                  void *opaque);
+void ringbuffer_set_high_watermark(ringbuffer_t *bfr, size_t level, ringbuffer_watermark_t cb,
+                                   void *opaque);
+
 size_t ringbuffer_get_used(ringbuffer_t *bfr);
 size_t ringbuffer_get_free(ringbuffer_t *bfr);
 
@@ -56,6 +56,29 @@ typedef enum {
 	TINF_BUF_ERROR  = -5  /**< Not enough room for output */
 } tinf_error_code;
 
+/**
+ * Callback supplying more input to the streaming decompressors.
+ *
+ * Sets `*data` to the next chunk of compressed data and returns its size,
+ * or returns 0 at the end of the input. The chunk must stay valid until the
+ * next call.
+ */
+typedef unsigned int (TINFCC *tinf_refill_fn)(void *opaque,
+                                               const unsigned char **data);
+
+/**
+ * Input stream for the streaming decompressors.
+ *
+ * Initialize `next` and `end` to NULL, or to data already available. On
+ * return they describe the input that was not consumed.
+ */
+struct tinf_stream {
+	tinf_refill_fn refill;       /**< Called when input runs out */
+	void *opaque;                /**< Passed to `refill` */
+	const unsigned char *next;   /**< Next unread input byte */
+	const unsigned char *end;    /**< End of the current chunk */
+};
+
 /**
  * Initialize global data used by tinf.
  *
@@ -99,6 +122,44 @@ int TINFCC tinf_uncompress(void *dest, unsigned int *destLen,
 int TINFCC tinf_gzip_uncompress(void *dest, unsigned int *destLen,
                                 const void *source, unsigned int *sourceLen);
 
+/**
+ * Decompress deflate data pulled from `stream` to `dest`.
+ *
+ * Like `tinf_uncompress`, but input is requested from the stream as it is
+ * needed, so it never has to be in memory all at once. Consumes exactly the
+ * bytes of the deflate stream.
+ *
+ * @param dest pointer to where to place decompressed data
+ * @param destLen pointer to variable containing size of `dest`
+ * @param stream input stream
+ * @return `TINF_OK` on success, error code on error
+ */
+int TINFCC tinf_uncompress_stream(void *dest, unsigned int *destLen,
+                                  struct tinf_stream *stream);
+
+/**
+ * Decompress gzip data pulled from `stream` to `dest`.
+ *
+ * Like `tinf_gzip_uncompress`, but input is requested from the stream as it
+ * is needed. The header CRC is skipped but not verified. Consumes exactly the
+ * bytes of the gzip member, including the trailer.
+ *
+ * @param dest pointer to where to place decompressed data
+ * @param destLen pointer to variable containing size of `dest`
+ * @param stream input stream
+ * @return `TINF_OK` on success, error code on error
+ */
+int TINFCC tinf_gzip_uncompress_stream(void *dest, unsigned int *destLen,
+                                       struct tinf_stream *stream);
+
+/**
+ * Get the next byte from `stream`.
+ *
+ * @param stream input stream
+ * @return next byte, or -1 at the end of the input
+ */
+int TINFCC tinf_stream_getbyte(struct tinf_stream *stream);
+
 /**
  * Decompress `sourceLen` bytes of zlib data from `source` to `dest`.
  *
@@ -189,3 +189,136 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
 
 	return TINF_OK;
 }
+
+/* Read n bytes of stream into a little endian value, or return -1 */
+static long long stream_read_le(struct tinf_stream *stream, int n)
+{
+	unsigned int val = 0;
+	int i, c;
+
+	for (i = 0; i < n; ++i) {
+		c = tinf_stream_getbyte(stream);
+
+		if (c < 0) {
+			return -1;
+		}
+
+		val |= (unsigned int) c << (8 * i);
+	}
+
+	return val;
+}
+
+/* Skip a zero terminated string in stream */
+static int stream_skip_string(struct tinf_stream *stream)
+{
+	int c;
+
+	do {
+		c = tinf_stream_getbyte(stream);
+
+		if (c < 0) {
+			return TINF_DATA_ERROR;
+		}
+	} while (c);
+
+	return TINF_OK;
+}
+
+int tinf_gzip_uncompress_stream(void *dest, unsigned int *destLen,
+                                struct tinf_stream *stream)
+{
+	unsigned char hdr[10];
+	long long xlen, crc32, dlen;
+	int res, c, i;
+	unsigned char flg;
+
+	/* -- Check header -- */
+
+	for (i = 0; i < 10; ++i) {
+		c = tinf_stream_getbyte(stream);
+
+		if (c < 0) {
+			return TINF_DATA_ERROR;
+		}
+
+		hdr[i] = c;
+	}
+
+	/* Check id bytes */
+	if (hdr[0] != 0x1F || hdr[1] != 0x8B) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* Check method is deflate */
+	if (hdr[2] != 8) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* Get flag byte */
+	flg = hdr[3];
+
+	/* Check that reserved bits are zero */
+	if (flg & 0xE0) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* -- Skip to start of compressed data -- */
+
+	/* Skip extra data if present */
+	if (flg & FEXTRA) {
+		xlen = stream_read_le(stream, 2);
+
+		if (xlen < 0) {
+			return TINF_DATA_ERROR;
+		}
+
+		while (xlen--) {
+			if (tinf_stream_getbyte(stream) < 0) {
+				return TINF_DATA_ERROR;
+			}
+		}
+	}
+
+	/* Skip file name if present */
+	if ((flg & FNAME) && stream_skip_string(stream) != TINF_OK) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* Skip file comment if present */
+	if ((flg & FCOMMENT) && stream_skip_string(stream) != TINF_OK) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* Skip header crc if present, the header is not kept around */
+	if ((flg & FHCRC) && stream_read_le(stream, 2) < 0) {
+		return TINF_DATA_ERROR;
+	}
+
+	/* -- Decompress data -- */
+
+	res = tinf_uncompress_stream(dest, destLen, stream);
+
+	if (res != TINF_OK) {
+		return res;
+	}
+
+	/* -- Check trailer -- */
+
+	crc32 = stream_read_le(stream, 4);
+	dlen = stream_read_le(stream, 4);
+
+	if (crc32 < 0 || dlen < 0) {
+		return TINF_DATA_ERROR;
+	}
+
+	if (*destLen != dlen) {
+		return TINF_DATA_ERROR;
+	}
+
+	if (crc32 != tinf_crc32(dest, *destLen)) {
+		return TINF_DATA_ERROR;
+	}
+
+	return TINF_OK;
+}
@@ -45,6 +45,7 @@ struct tinf_tree {
 struct tinf_data {
 	const unsigned char *source;
 	const unsigned char *source_end;
+	struct tinf_stream *stream; /* Refills source when it runs out, or NULL */
 	unsigned int tag;
 	int bitcount;
 	int overflow;
@@ -59,10 +60,29 @@ struct tinf_data {
 
 /* -- Utility functions -- */
 
-static unsigned int read_le16(const unsigned char *p)
+/* Pull the next chunk of input from the stream, returns 0 at end of input */
+static int tinf_stream_fill(struct tinf_data *d)
 {
-	return ((unsigned int) p[0])
-	     | ((unsigned int) p[1] << 8);
+	unsigned int len;
+
+	if (!d->stream) {
+		return 0;
+	}
+
+	len = d->stream->refill(d->stream->opaque, &d->source);
+	d->source_end = d->source + len;
+
+	return len != 0;
+}
+
+/* Get one byte of input, or -1 at end of input */
+static int tinf_getbyte(struct tinf_data *d)
+{
+	if (d->source == d->source_end && !tinf_stream_fill(d)) {
+		return -1;
+	}
+
+	return *d->source++;
 }
 
 /* Build fixed Huffman trees */
@@ -183,7 +203,7 @@ static void tinf_refill(struct tinf_data *d, int num)
 
 	/* Read bytes until at least num bits available */
 	while (d->bitcount < num) {
-		if (d->source != d->source_end) {
+		if (d->source != d->source_end || tinf_stream_fill(d)) {
 			d->tag |= (unsigned int) *d->source++ << d->bitcount;
 		}
 		else {
@@ -484,36 +504,47 @@ static int tinf_inflate_block_data(struct tinf_data *d, struct tinf_tree *lt,
 /* Inflate an uncompressed block of data */
 static int tinf_inflate_uncompressed_block(struct tinf_data *d)
 {
-	unsigned int length, invlength;
+	unsigned int length, invlength, n;
+	int hdr[4], i;
 
-	if (d->source_end && d->source_end - d->source < 4) {
-		return TINF_DATA_ERROR;
-	}
+	/* Get length and its one's complement */
+	for (i = 0; i < 4; ++i) {
+		hdr[i] = tinf_getbyte(d);
 
-	/* Get length */
-	length = read_le16(d->source);
+		if (hdr[i] < 0) {
+			return TINF_DATA_ERROR;
+		}
+	}
 
-	/* Get one's complement of length */
-	invlength = read_le16(d->source + 2);
+	length = hdr[0] | (hdr[1] << 8);
+	invlength = hdr[2] | (hdr[3] << 8);
 
 	/* Check length */
 	if (length != (~invlength & 0x0000FFFF)) {
 		return TINF_DATA_ERROR;
 	}
 
-	d->source += 4;
-
-	if (d->source_end && d->source_end - d->source < length) {
-		return TINF_DATA_ERROR;
-	}
-
 	if (d->dest_end - d->dest < length) {
 		return TINF_BUF_ERROR;
 	}
 
-	/* Copy block */
-	while (length--) {
-		*d->dest++ = *d->source++;
+	/* Copy block, one chunk of input at a time */
+	while (length) {
+		if (d->source == d->source_end && !tinf_stream_fill(d)) {
+			return TINF_DATA_ERROR;
+		}
+
+		n = length;
+
+		if (d->source_end && d->source_end - d->source < n) {
+			n = d->source_end - d->source;
+		}
+
+		length -= n;
+
+		while (n--) {
+			*d->dest++ = *d->source++;
+		}
 	}
 
 	/* Make sure we start next block on a byte boundary */
@@ -555,50 +586,34 @@ void tinf_init(void)
 	return;
 }
 
-/* Inflate stream from source to dest */
-int tinf_uncompress(void *dest, unsigned int *destLen,
-                    const void *source, unsigned int *sourceLen)
+/* Inflate all blocks of a deflate stream */
+static int tinf_inflate(struct tinf_data *d)
 {
-	struct tinf_data d;
 	int bfinal;
 
-	/* Initialise data */
-	d.source = (const unsigned char *) source;
-	if (sourceLen && *sourceLen)
-		d.source_end = d.source + *sourceLen;
-	else
-		d.source_end = 0;
-	d.tag = 0;
-	d.bitcount = 0;
-	d.overflow = 0;
-
-	d.dest = (unsigned char *) dest;
-	d.dest_start = d.dest;
-	d.dest_end = d.dest + *destLen;
-
 	do {
 		unsigned int btype;
 		int res;
 
 		/* Read final block flag */
-		bfinal = tinf_getbits(&d, 1);
+		bfinal = tinf_getbits(d, 1);
 
 		/* Read block type (2 bits) */
-		btype = tinf_getbits(&d, 2);
+		btype = tinf_getbits(d, 2);
 
 		/* Decompress block */
 		switch (btype) {
 		case 0:
 			/* Decompress uncompressed block */
-			res = tinf_inflate_uncompressed_block(&d);
+			res = tinf_inflate_uncompressed_block(d);
 			break;
 		case 1:
 			/* Decompress block with fixed Huffman trees */
-			res = tinf_inflate_fixed_block(&d);
+			res = tinf_inflate_fixed_block(d);
 			break;
 		case 2:
 			/* Decompress block with dynamic Huffman trees */
-			res = tinf_inflate_dynamic_block(&d);
+			res = tinf_inflate_dynamic_block(d);
 			break;
 		default:
 			res = TINF_DATA_ERROR;
@@ -611,10 +626,41 @@ int tinf_uncompress(void *dest, unsigned int *destLen,
 	} while (!bfinal);
 
 	/* Check for overflow in bit reader */
-	if (d.overflow) {
+	if (d->overflow) {
 		return TINF_DATA_ERROR;
 	}
 
+	return TINF_OK;
+}
+
+/* Inflate stream from source to dest */
+int tinf_uncompress(void *dest, unsigned int *destLen,
+                    const void *source, unsigned int *sourceLen)
+{
+	struct tinf_data d;
+	int res;
+
+	/* Initialise data */
+	d.source = (const unsigned char *) source;
+	if (sourceLen && *sourceLen)
+		d.source_end = d.source + *sourceLen;
+	else
+		d.source_end = 0;
+	d.stream = 0;
+	d.tag = 0;
+	d.bitcount = 0;
+	d.overflow = 0;
+
+	d.dest = (unsigned char *) dest;
+	d.dest_start = d.dest;
+	d.dest_end = d.dest + *destLen;
+
+	res = tinf_inflate(&d);
+
+	if (res != TINF_OK) {
+		return res;
+	}
+
 	if (sourceLen) {
 		unsigned int slen = d.source - (const unsigned char *)source;
 		if (!*sourceLen)
@@ -627,6 +673,56 @@ int tinf_uncompress(void *dest, unsigned int *destLen,
 	return TINF_OK;
 }
 
+/* Inflate stream pulled from stream to dest */
+int tinf_uncompress_stream(void *dest, unsigned int *destLen,
+                           struct tinf_stream *stream)
+{
+	struct tinf_data d;
+	int res;
+
+	/* Initialise data, continuing where the stream left off */
+	d.source = stream->next;
+	d.source_end = stream->end;
+	d.stream = stream;
+	d.tag = 0;
+	d.bitcount = 0;
+	d.overflow = 0;
+
+	d.dest = (unsigned char *) dest;
+	d.dest_start = d.dest;
+	d.dest_end = d.dest + *destLen;
+
+	res = tinf_inflate(&d);
+
+	/* The bit reader never reads ahead by a whole byte */
+	stream->next = d.source;
+	stream->end = d.source_end;
+
+	if (res != TINF_OK) {
+		return res;
+	}
+
+	*destLen = d.dest - d.dest_start;
+	return TINF_OK;
+}
+
+/* Get one byte of input from a stream, used by the container parsers */
+int tinf_stream_getbyte(struct tinf_stream *stream)
+{
+	unsigned int len;
+
+	if (stream->next == stream->end) {
+		len = stream->refill(stream->opaque, &stream->next);
+		stream->end = stream->next + len;
+
+		if (!len) {
+			return -1;
+		}
+	}
+
+	return *stream->next++;
+}
+
 /* clang -g -O1 -fsanitize=fuzzer,address -DTINF_FUZZING tinflate.c */
 #if defined(TINF_FUZZING)
 #include <limits.h>
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "trace.h"
+#include "arm_cpu_regs.h"
+#include "timer.h"
+#include "utils.h"
+
+struct trace_ring trace_ring = {
+    .magic = TRACE_MAGIC,
+    .entries = TRACE_ENTRIES,
+};
+
+void trace_record(const char *name, u32 type, u32 a0, u32 a1)
+{
+    u32 cpsr = mrs(cpsr);
+    u32 flags = irq_save();
+    struct trace_event *e = &trace_ring.event[trace_ring.head % TRACE_ENTRIES];
+
+    e->ticks = get_ticks();
+    e->name = (uintptr_t)name;
+    e->type = type;
+    e->flags = (cpsr & CPSR_MODE_MASK) == CPSR_MODE_IRQ ? TRACE_FLAG_IRQ : 0;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    trace_ring.head++;
+    irq_restore(flags);
+}
+
+/* enabling starts a new trace, the previous one is discarded */
+void trace_set_enable(bool enable)
+{
+    u32 flags = irq_save();
+    if (enable) {
+        trace_ring.head = 0;
+        trace_ring.hz = get_hz();
+    }
+    trace_ring.enabled = enable;
+    irq_restore(flags);
+}
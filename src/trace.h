@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+/*
+ * Static tracepoints: begin/end/instant events with a timer timestamp and two payload words,
+ * recorded into a RAM ring while tracing is enabled. The event name is a string literal that
+ * the host reads from target memory, see proxyclient/tools/trace2perfetto.py.
+ */
+
+#define TRACE_MAGIC   0x45435254 // "TRCE"
+#define TRACE_ENTRIES 4096
+
+#define TRACE_BEGIN   0
+#define TRACE_END     1
+#define TRACE_INSTANT 2
+
+/* set in trace_event.flags for events recorded in IRQ mode */
+#define TRACE_FLAG_IRQ BIT(0)
+
+/* layout shared with the proxyclient */
+struct trace_event {
+    u64 ticks;
+    u32 name;
+    u16 type;
+    u16 flags;
+    u32 args[2];
+} PACKED;
+
+struct trace_ring {
+    u32 magic;
+    u32 entries;
+    /* number of events ever recorded, the newest one is at (head - 1) % entries */
+    u64 head;
+    u32 enabled;
+    u32 hz;
+    struct trace_event event[TRACE_ENTRIES];
+} PACKED;
+
+extern struct trace_ring trace_ring;
+
+void trace_record(const char *name, u32 type, u32 a0, u32 a1);
+void trace_set_enable(bool enable);
+
+#define __trace_arg(a) ((u32)(uintptr_t)(a))
+#define __trace(name, type, a0, a1, ...)                                                           \
+    do {                                                                                           \
+        if (trace_ring.enabled)                                                                    \
+            trace_record("" name, type, __trace_arg(a0), __trace_arg(a1));                         \
+    } while (0)
+
+#define trace_begin(name, ...)   __trace(name, TRACE_BEGIN, ##__VA_ARGS__, 0, 0)
+#define trace_end(name, ...)     __trace(name, TRACE_END, ##__VA_ARGS__, 0, 0)
+#define trace_instant(name, ...) __trace(name, TRACE_INSTANT, ##__VA_ARGS__, 0, 0)
+
+#endif
@@ -43,6 +43,7 @@ typedef s64 ssize_t;
 #define SZ_2K  (1 << 11)
 #define SZ_4K  (1 << 12)
 #define SZ_16K (1 << 14)
+#define SZ_64K (1 << 16)
 #define SZ_1M  (1 << 20)
 #define SZ_32M (1 << 25)
 
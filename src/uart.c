@@ -4,24 +4,40 @@
 
 #include "adt.h"
 #include "iodev.h"
+#include "ringbuffer.h"
+#include "timer.h"
 #include "types.h"
 #include "uart.h"
 #include "uart_regs.h"
 #include "utils.h"
+#include "vic.h"
 #include "vsprintf.h"
 
 #define UART_CLOCK 24000000
+#define UART_PATH  "/arm-io/uart2"
+
+#define UART_TX_RING_SIZE 4096
+#define UART_RX_RING_SIZE 4096
+
+#define UART_BAUD_SETTLE_US 50000
 
 static uintptr_t uart_base = 0;
 
+/*
+ * Set up by uart_irq_init(). While they exist all TX goes through uart_tx_ring so that polled
+ * and interrupt driven writers stay in order, and the RX interrupt empties the FIFO into
+ * uart_rx_ring so input is not lost while the CPU is busy. The pumps run with IRQs masked.
+ */
+static ringbuffer_t *uart_tx_ring = NULL;
+static ringbuffer_t *uart_rx_ring = NULL;
+static int uart_irq = -1;
+static u32 uart_rx_dropped = 0;
+
 int uart_init(void)
 {
     int path[8];
-    const char *uart_path;
 
-    uart_path = "/arm-io/uart2";
-
-    adt_path_offset_trace(adt, uart_path, path);
+    adt_path_offset_trace(adt, UART_PATH, path);
 
     if (adt_get_reg(adt, path, "reg", 0, &uart_base, NULL)) {
         printf("!!! Failed to get UART reg property!\n");
@@ -29,20 +45,170 @@ int uart_init(void)
     }
 
     write32(uart_base + ULCON, ULCON_CS8);
-    write32(uart_base + UCON, UCON_DEFAULT);
-    write32(uart_base + UFCON, 0);
+    write32(uart_base + UCON, UCON_DEFAULT & ~UCON_TXTHRESH_ENA);
+    write32(uart_base + UFCON, UFCON_DEFAULT | UFCON_TXRESET | UFCON_RXRESET);
     write32(uart_base + UMCON, UMCOM_RTS_LOW);
     uart_setbaud(115200);
 
     return 0;
 }
 
+static size_t uart_rx_fifo_count(void)
+{
+    u32 ufstat = read32(uart_base + UFSTAT);
+
+    if (ufstat & UFSTAT_RXFULL)
+        return UART_FIFO_SIZE;
+
+    return FIELD_GET(UFSTAT_RXCNT, ufstat);
+}
+
+static bool uart_tx_fifo_full(void)
+{
+    return read32(uart_base + UFSTAT) & UFSTAT_TXFULL;
+}
+
+/* move queued bytes into the TX FIFO, the threshold IRQ stays enabled while any are left */
+static void uart_tx_pump(void)
+{
+    const u8 *data;
+    size_t len;
+
+    while ((len = ringbuffer_peek(uart_tx_ring, &data))) {
+        size_t sent = 0;
+
+        while (sent < len && !uart_tx_fifo_full())
+            write32(uart_base + UTXH, data[sent++]);
+
+        ringbuffer_consume(uart_tx_ring, sent);
+        if (sent < len)
+            break;
+    }
+
+    if (ringbuffer_get_used(uart_tx_ring))
+        set32(uart_base + UCON, UCON_TXTHRESH_ENA);
+    else
+        clear32(uart_base + UCON, UCON_TXTHRESH_ENA);
+}
+
+static void uart_rx_pump(void)
+{
+    size_t count;
+
+    while ((count = uart_rx_fifo_count())) {
+        while (count--) {
+            u8 c = read32(uart_base + URXH);
+
+            if (!ringbuffer_write(&c, 1, uart_rx_ring))
+                uart_rx_dropped++;
+        }
+    }
+}
+
+static void uart_irq_handler(void *opaque)
+{
+    UNUSED(opaque);
+
+    /* ack first, anything arriving while we pump raises the interrupt again */
+    uart_clear_irqs();
+    uart_rx_pump();
+    uart_tx_pump();
+}
+
+int uart_irq_init(void)
+{
+    if (!uart_base || uart_tx_ring)
+        return -1;
+
+    uart_irq = vic_get_irq(UART_PATH, 0);
+    if (uart_irq < 0) {
+        printf("UART: no IRQ, staying in polled mode\n");
+        return -1;
+    }
+
+    ringbuffer_t *tx_ring = ringbuffer_alloc(UART_TX_RING_SIZE);
+    ringbuffer_t *rx_ring = ringbuffer_alloc(UART_RX_RING_SIZE);
+    if (!tx_ring || !rx_ring || vic_register_irq(uart_irq, uart_irq_handler, NULL) < 0) {
+        printf("UART: failed to set up IRQ mode, staying in polled mode\n");
+        if (tx_ring)
+            ringbuffer_free(tx_ring);
+        if (rx_ring)
+            ringbuffer_free(rx_ring);
+        uart_irq = -1;
+        return -1;
+    }
+
+    u32 flags = irq_save();
+    uart_tx_ring = tx_ring;
+    uart_rx_ring = rx_ring;
+    uart_rx_dropped = 0;
+    uart_clear_irqs();
+    vic_enable_irq(uart_irq);
+    irq_restore(flags);
+
+    printf("UART: using IRQ %d\n", uart_irq);
+    return 0;
+}
+
+/* back to polled mode, sends whatever is still queued */
+void uart_irq_shutdown(void)
+{
+    if (!uart_tx_ring)
+        return;
+
+    vic_unregister_irq(uart_irq);
+    uart_irq = -1;
+
+    u32 flags = irq_save();
+    while (ringbuffer_get_used(uart_tx_ring))
+        uart_tx_pump();
+
+    ringbuffer_t *tx_ring = uart_tx_ring;
+    ringbuffer_t *rx_ring = uart_rx_ring;
+    uart_tx_ring = uart_rx_ring = NULL;
+    clear32(uart_base + UCON, UCON_TXTHRESH_ENA);
+    uart_clear_irqs();
+    irq_restore(flags);
+
+    if (uart_rx_dropped)
+        printf("UART: dropped %u received bytes, RX ring full\n", uart_rx_dropped);
+
+    ringbuffer_free(tx_ring);
+    ringbuffer_free(rx_ring);
+}
+
+/* append to the TX ring, waiting for room if it is full; kick starts transmission */
+static void uart_queue_bytes(const u8 *p, size_t count, bool kick)
+{
+    while (count) {
+        u32 flags = irq_save();
+        size_t wrote = ringbuffer_write(p, count, uart_tx_ring);
+        if (wrote < count)
+            uart_tx_pump();
+        irq_restore(flags);
+
+        p += wrote;
+        count -= wrote;
+    }
+
+    if (kick) {
+        u32 flags = irq_save();
+        uart_tx_pump();
+        irq_restore(flags);
+    }
+}
+
 void uart_putbyte(u8 c)
 {
     if (!uart_base)
         return;
 
-    while (!(read32(uart_base + UTRSTAT) & UTRSTAT_TXBE))
+    if (uart_tx_ring) {
+        uart_queue_bytes(&c, 1, true);
+        return;
+    }
+
+    while (uart_tx_fifo_full())
         ;
 
     write32(uart_base + UTXH, c);
@@ -50,13 +216,13 @@ void uart_putbyte(u8 c)
 
 u8 uart_getbyte(void)
 {
+    u8 c;
+
     if (!uart_base)
         return 0;
 
-    while (!(read32(uart_base + UTRSTAT) & UTRSTAT_RXD))
-        ;
-
-    return read32(uart_base + URXH);
+    uart_read(&c, 1);
+    return c;
 }
 
 void uart_putchar(u8 c)
@@ -84,30 +250,154 @@ void uart_write(const void *buf, size_t count)
 {
     const u8 *p = buf;
 
+    if (!uart_base)
+        return;
+
+    if (uart_tx_ring) {
+        uart_queue_bytes(p, count, true);
+        return;
+    }
+
     while (count--)
         uart_putbyte(*p++);
 }
 
+/* like uart_write, but in IRQ mode leaves the data in the ring until the next write or flush */
+void uart_queue(const void *buf, size_t count)
+{
+    if (uart_base && uart_tx_ring)
+        uart_queue_bytes(buf, count, false);
+    else
+        uart_write(buf, count);
+}
+
+/* write only what the transmitter takes right now */
+size_t uart_try_write(const void *buf, size_t count)
+{
+    const u8 *p = buf;
+    size_t wrote = 0;
+
+    if (!uart_base)
+        return count;
+
+    if (uart_tx_ring) {
+        u32 flags = irq_save();
+        wrote = ringbuffer_write(p, count, uart_tx_ring);
+        uart_tx_pump();
+        irq_restore(flags);
+        return wrote;
+    }
+
+    while (wrote < count && !uart_tx_fifo_full())
+        write32(uart_base + UTXH, p[wrote++]);
+
+    return wrote;
+}
+
+size_t uart_can_read(void)
+{
+    if (!uart_base)
+        return 0;
+
+    if (uart_rx_ring)
+        return ringbuffer_get_used(uart_rx_ring) + uart_rx_fifo_count();
+
+    return uart_rx_fifo_count();
+}
+
 size_t uart_read(void *buf, size_t count)
 {
     u8 *p = buf;
     size_t recvd = 0;
 
-    while (count--) {
-        *p++ = uart_getbyte();
-        recvd++;
+    if (!uart_base)
+        return 0;
+
+    while (recvd < count) {
+        if (uart_rx_ring) {
+            /* pump by hand too, the caller may have IRQs masked */
+            u32 flags = irq_save();
+            uart_rx_pump();
+            recvd += ringbuffer_read(p + recvd, count - recvd, uart_rx_ring);
+            irq_restore(flags);
+        } else if (uart_rx_fifo_count()) {
+            p[recvd++] = read32(uart_base + URXH);
+        }
     }
 
     return recvd;
 }
 
+static u32 uart_baud_divisor(int baudrate)
+{
+    return ((UART_CLOCK / baudrate + 7) / 16) - 1;
+}
+
 void uart_setbaud(int baudrate)
 {
     if (!uart_base)
         return;
 
     uart_flush();
-    write32(uart_base + UBRDIV, ((UART_CLOCK / baudrate + 7) / 16) - 1);
+    write32(uart_base + UBRDIV, uart_baud_divisor(baudrate));
+}
+
+static void uart_discard_input(void)
+{
+    u8 c;
+
+    while (uart_can_read())
+        uart_read(&c, 1);
+}
+
+/*
+ * Try baudrate and check the link both ways: after a settle delay for the host to switch,
+ * send count copies of pattern, then expect the host to send them back inverted within
+ * timeout_us. The previous rate is restored either way, so the proxy reply goes out at a rate
+ * the host already knows works. Returns the effective baud rate if the exchange was clean.
+ */
+int uart_verify_baud(int baudrate, u32 pattern, u32 count, u32 timeout_us)
+{
+    if (!uart_base || baudrate <= 0 || baudrate > UART_CLOCK / 16 || !count)
+        return -1;
+
+    u32 div = uart_baud_divisor(baudrate);
+    u32 old_div = read32(uart_base + UBRDIV);
+    size_t expect = count * sizeof(pattern);
+    size_t matched = 0;
+
+    uart_flush();
+    write32(uart_base + UBRDIV, div);
+    udelay(UART_BAUD_SETTLE_US);
+    uart_discard_input();
+
+    for (u32 i = 0; i < count; i++)
+        uart_write(&pattern, sizeof(pattern));
+    uart_flush();
+
+    pattern = ~pattern;
+    u64 deadline = get_ticks() + (u64)timeout_us * get_hz() / 1000000;
+    while (matched < expect && get_ticks() < deadline) {
+        u8 c;
+
+        if (!uart_can_read())
+            continue;
+
+        uart_read(&c, 1);
+        if (c != ((u8 *)&pattern)[matched % sizeof(pattern)])
+            break;
+        matched++;
+    }
+
+    /* give the host time to switch back before anything is sent at the old rate */
+    udelay(UART_BAUD_SETTLE_US);
+    write32(uart_base + UBRDIV, old_div);
+    uart_discard_input();
+
+    if (matched < expect)
+        return -1;
+
+    return UART_CLOCK / (16 * (div + 1));
 }
 
 void uart_flush(void)
@@ -115,6 +405,12 @@ void uart_flush(void)
     if (!uart_base)
         return;
 
+    while (uart_tx_ring && ringbuffer_get_used(uart_tx_ring)) {
+        u32 flags = irq_save();
+        uart_tx_pump();
+        irq_restore(flags);
+    }
+
     while (!(read32(uart_base + UTRSTAT) & UTRSTAT_TXE))
         ;
 }
@@ -151,11 +447,7 @@ static bool uart_iodev_can_write(void *opaque)
 static ssize_t uart_iodev_can_read(void *opaque)
 {
     UNUSED(opaque);
-
-    if (!uart_base)
-        return 0;
-
-    return (read32(uart_base + UTRSTAT) & UTRSTAT_RXD) ? 1 : 0;
+    return uart_can_read();
 }
 
 static ssize_t uart_iodev_read(void *opaque, void *buf, size_t len)
@@ -171,11 +463,48 @@ static ssize_t uart_iodev_write(void *opaque, const void *buf, size_t len)
     return len;
 }
 
+static ssize_t uart_iodev_queue(void *opaque, const void *buf, size_t len)
+{
+    UNUSED(opaque);
+    uart_queue(buf, len);
+    return len;
+}
+
+static ssize_t uart_iodev_writev(void *opaque, const struct iodev_iov *iov, int iovcnt)
+{
+    ssize_t ret = 0;
+
+    UNUSED(opaque);
+    for (int i = 0; i < iovcnt; i++) {
+        uart_queue(iov[i].buf, iov[i].len);
+        ret += iov[i].len;
+    }
+    uart_write(NULL, 0);
+
+    return ret;
+}
+
+static void uart_iodev_flush(void *opaque)
+{
+    UNUSED(opaque);
+    uart_flush();
+}
+
+static ssize_t uart_iodev_try_write(void *opaque, const void *buf, size_t len)
+{
+    UNUSED(opaque);
+    return uart_try_write(buf, len);
+}
+
 static struct iodev_ops iodev_uart_ops = {
     .can_read = uart_iodev_can_read,
     .can_write = uart_iodev_can_write,
     .read = uart_iodev_read,
     .write = uart_iodev_write,
+    .try_write = uart_iodev_try_write,
+    .queue = uart_iodev_queue,
+    .writev = uart_iodev_writev,
+    .flush = uart_iodev_flush,
 };
 
 struct iodev iodev_uart = {
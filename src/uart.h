@@ -6,6 +6,8 @@
 #include "types.h"
 
 int uart_init(void);
+int uart_irq_init(void);
+void uart_irq_shutdown(void);
 
 void uart_putbyte(u8 c);
 u8 uart_getbyte(void);
@@ -14,11 +16,15 @@ void uart_putchar(u8 c);
 u8 uart_getchar(void);
 
 void uart_write(const void *buf, size_t count);
+void uart_queue(const void *buf, size_t count);
+size_t uart_try_write(const void *buf, size_t count);
+size_t uart_can_read(void);
 size_t uart_read(void *buf, size_t count);
 
 void uart_puts(const char *s);
 
 void uart_setbaud(int baudrate);
+int uart_verify_baud(int baudrate, u32 pattern, u32 count, u32 timeout_us);
 
 void uart_flush(void);
 
@@ -19,6 +19,20 @@
 
 #define UMCOM_RTS_LOW (1 << 0)
 
+#define UFCON_TXTRIG   GENMASK(7, 6)
+#define UFCON_RXTRIG   GENMASK(5, 4)
+#define UFCON_TXRESET  BIT(2)
+#define UFCON_RXRESET  BIT(1)
+#define UFCON_FIFO_ENA BIT(0)
+
+/* trigger levels of the 16 byte FIFOs: TX fires when empty, RX when half full */
+#define UFCON_TXTRIG_EMPTY 0
+#define UFCON_RXTRIG_8     2
+
+#define UFCON_DEFAULT                                                                              \
+    (FIELD_PREP(UFCON_TXTRIG, UFCON_TXTRIG_EMPTY) | FIELD_PREP(UFCON_RXTRIG, UFCON_RXTRIG_8) |     \
+     UFCON_FIFO_ENA)
+
 #define UCON_TXTHRESH_ENA BIT(13)
 #define UCON_RXTHRESH_ENA BIT(12)
 #define UCON_RXTO_ENA_S5L BIT(11)
@@ -46,4 +60,6 @@
 #define UFSTAT_TXCNT  GENMASK(7, 4)
 #define UFSTAT_RXCNT  GENMASK(3, 0)
 
+#define UART_FIFO_SIZE 16
+
 #endif
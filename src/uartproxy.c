@@ -2,12 +2,16 @@
 
 #include "uartproxy.h"
 #include "assert.h"
+#include "blog.h"
 #include "exception.h"
 #include "iodev.h"
+#include "log.h"
 #include "proxy.h"
 #include "string.h"
+#include "trace.h"
 #include "types.h"
 #include "utils.h"
+#include "tinf/tinf.h"
 
 #define REQ_SIZE 64
 
@@ -21,6 +25,13 @@ typedef struct {
             u64 size;
             u32 dchecksum;
         } mrequest;
+        struct {
+            u64 addr;
+            u64 size;
+            u32 dchecksum;
+            u32 _pad;
+            u64 dest_size;
+        } zrequest;
         u64 features;
     };
     u32 checksum;
@@ -36,6 +47,11 @@ typedef struct {
         struct {
             u32 dchecksum;
         } mreply;
+        struct {
+            u32 dchecksum;
+            u32 _pad;
+            u64 size;
+        } zreply;
         struct uartproxy_msg_start start;
         u64 features;
     };
@@ -57,6 +73,7 @@ static_assert(sizeof(UartReply) == (REPLY_SIZE + 4), "Invalid UartReply size");
 #define REQ_MEMWRITE 0x03AA55FF
 #define REQ_BOOT     0x04AA55FF
 #define REQ_EVENT    0x05AA55FF
+#define REQ_GZWRITE  0x06AA55FF
 
 #define ST_OK      0
 #define ST_BADCMD  -1
@@ -65,7 +82,10 @@ static_assert(sizeof(UartReply) == (REPLY_SIZE + 4), "Invalid UartReply size");
 #define ST_CSUMERR -4
 
 #define PROXY_FEAT_DISABLE_DATA_CSUMS 0x01
-#define PROXY_FEAT_ALL                (PROXY_FEAT_DISABLE_DATA_CSUMS)
+#define PROXY_FEAT_DATA_CHANNEL       0x02
+#define PROXY_FEAT_GZWRITE            0x04
+#define PROXY_FEAT_ALL                                                                             \
+    (PROXY_FEAT_DISABLE_DATA_CSUMS | PROXY_FEAT_DATA_CHANNEL | PROXY_FEAT_GZWRITE)
 
 static u32 iodev_proxy_buffer[IODEV_MAX];
 
@@ -76,6 +96,15 @@ static u32 iodev_proxy_buffer[IODEV_MAX];
 
 static bool disable_data_csums = false;
 
+/*
+ * With PROXY_FEAT_DATA_CHANNEL, REQ_MEMREAD/REQ_MEMWRITE payloads go over the raw bulk
+ * interface of the same USB controller, while requests and replies stay on the command
+ * iodev. While enabled, the data iodev is not scanned for requests. The channel belongs to the
+ * command iodev that negotiated it and is dropped as soon as a request arrives on another one.
+ */
+static iodev_id_t data_iodev = IODEV_MAX;
+static iodev_id_t data_cmd_iodev = IODEV_MAX;
+
 // I just totally pulled this out of my arse
 // Noinline so that this can be bailed out by exc_guard = EXC_RETURN
 // We assume this function does not use the stack
@@ -120,6 +149,107 @@ static u64 data_checksum(void *start, u32 length)
     return checksum(start, length);
 }
 
+/* the data checksum of the proxy protocol, run in place for P_CHECKSUM */
+u32 uartproxy_checksum(void *start, u32 length)
+{
+    return checksum(start, length);
+}
+
+static iodev_id_t uartproxy_data_iodev(iodev_id_t iodev)
+{
+    if (iodev < IODEV_USB0 || iodev >= IODEV_USB0 + USB_IODEV_COUNT)
+        return IODEV_MAX;
+
+    iodev_id_t data = IODEV_USB_BULK0 + (iodev - IODEV_USB0);
+    if (!(iodev_get_usage(data) & USAGE_UARTPROXY))
+        return IODEV_MAX;
+
+    return data;
+}
+
+/*
+ * REQ_GZWRITE decompresses a gzip payload into memory as it arrives, so the compressed data
+ * never has to be staged in a heap buffer and decoding overlaps the transfer.
+ */
+#define GZWRITE_CHUNK SZ_16K
+
+struct gzwrite_stream {
+    iodev_id_t iodev;
+    u64 left;
+    u32 sum;
+    bool error;
+};
+
+static u8 gzwrite_buf[GZWRITE_CHUNK];
+
+static unsigned int gzwrite_refill(void *opaque, const unsigned char **data)
+{
+    struct gzwrite_stream *gz = opaque;
+
+    if (!gz->left || gz->error)
+        return 0;
+
+    // Hand over whatever already arrived instead of waiting for a full chunk
+    size_t len = min(gz->left, (u64)GZWRITE_CHUNK);
+    ssize_t avail = iodev_can_read(gz->iodev);
+    if (avail > 0)
+        len = min(len, (size_t)avail);
+
+    if (iodev_read(gz->iodev, gzwrite_buf, len) != (ssize_t)len) {
+        gz->error = true;
+        return 0;
+    }
+
+    if (!disable_data_csums)
+        gz->sum = checksum_add(gzwrite_buf, len, gz->sum);
+    gz->left -= len;
+    *data = gzwrite_buf;
+    return len;
+}
+
+static int uartproxy_gzwrite(iodev_id_t data, UartRequest *request, UartReply *reply)
+{
+    struct gzwrite_stream gz = {
+        .iodev = data,
+        .left = request->zrequest.size,
+        .sum = CHECKSUM_INIT,
+    };
+    struct tinf_stream stream = {
+        .refill = gzwrite_refill,
+        .opaque = &gz,
+    };
+    unsigned int dest_len = min(request->zrequest.dest_size, (u64)0xffffffff);
+    int status = ST_OK;
+
+    int ret = tinf_gzip_uncompress_stream((void *)request->zrequest.addr, &dest_len, &stream);
+    if (ret != TINF_OK) {
+        printf("Proxy: gzwrite decompression failed: %d\n", ret);
+        status = ST_XFRERR;
+    }
+
+    // Consume the rest of the payload so the stream stays in sync
+    while (gzwrite_refill(&gz, &stream.next))
+        ;
+    if (gz.error)
+        return ST_XFRERR;
+
+    if (disable_data_csums) {
+        u32 sentinel = 0;
+        if (iodev_read(data, &sentinel, sizeof(sentinel)) != sizeof(sentinel) ||
+            sentinel != DATA_END_SENTINEL)
+            return ST_XFRERR;
+        reply->zreply.dchecksum = CHECKSUM_SENTINEL;
+    } else {
+        reply->zreply.dchecksum = checksum_finish(gz.sum);
+    }
+
+    if (reply->zreply.dchecksum != request->zrequest.dchecksum)
+        return ST_XFRERR;
+
+    reply->zreply.size = dest_len;
+    return status;
+}
+
 iodev_id_t uartproxy_iodev;
 
 int uartproxy_run(struct uartproxy_msg_start *start)
@@ -131,6 +261,7 @@ int uartproxy_run(struct uartproxy_msg_start *start)
     u64 enabled_features = 0;
 
     iodev_id_t iodev = IODEV_MAX;
+    iodev_id_t data;
 
     UartRequest request;
     UartReply reply = {REQ_BOOT};
@@ -151,7 +282,9 @@ int uartproxy_run(struct uartproxy_msg_start *start)
             // Look for commands from any iodev on startup
             for (iodev = 0; iodev < IODEV_MAX;) {
                 u8 b;
-                if ((iodev_get_usage(iodev) & USAGE_UARTPROXY)) {
+                if (!iodev)
+                    blog_drain();
+                if ((iodev_get_usage(iodev) & USAGE_UARTPROXY) && iodev != data_iodev) {
                     iodev_handle_events(iodev);
                     if (iodev_can_read(iodev) && iodev_read(iodev, &b, 1) == 1) {
                         iodev_proxy_buffer[iodev] >>= 8;
@@ -197,7 +330,12 @@ int uartproxy_run(struct uartproxy_msg_start *start)
         reply.type = request.type;
         reply.status = ST_OK;
 
+        trace_begin("uartproxy_request", request.type, iodev);
+
         uartproxy_iodev = iodev;
+        if (iodev != data_cmd_iodev)
+            data_iodev = data_cmd_iodev = IODEV_MAX;
+        data = data_iodev != IODEV_MAX ? data_iodev : iodev;
 
         switch (request.type) {
             case REQ_NOP:
@@ -207,15 +345,25 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                     enabled_features &= ~PROXY_FEAT_DISABLE_DATA_CSUMS;
                 }
 
+                data_iodev = IODEV_MAX;
+                if (enabled_features & PROXY_FEAT_DATA_CHANNEL) {
+                    data_iodev = uartproxy_data_iodev(iodev);
+                    if (data_iodev == IODEV_MAX)
+                        enabled_features &= ~PROXY_FEAT_DATA_CHANNEL;
+                }
+                data_cmd_iodev = data_iodev != IODEV_MAX ? iodev : IODEV_MAX;
+
                 disable_data_csums = enabled_features & PROXY_FEAT_DISABLE_DATA_CSUMS;
                 reply.features = enabled_features;
                 break;
             case REQ_PROXY:
+                trace_begin("proxy_process", request.prequest.opcode);
                 ret = proxy_process(&request.prequest, &reply.preply);
+                trace_end("proxy_process", request.prequest.opcode, reply.preply.retval);
                 if (ret != 0)
                     running = 0;
                 if (ret < 0)
-                    printf("Proxy req error: %d\n", ret);
+                    log_err(LOG_PROXY, "Proxy req error: %d\n", ret);
                 break;
             case REQ_MEMREAD:
                 if (request.mrequest.size == 0)
@@ -242,7 +390,7 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                     reply.status = ST_XFRERR;
                     break;
                 }
-                bytes = iodev_read(iodev, (void *)request.mrequest.addr, request.mrequest.size);
+                bytes = iodev_read(data, (void *)request.mrequest.addr, request.mrequest.size);
                 if (bytes != request.mrequest.size) {
                     reply.status = ST_XFRERR;
                     break;
@@ -256,13 +404,28 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                 if (disable_data_csums) {
                     // Check the sentinel that should be present after the data
                     u32 sentinel = 0;
-                    bytes = iodev_read(iodev, &sentinel, sizeof(sentinel));
+                    bytes = iodev_read(data, &sentinel, sizeof(sentinel));
                     if (bytes != sizeof(sentinel) || sentinel != DATA_END_SENTINEL) {
                         reply.status = ST_XFRERR;
                         break;
                     }
                 }
                 break;
+            case REQ_GZWRITE:
+                exc_count = 0;
+                exc_guard = GUARD_SKIP;
+                if (request.zrequest.dest_size != 0) {
+                    // Probe for exception guard, like REQ_MEMWRITE
+                    write8(request.zrequest.addr, 0);
+                    write8(request.zrequest.addr + request.zrequest.dest_size - 1, 0);
+                }
+                exc_guard = GUARD_OFF;
+                if (exc_count) {
+                    reply.status = ST_XFRERR;
+                    break;
+                }
+                reply.status = uartproxy_gzwrite(data, &request, &reply);
+                break;
             default:
                 reply.status = ST_BADCMD;
                 break;
@@ -270,25 +433,35 @@ int uartproxy_run(struct uartproxy_msg_start *start)
         sysop("dsb sy");
         sysop("isb");
         reply.checksum = checksum(&reply, REPLY_SIZE - 4);
-        iodev_lock(uartproxy_iodev);
-        iodev_queue(iodev, &reply, REPLY_SIZE);
 
-        if ((request.type == REQ_MEMREAD) && (reply.status == ST_OK)) {
-            iodev_queue(iodev, (void *)request.mrequest.addr, request.mrequest.size);
+        struct iodev_iov iov[3];
+        int iovcnt = 0;
+        u32 sentinel = DATA_END_SENTINEL;
 
-            if (disable_data_csums) {
-                // Since there is no checksum, put a sentinel after the data so the receiver
-                // can check that no packets were lost.
-                u32 sentinel = DATA_END_SENTINEL;
+        iov[iovcnt++] = (struct iodev_iov){&reply, REPLY_SIZE};
 
-                iodev_queue(iodev, &sentinel, sizeof(sentinel));
-            }
+        if (data != iodev) {
+            // Get the reply out before the payload starts filling up the data pipe
+            iodev_writev(iodev, iov, iovcnt);
+            iodev_flush(iodev);
+            iovcnt = 0;
         }
 
-        iodev_unlock(uartproxy_iodev);
-        // Flush all queued data
-        iodev_write(iodev, NULL, 0);
-        iodev_flush(iodev);
+        if ((request.type == REQ_MEMREAD) && (reply.status == ST_OK)) {
+            iov[iovcnt++] =
+                (struct iodev_iov){(void *)request.mrequest.addr, request.mrequest.size};
+
+            // Since there is no checksum, put a sentinel after the data so the receiver
+            // can check that no packets were lost.
+            if (disable_data_csums)
+                iov[iovcnt++] = (struct iodev_iov){&sentinel, sizeof(sentinel)};
+        }
+
+        if (iovcnt)
+            iodev_writev(data, iov, iovcnt);
+        iodev_flush(data);
+
+        trace_end("uartproxy_request", request.type, reply.status);
     }
 
     return ret;
@@ -309,9 +482,11 @@ void uartproxy_send_event(u16 event_type, void *data, u16 length)
         csum = checksum_start(&hdr, sizeof(UartEventHdr));
         csum = checksum_finish(checksum_add(data, length, csum));
     }
-    iodev_lock(uartproxy_iodev);
-    iodev_queue(uartproxy_iodev, &hdr, sizeof(UartEventHdr));
-    iodev_queue(uartproxy_iodev, data, length);
-    iodev_write(uartproxy_iodev, &csum, sizeof(csum));
-    iodev_unlock(uartproxy_iodev);
+
+    struct iodev_iov iov[] = {
+        {&hdr, sizeof(UartEventHdr)},
+        {data, length},
+        {&csum, sizeof(csum)},
+    };
+    iodev_writev(uartproxy_iodev, iov, ARRAY_SIZE(iov));
 }
@@ -41,5 +41,6 @@ struct uartproxy_msg_start {
 
 int uartproxy_run(struct uartproxy_msg_start *start);
 void uartproxy_send_event(u16 event_type, void *data, u16 length);
+u32 uartproxy_checksum(void *start, u32 length);
 
 #endif
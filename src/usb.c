@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: MIT */
 
+#include "../build/build_cfg.h"
+
 #include "usb.h"
 #include "adt.h"
 #include "clkrstgen.h"
@@ -10,10 +12,18 @@
 #include "usb_dwc2.h"
 #include "usbphy.h"
 #include "utils.h"
+#include "vic.h"
 #include "vsprintf.h"
 
 bool usb_is_initialized = false;
 
+/* scatter/gather descriptor DMA is opt-in (make USB_DESC_DMA=1) */
+#ifdef USB_DESC_DMA
+#define USB_DWC2_DESC_DMA true
+#else
+#define USB_DWC2_DESC_DMA false
+#endif
+
 #if USB_IODEV_COUNT > 100
 #error "USB_IODEV_COUNT is limited to 100 to prevent overflow in ADT path names"
 #endif
@@ -39,11 +49,29 @@ bool usb_is_initialized = false;
         return usb_##driver##_write(dev, pipe, buf, count);                                        \
     }                                                                                              \
                                                                                                    \
+    static ssize_t usb_##driver##_##name##_try_write(void *dev, const void *buf, size_t count)     \
+    {                                                                                              \
+        return usb_##driver##_try_write(dev, pipe, buf, count);                                    \
+    }                                                                                              \
+                                                                                                   \
     static ssize_t usb_##driver##_##name##_queue(void *dev, const void *buf, size_t count)         \
     {                                                                                              \
         return usb_##driver##_queue(dev, pipe, buf, count);                                        \
     }                                                                                              \
                                                                                                    \
+    /* queue everything first so the IN transfer is started once, with all of it */                \
+    static ssize_t usb_##driver##_##name##_writev(void *dev, const struct iodev_iov *iov,          \
+                                                  int iovcnt)                                      \
+    {                                                                                              \
+        ssize_t ret = 0;                                                                           \
+                                                                                                   \
+        for (int i = 0; i < iovcnt; i++)                                                           \
+            ret += usb_##driver##_queue(dev, pipe, iov[i].buf, iov[i].len);                        \
+                                                                                                   \
+        usb_##driver##_write(dev, pipe, NULL, 0);                                                  \
+        return ret;                                                                                \
+    }                                                                                              \
+                                                                                                   \
     static void usb_##driver##_##name##_handle_events(void *dev)                                   \
     {                                                                                              \
         usb_##driver##_handle_events(dev);                                                         \
@@ -55,7 +83,49 @@ bool usb_is_initialized = false;
     }
 
 USB_IODEV_WRAPPER(dwc2, 0, CDC_ACM_PIPE_0)
-USB_IODEV_WRAPPER(dwc2, 1, CDC_ACM_PIPE_1)
+USB_IODEV_WRAPPER(dwc2, bulk, USB_BULK_PIPE)
+
+/*
+ * The vuart is a byte bridge for next-stage code and kernel consoles. Nothing guarantees that
+ * the host has its tty open, so writes drop (and count) what does not fit in the ringbuffer and
+ * flush just kicks the IN endpoint; a stalled reader costs dropped bytes instead of a stalled
+ * proxy.
+ */
+static ssize_t usb_dwc2_vuart_can_read(void *dev)
+{
+    return usb_dwc2_can_read(dev, CDC_ACM_PIPE_1);
+}
+
+static bool usb_dwc2_vuart_can_write(void *dev)
+{
+    return usb_dwc2_write_room(dev, CDC_ACM_PIPE_1) != 0;
+}
+
+static ssize_t usb_dwc2_vuart_read(void *dev, void *buf, size_t count)
+{
+    return usb_dwc2_read(dev, CDC_ACM_PIPE_1, buf, count);
+}
+
+static ssize_t usb_dwc2_vuart_write(void *dev, const void *buf, size_t count)
+{
+    return usb_dwc2_write_nonblock(dev, CDC_ACM_PIPE_1, buf, count);
+}
+
+/* the console keeps its own copy, so a partial write here is not a drop */
+static ssize_t usb_dwc2_vuart_try_write(void *dev, const void *buf, size_t count)
+{
+    return usb_dwc2_try_write(dev, CDC_ACM_PIPE_1, buf, count);
+}
+
+static void usb_dwc2_vuart_flush(void *dev)
+{
+    usb_dwc2_write_nonblock(dev, CDC_ACM_PIPE_1, NULL, 0);
+}
+
+static void usb_dwc2_vuart_handle_events(void *dev)
+{
+    usb_dwc2_handle_events(dev);
+}
 
 #define USB_IODEV_OPS(driver, name, pipe)                                                          \
     {                                                                                              \
@@ -63,13 +133,25 @@ USB_IODEV_WRAPPER(dwc2, 1, CDC_ACM_PIPE_1)
         .can_write = usb_##driver##_##name##_can_write,                                            \
         .read = usb_##driver##_##name##_read,                                                      \
         .write = usb_##driver##_##name##_write,                                                    \
+        .try_write = usb_##driver##_##name##_try_write,                                            \
         .queue = usb_##driver##_##name##_queue,                                                    \
+        .writev = usb_##driver##_##name##_writev,                                                  \
         .flush = usb_##driver##_##name##_flush,                                                    \
         .handle_events = usb_##driver##_##name##_handle_events,                                    \
     }
 
 static struct iodev_ops iodev_usb_dwc2_ops = USB_IODEV_OPS(dwc2, 0, CDC_ACM_PIPE_0);
-static struct iodev_ops iodev_usb_dwc2_sec_ops = USB_IODEV_OPS(dwc2, 1, CDC_ACM_PIPE_1);
+static struct iodev_ops iodev_usb_dwc2_vuart_ops = {
+    .can_read = usb_dwc2_vuart_can_read,
+    .can_write = usb_dwc2_vuart_can_write,
+    .read = usb_dwc2_vuart_read,
+    .write = usb_dwc2_vuart_write,
+    .try_write = usb_dwc2_vuart_try_write,
+    .queue = usb_dwc2_vuart_write,
+    .flush = usb_dwc2_vuart_flush,
+    .handle_events = usb_dwc2_vuart_handle_events,
+};
+static struct iodev_ops iodev_usb_dwc2_bulk_ops = USB_IODEV_OPS(dwc2, bulk, USB_BULK_PIPE);
 
 struct iodev iodev_usb_vuart = {
     .usage = 0,
@@ -168,6 +250,29 @@ int usbphy_init(u32 idx)
     return 0;
 }
 
+static int usb_irqs[USB_IODEV_COUNT];
+
+static void usb_dwc2_irq(void *opaque)
+{
+    usb_dwc2_handle_interrupts(opaque);
+}
+
+static void usb_iodev_irq_setup(u32 idx, dwc2_dev_t *opaque)
+{
+    char dwc2_adt_path[sizeof(FMT_DWC2_PATH)];
+    snprintf(dwc2_adt_path, sizeof(dwc2_adt_path), FMT_DWC2_PATH, idx, idx);
+
+    usb_irqs[idx] = vic_get_irq(dwc2_adt_path, 0);
+    if (usb_irqs[idx] < 0 || vic_register_irq(usb_irqs[idx], usb_dwc2_irq, opaque) < 0) {
+        printf("USB%d: no IRQ, falling back to polling\n", idx);
+        usb_irqs[idx] = -1;
+        return;
+    }
+
+    vic_enable_irq(usb_irqs[idx]);
+    printf("USB%d: using IRQ %d\n", idx, usb_irqs[idx]);
+}
+
 dwc2_dev_t *usb_iodev_bringup(u32 idx)
 {
     char dwc2_adt_path[sizeof(FMT_DWC2_PATH)];
@@ -184,7 +289,7 @@ dwc2_dev_t *usb_iodev_bringup(u32 idx)
         return NULL;
     }
 
-    return usb_dwc2_init(DWC2Base);
+    return usb_dwc2_init(DWC2Base, USB_DWC2_DESC_DMA);
 }
 
 void usb_init(void)
@@ -222,27 +327,176 @@ void usb_iodev_init(void)
 
         iodev_register_device(IODEV_USB0 + i, usb_iodev);
         printf("USB%d: initialized at %p\n", i, opaque);
+
+        usb_iodev_irq_setup(i, opaque);
+
+        /*
+         * The raw bulk interface is proxy-only: nothing drains it unless a host has the
+         * interface claimed, so it must not be used as a console.
+         */
+        usb_iodev = memalign(SPINLOCK_ALIGN, sizeof(*usb_iodev));
+        if (!usb_iodev)
+            continue;
+
+        usb_iodev->ops = &iodev_usb_dwc2_bulk_ops;
+        usb_iodev->opaque = opaque;
+        usb_iodev->usage = USAGE_UARTPROXY;
+        spin_init(&usb_iodev->lock);
+
+        iodev_register_device(IODEV_USB_BULK0 + i, usb_iodev);
     }
 }
 
 void usb_iodev_shutdown(void)
 {
     for (int i = 0; i < USB_IODEV_COUNT; i++) {
-        struct iodev *usb_iodev = iodev_unregister_device(IODEV_USB0 + i);
+        struct iodev *usb_iodev = iodev_unregister_device(IODEV_USB_BULK0 + i);
+        free(usb_iodev);
+
+        usb_iodev = iodev_unregister_device(IODEV_USB0 + i);
         if (!usb_iodev)
             continue;
 
         printf("USB%d: shutdown\n", i);
+        if (usb_irqs[i] >= 0)
+            vic_unregister_irq(usb_irqs[i]);
         usb_dwc2_shutdown(usb_iodev->opaque);
         free(usb_iodev);
     }
 }
 
-void usb_iodev_vuart_setup(iodev_id_t iodev)
+static dwc2_dev_t *usb_iodev_get_dwc2(iodev_id_t iodev)
+{
+    if (iodev < IODEV_USB0 || iodev >= IODEV_MUX0)
+        return NULL;
+
+    return iodev_get_opaque(iodev);
+}
+
+int usb_iodev_get_stats(iodev_id_t iodev, void *buf, size_t size, bool reset)
+{
+    dwc2_dev_t *opaque = usb_iodev_get_dwc2(iodev);
+    if (!opaque || size < sizeof(struct usb_dwc2_stats))
+        return -1;
+
+    usb_dwc2_get_stats(opaque, buf, reset);
+    return sizeof(struct usb_dwc2_stats);
+}
+
+/*
+ * The raw bulk interface is taken away from the proxy while it is used for something else
+ * (source/sink, mass storage), since its data no longer goes through the ringbuffers.
+ */
+static dwc2_dev_t *usb_iodev_claim_bulk(iodev_id_t iodev, bool claim)
+{
+    static iodev_usage_t saved_usage[USB_IODEV_COUNT];
+
+    if (iodev < IODEV_USB_BULK0 || iodev >= IODEV_USB_BULK0 + USB_IODEV_COUNT)
+        return NULL;
+
+    dwc2_dev_t *opaque = usb_iodev_get_dwc2(iodev);
+    if (!opaque)
+        return NULL;
+
+    u32 idx = iodev - IODEV_USB_BULK0;
+    if (claim && iodev_get_usage(iodev)) {
+        saved_usage[idx] = iodev_get_usage(iodev);
+        iodev_set_usage(iodev, 0);
+    } else if (!claim && saved_usage[idx]) {
+        iodev_set_usage(iodev, saved_usage[idx]);
+        saved_usage[idx] = 0;
+    }
+
+    return opaque;
+}
+
+/*
+ * Resize the ringbuffers behind a USB iodev: USB<n> is the proxy pipe, USB_VUART the second
+ * ACM pipe and USB_BULK<n> the raw bulk interface.
+ */
+int usb_iodev_set_buffer_size(iodev_id_t iodev, size_t host2device_size, size_t device2host_size)
+{
+    dwc2_dev_t *opaque = usb_iodev_get_dwc2(iodev);
+    cdc_acm_pipe_id_t pipe = CDC_ACM_PIPE_0;
+
+    if (iodev == IODEV_USB_VUART) {
+        opaque = iodev_usb_vuart.opaque;
+        pipe = CDC_ACM_PIPE_1;
+    } else if (iodev >= IODEV_USB_BULK0) {
+        pipe = USB_BULK_PIPE;
+    }
+
+    if (!opaque)
+        return -1;
+
+    return usb_dwc2_set_buffer_size(opaque, pipe, host2device_size, device2host_size);
+}
+
+/* turn the raw bulk interface into a source/sink for link throughput tests */
+int usb_iodev_source_sink(iodev_id_t iodev, bool enable, void *stats)
+{
+    dwc2_dev_t *opaque = usb_iodev_claim_bulk(iodev, enable);
+    if (!opaque)
+        return -1;
+
+    usb_dwc2_source_sink(opaque, enable, stats);
+    return 0;
+}
+
+/*
+ * Expose a RAM window as a USB disk on the raw bulk interface. The device re-enumerates, so
+ * the caller loses its connection if it talks to us over the same controller.
+ */
+int usb_iodev_msc_start(iodev_id_t iodev, void *base, size_t size)
+{
+    dwc2_dev_t *opaque = usb_iodev_claim_bulk(iodev, true);
+    if (!opaque)
+        return -1;
+
+    if (usb_dwc2_msc_start(opaque, base, size) < 0) {
+        usb_iodev_claim_bulk(iodev, false);
+        return -1;
+    }
+
+    return 0;
+}
+
+int usb_iodev_msc_stop(iodev_id_t iodev)
+{
+    dwc2_dev_t *opaque = usb_iodev_claim_bulk(iodev, false);
+    if (!opaque)
+        return -1;
+
+    usb_dwc2_msc_stop(opaque);
+    return 0;
+}
+
+int usb_iodev_msc_status(iodev_id_t iodev, void *buf, size_t size)
+{
+    dwc2_dev_t *opaque = usb_iodev_get_dwc2(iodev);
+    if (!opaque || size < sizeof(struct usb_msc_status))
+        return -1;
+
+    if (usb_dwc2_msc_status(opaque, buf) < 0)
+        return -1;
+
+    return sizeof(struct usb_msc_status);
+}
+
+/* bind the vuart iodev to the second ACM pipe of the controller behind USB<n> */
+int usb_iodev_vuart_setup(iodev_id_t iodev)
 {
     if (iodev < IODEV_USB0 || iodev >= IODEV_USB0 + USB_IODEV_COUNT)
-        return;
+        return -1;
 
-    iodev_usb_vuart.ops = &iodev_usb_dwc2_sec_ops;
-    iodev_usb_vuart.opaque = iodev_get_opaque(iodev);
+    dwc2_dev_t *opaque = iodev_get_opaque(iodev);
+    if (!opaque)
+        return -1;
+
+    iodev_lock(IODEV_USB_VUART);
+    iodev_usb_vuart.ops = &iodev_usb_dwc2_vuart_ops;
+    iodev_usb_vuart.opaque = opaque;
+    iodev_unlock(IODEV_USB_VUART);
+
+    return 0;
 }
@@ -9,6 +9,12 @@
 void usb_init(void);
 void usb_iodev_init(void);
 void usb_iodev_shutdown(void);
-void usb_iodev_vuart_setup(iodev_id_t iodev);
+int usb_iodev_vuart_setup(iodev_id_t iodev);
+int usb_iodev_get_stats(iodev_id_t iodev, void *buf, size_t size, bool reset);
+int usb_iodev_set_buffer_size(iodev_id_t iodev, size_t host2device_size, size_t device2host_size);
+int usb_iodev_source_sink(iodev_id_t iodev, bool enable, void *stats);
+int usb_iodev_msc_start(iodev_id_t iodev, void *base, size_t size);
+int usb_iodev_msc_stop(iodev_id_t iodev);
+int usb_iodev_msc_status(iodev_id_t iodev, void *buf, size_t size);
 
 #endif
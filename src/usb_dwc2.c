@@ -16,25 +16,40 @@
 #include <assert.h>
 
 #include "adt.h"
+#include "blog.h"
+#include "log.h"
 #include "malloc.h"
 #include "memory.h"
 #include "ringbuffer.h"
 #include "string.h"
+#include "timer.h"
+#include "trace.h"
 #include "types.h"
 #include "uart.h"
 #include "usb_dwc2.h"
 #include "usb_dwc2_regs.h"
+#include "usb_msc.h"
 #include "usb_types.h"
 #include "utils.h"
 
-#define MAX_ENDPOINTS   8
-#define CDC_BUFFER_SIZE SZ_1M
+#define MAX_ENDPOINTS USB_DWC2_MAX_ENDPOINTS
 
-#define usb_debug_printf(fmt, ...) // uart_printf("usb-dwc2: " fmt, ##__VA_ARGS__)
-// many printf commented due to strict timing requirements
-// macos is less strict than linux
-
-#define usb_error_printf(fmt, ...) uart_printf("usb-dwc2[ERR]: " fmt, ##__VA_ARGS__)
+/*
+ * Debug output goes to the binary log: printing from event handling breaks USB timing (macos
+ * is less strict than linux), recording a blog entry does not. It is off by default, and the
+ * arguments (register reads included) are only evaluated once it is turned on.
+ */
+#define usb_debug_printf(fmt, ...)                                                                 \
+    do {                                                                                           \
+        if (log_enabled(LOG_USB, LOG_DEBUG))                                                       \
+            blog("usb-dwc2: " fmt, ##__VA_ARGS__);                                                 \
+    } while (0)
+
+#define usb_error_printf(fmt, ...)                                                                 \
+    do {                                                                                           \
+        if (log_enabled(LOG_USB, LOG_ERR))                                                         \
+            uart_printf("usb-dwc2[ERR]: " fmt, ##__VA_ARGS__);                                     \
+    } while (0)
 
 #define STRING_DESCRIPTOR_LANGUAGES    0
 #define STRING_DESCRIPTOR_MANUFACTURER 1
@@ -52,6 +67,18 @@
 #define CDC_INTERFACE_PROTOCOL_NONE 0x00
 #define CDC_INTERFACE_PROTOCOL_AT   0x01
 
+#define USB_INTERFACE_CLASS_VENDOR 0xff
+
+#define MSC_INTERFACE_CLASS        0x08
+#define MSC_INTERFACE_SUBCLASS     0x06 // SCSI transparent command set
+#define MSC_INTERFACE_PROTOCOL_BOT 0x50
+
+#define USB_REQUEST_MSC_GET_MAX_LUN 0xfe
+#define USB_REQUEST_MSC_RESET       0xff
+
+/* the raw bulk interface number, which turns into the mass-storage one in MSC mode */
+#define USB_BULK_INTERFACE 4
+
 #define TRB_BUFFER_SIZE  SZ_16K
 #define XFER_BUFFER_SIZE (SZ_16K * MAX_ENDPOINTS * 2)
 #define PAD_BUFFER_SIZE  SZ_16K
@@ -64,7 +91,31 @@
 #define EVENT_BUFFER_IOVA 0xdead0000
 #define XFER_BUFFER_IOVA  0xbabe0000
 #define TRB_BUFFER_IOVA   0xf00d0000
-#define DMA_BUFFER_SIZE   (0x4000 / 4) // diviced between 4 endpoints
+#define DMA_BUFFER_SIZE   XFER_SIZE
+
+/*
+ * descriptor DMA: a transfer is chained over up to DESCS_PER_EP descriptors of at most
+ * DESC_SEG_SIZE each, whole packets so that only the last one ends short
+ */
+#define DESCS_PER_EP  8
+#define DESC_SEG_SIZE (DWC2_DMA_DESC_NBYTES_MASK & ~(BULK_EP_MAX_PACKET_SIZE - 1))
+
+/* an OUT transfer is only armed with XFER_SIZE free, so leave room for one unread transfer */
+#define MIN_BUFFER_SIZE (2 * XFER_SIZE)
+
+/*
+ * MSC data stages and CDC transfers with descriptor DMA are armed straight over the window or
+ * ring memory, up to this much at a time, as far as the DxEPTSIZ fields (buffer DMA) and
+ * DESCS_PER_EP (descriptor DMA) allow.
+ */
+#define MSC_MAX_XFER_SIZE  (SZ_16K * 16)
+#define RING_MAX_XFER_SIZE MSC_MAX_XFER_SIZE
+
+/* the window gets cache maintenance around DMA, so it must not share lines with other data */
+#define MSC_WINDOW_ALIGN 64
+
+/* how long the soft disconnect is held so the host notices the device went away */
+#define RECONNECT_DELAY_MS 100
 
 /* these map to the control endpoint 0x00/0x80 */
 #define USB_LEP_CTRL_OUT 0
@@ -84,12 +135,40 @@
 #define USB_LEP_CDC_BULK_OUT_2 6
 #define USB_LEP_CDC_BULK_IN_2  7
 
+/* raw bulk interface, reusing the unused directions of physical endpoints 0x01 and 0x82 */
+#define USB_LEP_BULK_OUT 8
+#define USB_LEP_BULK_IN  9
+
 #define BULK_EP_MAX_PACKET_SIZE 0x200
-#define RX_FIFO_SIZE            ((4 * 1 + 6) + 2 * ((BULK_EP_MAX_PACKET_SIZE / 4) + 8) + 1)
-#define TX_FIFO_SIZE            (2 * (BULK_EP_MAX_PACKET_SIZE / 4))
 #define RECV_DATA               1
 
-static const u8 phyEndpoints[] = {0x0, 0x80, 0x81, 0x2, 0x83, 0x84, 0x05, 0x86};
+/*
+ * FIFO RAM partitioning, in 32-bit words. The RX FIFO follows the databook sizing rule
+ * (control endpoint setup packets, RX_FIFO_PACKETS bulk packets plus status words, two
+ * transfer complete words per OUT endpoint). EP0 and the CDC notification endpoints get one
+ * packet each, everything else is split between the bulk IN endpoints.
+ */
+#define RX_FIFO_PACKETS 4
+#define RX_FIFO_SIZE                                                                               \
+    ((4 * 1 + 6) + RX_FIFO_PACKETS * ((BULK_EP_MAX_PACKET_SIZE / 4) + 1) + 2 * 4 + 1)
+#define EP0_TX_FIFO_SIZE  (EP0_MAX_PACKET_SIZE / 4)
+#define INTR_TX_FIFO_SIZE (64 / 4)
+#define BULK_TX_FIFO_MIN  (2 * (BULK_EP_MAX_PACKET_SIZE / 4))
+#define BULK_TX_FIFO_MAX  (8 * (BULK_EP_MAX_PACKET_SIZE / 4))
+/* descriptor DMA keeps per-endpoint state at the top of FIFO RAM, above EPInfoBase */
+#define EP_INFO_SIZE (4 * 16)
+
+static const u8 phyEndpoints[] = {0x0, 0x80, 0x81, 0x2, 0x83, 0x84, 0x05, 0x86, 0x01, 0x82};
+
+/*
+ * Default ringbuffer size per pipe and direction. Only the proxy pipe gets a large one, the
+ * others can be grown with usb_dwc2_set_buffer_size() for bulk sessions.
+ */
+static const size_t default_buffer_size[USB_PIPE_MAX] = {
+    [CDC_ACM_PIPE_0] = SZ_1M,
+    [CDC_ACM_PIPE_1] = SZ_64K,
+    [USB_BULK_PIPE] = SZ_64K,
+};
 
 /* content doesn't matter at all, this is the setting linux writes by default */
 static const u8 cdc_default_line_coding[] = {0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08};
@@ -108,6 +187,13 @@ enum ep0_state {
     USB_DWC2_EP0_STATE_DATA_SEND_STATUS_DONE
 };
 
+enum msc_state {
+    USB_DWC2_MSC_STATE_CBW,
+    USB_DWC2_MSC_STATE_DATA_IN,
+    USB_DWC2_MSC_STATE_DATA_OUT,
+    USB_DWC2_MSC_STATE_CSW,
+};
+
 typedef struct dwc2_endpoint {
     bool xfer_in_progress;
     bool zlp_pending;
@@ -118,8 +204,28 @@ typedef struct dwc2_endpoint {
     void *xfer_buffer;
     bool transfer_max;
     u16 max_packet_size;
+    /* descriptor DMA ring and length of the currently armed transfer */
+    struct dwc2_dma_desc *desc;
+    u32 desc_count;
+    u32 xfer_len;
+    /*
+     * the armed transfer runs straight over xfer_ring memory instead of xfer_buffer, and
+     * retired_ring is one a resize replaced under it, freed once that transfer is over
+     */
+    bool xfer_direct;
+    ringbuffer_t *xfer_ring;
+    ringbuffer_t *retired_ring;
+    /* completion time of the last transfer that has not been re-armed yet, or 0 */
+    u64 done_ticks;
+    bool ring_full;
 } dwc2_endpoint_t;
 
+/* a piece of memory a descriptor chain is built over */
+struct dwc2_span {
+    void *buf;
+    u32 len;
+};
+
 typedef struct dwc2_dev {
     /* USB DRD */
     uintptr_t regs;
@@ -129,26 +235,59 @@ typedef struct dwc2_dev {
     u32 ep0_buffer_len;
     void *ep0_read_buffer;
     void *dma_page_p;
+    struct dwc2_dma_desc *desc_page_p;
     u32 ep0_read_buffer_len;
+    bool desc_dma;
 
     const union usb_setup_packet *setup_pkt;
 
     dwc2_endpoint_t endpoints[MAX_ENDPOINTS];
 
+    /* ringbuffers are allocated from the foreground once the pipe is first ready */
     struct {
         ringbuffer_t *host2device;
         ringbuffer_t *device2host;
+        size_t host2device_size;
+        size_t device2host_size;
         u8 ep_intr;
         u8 ep_in;
         u8 ep_out;
         bool ready;
         /* USB ACM CDC serial */
         u8 cdc_line_coding[7];
-    } pipe[CDC_ACM_PIPE_MAX];
+    } pipe[USB_PIPE_MAX];
+
+    struct usb_dwc2_stats stats;
+
+    /*
+     * g_zero style source/sink on the raw bulk pipe: IN sends an endless stream and OUT
+     * checks and drops everything. The pattern is a little endian u32 counter over the
+     * byte offset in the stream, so a lost packet shows up as an error.
+     */
+    struct {
+        bool enabled;
+        struct usb_dwc2_source_sink_stats stats;
+    } source_sink;
 
+    /*
+     * Bulk-only mass storage on the raw bulk endpoints, exposing a RAM window. The data
+     * stage DMAs straight to and from the window, only the first useful bytes of it are
+     * real data and the rest up to total is zero padding (IN) or discarded (OUT).
+     */
+    struct {
+        bool enabled;
+        enum msc_state state;
+        struct usb_msc_cbw cbw;
+        struct usb_msc_data data;
+        u32 useful;
+        u32 total;
+        u32 done;
+        u32 chunk;
+        u8 status;
+        usb_msc_t scsi;
+    } msc;
 } dwc2_dev_t;
 
-u32 next_tx_fifo_addr = 0;
 static const struct usb_string_descriptor str_manufacturer =
     make_usb_string_descriptor("Haywire Linux");
 static const struct usb_string_descriptor str_product =
@@ -176,6 +315,9 @@ struct cdc_dev_desc {
     const struct usb_interface_descriptor sec_interface_data;
     const struct usb_endpoint_descriptor sec_endpoint_data_in;
     const struct usb_endpoint_descriptor sec_endpoint_data_out;
+    const struct usb_interface_descriptor bulk_interface;
+    const struct usb_endpoint_descriptor bulk_endpoint_out;
+    const struct usb_endpoint_descriptor bulk_endpoint_in;
 } PACKED;
 
 static const struct usb_device_descriptor usb_cdc_device_descriptor = {
@@ -201,7 +343,7 @@ static const struct cdc_dev_desc cdc_configuration_descriptor = {
             .bLength = sizeof(cdc_configuration_descriptor.configuration),
             .bDescriptorType = USB_CONFIGURATION_DESCRIPTOR,
             .wTotalLength = sizeof(cdc_configuration_descriptor),
-            .bNumInterfaces = 4,
+            .bNumInterfaces = 5,
             .bConfigurationValue = 1,
             .iConfiguration = 0,
             .bmAttributes = USB_CONFIGURATION_ATTRIBUTE_RES1 | USB_CONFIGURATION_SELF_POWERED,
@@ -345,8 +487,58 @@ static const struct cdc_dev_desc cdc_configuration_descriptor = {
             .wMaxPacketSize = 512,
             .bInterval = 10,
         },
+
+    /*
+     * vendor-specific interface with a plain bulk pair, for hosts talking to us through
+     * libusb instead of a tty
+     */
+    .bulk_interface =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_interface),
+            .bDescriptorType = USB_INTERFACE_DESCRIPTOR,
+            .bInterfaceNumber = USB_BULK_INTERFACE,
+            .bAlternateSetting = 0,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_INTERFACE_CLASS_VENDOR,
+            .bInterfaceSubClass = 0,
+            .bInterfaceProtocol = 0,
+            .iInterface = 0,
+        },
+    .bulk_endpoint_out =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_endpoint_out),
+            .bDescriptorType = USB_ENDPOINT_DESCRIPTOR,
+            .bEndpointAddress = USB_ENDPOINT_ADDR_OUT(phyEndpoints[USB_LEP_BULK_OUT]),
+            .bmAttributes = USB_ENDPOINT_ATTR_TYPE_BULK,
+            .wMaxPacketSize = 512,
+            .bInterval = 0,
+        },
+    .bulk_endpoint_in =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_endpoint_in),
+            .bDescriptorType = USB_ENDPOINT_DESCRIPTOR,
+            .bEndpointAddress = USB_ENDPOINT_ADDR_IN(phyEndpoints[USB_LEP_BULK_IN] & 0xf),
+            .bmAttributes = USB_ENDPOINT_ATTR_TYPE_BULK,
+            .wMaxPacketSize = 512,
+            .bInterval = 0,
+        },
 };
 
+/* replaces bulk_interface in the configuration descriptor while in MSC mode */
+static const struct usb_interface_descriptor msc_interface_descriptor = {
+    .bLength = sizeof(msc_interface_descriptor),
+    .bDescriptorType = USB_INTERFACE_DESCRIPTOR,
+    .bInterfaceNumber = USB_BULK_INTERFACE,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = MSC_INTERFACE_CLASS,
+    .bInterfaceSubClass = MSC_INTERFACE_SUBCLASS,
+    .bInterfaceProtocol = MSC_INTERFACE_PROTOCOL_BOT,
+    .iInterface = 0,
+};
+
+static u8 msc_configuration_descriptor[sizeof(cdc_configuration_descriptor)] ALIGNED(4);
+
 static const struct usb_device_qualifier_descriptor usb_cdc_device_qualifier_descriptor = {
     .bLength = sizeof(struct usb_device_qualifier_descriptor),
     .bDescriptorType = USB_DEVICE_QUALIFIER_DESCRIPTOR,
@@ -375,10 +567,19 @@ static const char *ep0_state_names[] = {
 static void usb_set_address(dwc2_dev_t *dev, u8 address);
 static void usb_dwc2_ep_hw_recv(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count);
 static void usb_dwc2_ep_hw_send(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count);
+static int usb_dwc2_ep_hw_recv_buf(dwc2_dev_t *dev, u8 ep, void *buf, u32 hw_xfer_size,
+                                   u32 packet_count);
+static int usb_dwc2_ep_hw_send_buf(dwc2_dev_t *dev, u8 ep, void *buf, u32 hw_xfer_size,
+                                   u32 packet_count);
+static int usb_dwc2_ep_hw_send_spans(dwc2_dev_t *dev, u8 ep, const struct dwc2_span *spans,
+                                     u32 nspans, u32 packet_count);
+static u32 usb_dwc2_ep_out_xfer_size(dwc2_dev_t *dev, u8 ep);
+static void usb_dwc2_ep_rearm_desc(dwc2_dev_t *dev, u8 ep);
 static void usb_dwc2_ep_abort(dwc2_dev_t *dev, u8 ep);
 static int usb_dwc2_start_status_phase(dwc2_dev_t *dev, u8 ep);
 static void usb_dwc2_cdc_start_bulk_out_xfer(dwc2_dev_t *dev, u8 endpoint_number);
 static void usb_dwc2_cdc_start_bulk_in_xfer(dwc2_dev_t *dev, u8 endpoint_number);
+static void usb_dwc2_msc_reset(dwc2_dev_t *dev);
 
 #ifdef LOG_REGISTER_RW
 static void USB_DEBUG_PRINT_REGISTERS(dwc2_dev_t *dev)
@@ -460,25 +661,31 @@ static void USB_DEBUG_PRINT_REGISTERS(dwc2_dev_t *dev)
     USB_DEBUG_REG_VALUE(DWC2_DOEPDMA(1));
 }
 
-u64 debug_reg_base = 0;
-static inline void write32(u64 addr, u32 data)
+/* trace register writes from here on, the wrappers still see the utils.h versions */
+static uintptr_t debug_reg_base;
+
+static inline void usb_dwc2_trace_write32(uintptr_t addr, u32 data)
 {
     if (addr != debug_reg_base + DWC2_GINTSTS)
-        usb_debug_printf("wr%x %x\n", addr - debug_reg_base, data);
+        usb_debug_printf("wr%x %x\n", (u32)(addr - debug_reg_base), data);
     write32(addr, data);
 }
 
-static inline void set32(u64 addr, u32 data)
+static inline u32 usb_dwc2_trace_set32(uintptr_t addr, u32 data)
 {
-    usb_debug_printf("or%x %x\n", addr - debug_reg_base, data);
-    set32(addr, data);
+    usb_debug_printf("or%x %x\n", (u32)(addr - debug_reg_base), data);
+    return set32(addr, data);
 }
 
-static inline void clear32(u64 addr, u32 data)
+static inline u32 usb_dwc2_trace_clear32(uintptr_t addr, u32 data)
 {
-    usb_debug_printf("cl%x %x\n", addr - debug_reg_base, data);
-    clear32(addr, data);
+    usb_debug_printf("cl%x %x\n", (u32)(addr - debug_reg_base), data);
+    return clear32(addr, data);
 }
+
+#define write32 usb_dwc2_trace_write32
+#define set32   usb_dwc2_trace_set32
+#define clear32 usb_dwc2_trace_clear32
 #endif
 
 static int usb_dwc2_ep_activate(dwc2_dev_t *dev, u8 ep, u8 type, u32 max_packet_len)
@@ -487,7 +694,7 @@ static int usb_dwc2_ep_activate(dwc2_dev_t *dev, u8 ep, u8 type, u32 max_packet_
     u8 is_endpoint_in = !(!(pep & 0x80));
     u64 ep_ctl_reg = 0, daint_mask_shift;
     pep &= 0xf;
-    // usb_debug_printf ("activate EP%u, is_in =%d\n", pep, is_endpoint_in);
+    usb_debug_printf("activate EP%u, is_in =%d\n", pep, is_endpoint_in);
     dev->endpoints[ep].max_packet_size = max_packet_len;
     u32 val = DWC2_DXEPCTLi_SetD0Pid | DWC2_DXEPCTL_SetNAK;
 
@@ -497,14 +704,9 @@ static int usb_dwc2_ep_activate(dwc2_dev_t *dev, u8 ep, u8 type, u32 max_packet_
     }
     if (is_endpoint_in) {
         ep_ctl_reg = dev->regs + DWC2_DIEPCTL(pep);
-        // usb_debug_printf("dev->regs + DWC2_DIEPCTL(pep) = %x\n", dev->regs +
-        // DWC2_DIEPCTL(pep));
+        usb_debug_printf("dev->regs + DWC2_DIEPCTL(pep) = %x\n", (u32)ep_ctl_reg);
         write32(ep_ctl_reg, 0);
-        u8 next_tx_fifo = pep;
-        val |= next_tx_fifo << 22; // TX_FIFO_SHIFT
-        write32(dev->regs + DWC2_DTXFSIZ(next_tx_fifo), TX_FIFO_SIZE << 16 | next_tx_fifo_addr);
-        // usb_debug_printf("DWC2_DTXFSIZ(next_tx_fifo)= %x\n", DWC2_DTXFSIZ(next_tx_fifo));
-        next_tx_fifo_addr += TX_FIFO_SIZE;
+        val |= pep << 22; // TX_FIFO_SHIFT, FIFOs are sized in usb_dwc2_fifo_setup()
         if (ep == USB_LEP_CDC_INTR_IN || ep == USB_LEP_CDC_INTR_IN_2)
             val |= 1 << 26; // CNAK
         daint_mask_shift = pep;
@@ -606,7 +808,7 @@ usb_dwc2_handle_ep0_get_descriptor(dwc2_dev_t *dev,
     const void *descriptor = NULL;
     u16 descriptor_len = 0;
 
-    // usb_debug_printf("handle_ep0_get_descriptor, type=%u\n", get_descriptor->type);
+    usb_debug_printf("handle_ep0_get_descriptor, type=%u\n", get_descriptor->type);
 
     switch (get_descriptor->type) {
         case USB_DEVICE_DESCRIPTOR:
@@ -616,6 +818,14 @@ usb_dwc2_handle_ep0_get_descriptor(dwc2_dev_t *dev,
         case USB_CONFIGURATION_DESCRIPTOR:
             descriptor = &cdc_configuration_descriptor;
             descriptor_len = cdc_configuration_descriptor.configuration.wTotalLength;
+            if (dev->msc.enabled) {
+                memcpy(msc_configuration_descriptor, &cdc_configuration_descriptor,
+                       sizeof(cdc_configuration_descriptor));
+                memcpy(msc_configuration_descriptor +
+                           offsetof(struct cdc_dev_desc, bulk_interface),
+                       &msc_interface_descriptor, sizeof(msc_interface_descriptor));
+                descriptor = msc_configuration_descriptor;
+            }
             break;
         case USB_STRING_DESCRIPTOR:
             usb_cdc_get_string_descriptor(get_descriptor->index, &descriptor, &descriptor_len);
@@ -641,11 +851,11 @@ usb_dwc2_handle_ep0_get_descriptor(dwc2_dev_t *dev,
 static void usb_dwc2_ep0_handle_standard_device(dwc2_dev_t *dev,
                                                 const union usb_setup_packet *setup)
 {
-    // usb_debug_printf("ep0_handle_standard_device: bRequest=%u\n", setup->raw.bRequest);
+    usb_debug_printf("ep0_handle_standard_device: bRequest=%u\n", setup->raw.bRequest);
     switch (setup->raw.bRequest) {
         case USB_REQUEST_SET_ADDRESS:
-            // usb_debug_printf("handle USB_REQUEST_SET_ADDRESS, addr=%u, addr=%u\n",
-            // setup->set_address.address, setup->raw.wValue & 0x7f);
+            usb_debug_printf("handle USB_REQUEST_SET_ADDRESS, addr=%u, addr=%u\n",
+                             setup->set_address.address, setup->raw.wValue & 0x7f);
             usb_set_address(dev, setup->set_address.address);
             dev->ep0_state = USB_DWC2_EP0_STATE_DATA_SEND_STATUS;
             // debug_printf("S");
@@ -659,20 +869,31 @@ static void usb_dwc2_ep0_handle_standard_device(dwc2_dev_t *dev,
                     //     usb_dwc2_enable_ep(dev, i, 0);
                     // }
                     dev->ep0_state = USB_DWC2_EP0_STATE_DATA_SEND_STATUS;
-                    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++)
+                    for (int i = 0; i < USB_PIPE_MAX; i++)
                         dev->pipe[i].ready = false;
                     break;
                 case 1:
-                    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
+                    for (int i = 0; i < USB_PIPE_MAX; i++) {
                         /* prepare INTR endpoint so that we don't have to reconfigure this device
                          * later */
-                        usb_dwc2_ep_activate(dev, dev->pipe[i].ep_intr, DWC2_EP_TYPE_INTR, 64);
+                        if (i < CDC_ACM_PIPE_MAX)
+                            usb_dwc2_ep_activate(dev, dev->pipe[i].ep_intr, DWC2_EP_TYPE_INTR,
+                                                 64);
 
                         /* prepare BULK endpoints so that we don't have to reconfigure this device
                          * later */
                         usb_dwc2_ep_activate(dev, dev->pipe[i].ep_in, DWC2_EP_TYPE_BULK, 512);
                         usb_dwc2_ep_activate(dev, dev->pipe[i].ep_out, DWC2_EP_TYPE_BULK, 512);
                     }
+
+                    /* there is no DTR on the raw interface, it is usable once configured */
+                    if (dev->msc.enabled) {
+                        usb_dwc2_msc_reset(dev);
+                    } else {
+                        dev->pipe[USB_BULK_PIPE].ready = true;
+                        usb_dwc2_cdc_start_bulk_out_xfer(dev, USB_LEP_BULK_OUT);
+                        usb_dwc2_cdc_start_bulk_in_xfer(dev, USB_LEP_BULK_IN);
+                    }
                     dev->ep0_state = USB_DWC2_EP0_STATE_DATA_SEND_STATUS;
                     break;
                 default:
@@ -733,8 +954,8 @@ static int usb_dwc2_start_setup_phase(dwc2_dev_t *dev)
 
 static int usb_dwc2_ep0_start_data_send_phase(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("ep0_start_data_send_phase: device was requested to xfer %d on ep 0\n",
-    // dev->ep0_buffer_len);
+    usb_debug_printf("ep0_start_data_send_phase: device was requested to xfer %d on ep 0\n",
+                     dev->ep0_buffer_len);
     memset(dev->endpoints[USB_LEP_CTRL_IN].xfer_buffer, 0, 64);
     memcpy(dev->endpoints[USB_LEP_CTRL_IN].xfer_buffer, dev->ep0_buffer, dev->ep0_buffer_len);
     u32 pkt_count = (dev->ep0_buffer_len + 63) / 64;
@@ -747,8 +968,8 @@ static int usb_dwc2_ep0_start_data_send_phase(dwc2_dev_t *dev)
 
 static int usb_dwc2_ep0_start_data_recv_phase(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("ep0_start_data_send_phase: device was requested to recv %d on ep 0\n",
-    // dev->ep0_read_buffer_len);
+    usb_debug_printf("ep0_start_data_send_phase: device was requested to recv %d on ep 0\n",
+                     dev->ep0_read_buffer_len);
     memset(dev->endpoints[USB_LEP_CTRL_OUT].xfer_buffer, 0xbb, dev->ep0_read_buffer_len);
     usb_dwc2_ep_hw_recv(dev, USB_LEP_CTRL_OUT, dev->ep0_read_buffer_len,
                         1); // should check if ep0_read_buffer_len is too large
@@ -792,8 +1013,8 @@ static void usb_dwc2_ep0_handle_standard_endpoint(dwc2_dev_t *dev,
 
 static void usb_dwc2_ep0_handle_standard(dwc2_dev_t *dev, const union usb_setup_packet *setup)
 {
-    // usb_debug_printf("ep0_handle_standard: questType=0x%x\n", setup->raw.bmRequestType &
-    // USB_REQUEST_TYPE_RECIPIENT_MASK);
+    usb_debug_printf("ep0_handle_standard: questType=0x%x\n",
+                     setup->raw.bmRequestType & USB_REQUEST_TYPE_RECIPIENT_MASK);
 
     switch (setup->raw.bmRequestType & USB_REQUEST_TYPE_RECIPIENT_MASK) {
         case USB_REQUEST_TYPE_RECIPIENT_DEVICE:
@@ -815,10 +1036,39 @@ static void usb_dwc2_ep0_handle_standard(dwc2_dev_t *dev, const union usb_setup_
     }
 }
 
+static void usb_dwc2_ep0_handle_msc_class(dwc2_dev_t *dev, const union usb_setup_packet *setup)
+{
+    switch (setup->raw.bRequest) {
+        case USB_REQUEST_MSC_GET_MAX_LUN: {
+            static const u8 max_lun = 0;
+            dev->ep0_buffer = &max_lun;
+            dev->ep0_buffer_len = min(setup->raw.wLength, sizeof(max_lun));
+            dev->ep0_state = USB_DWC2_EP0_STATE_DATA_SEND;
+            break;
+        }
+
+        case USB_REQUEST_MSC_RESET:
+            usb_dwc2_msc_reset(dev);
+            usb_dwc2_start_status_phase(dev, USB_LEP_CTRL_IN);
+            dev->ep0_state = USB_DWC2_EP0_STATE_DATA_SEND_STATUS_DONE;
+            break;
+
+        default:
+            usb_dwc2_ep_set_stall(dev, 0, 1);
+            dev->ep0_state = USB_DWC2_EP0_STATE_IDLE;
+            usb_error_printf("unsupported MSC request 0x%x\n", setup->raw.bRequest);
+    }
+}
+
 static void usb_dwc2_ep0_handle_class(dwc2_dev_t *dev, const union usb_setup_packet *setup)
 {
     int pipe = setup->raw.wIndex / 2;
 
+    if (dev->msc.enabled && setup->raw.wIndex == USB_BULK_INTERFACE) {
+        usb_dwc2_ep0_handle_msc_class(dev, setup);
+        return;
+    }
+
     if (pipe >= CDC_ACM_PIPE_MAX)
         goto unsupported_setup_pkt;
 
@@ -872,8 +1122,7 @@ static void usb_dwc2_ep0_handle_setup(dwc2_dev_t *dev)
     const union usb_setup_packet *setup = dev->endpoints[USB_LEP_CTRL_OUT].xfer_buffer;
     dev->setup_pkt = setup;
 
-    // usb_debug_printf("ep0_handle_setup: setup->raw.bmRequestType = %u\n",
-    // setup->raw.bmRequestType);
+    usb_debug_printf("ep0_handle_setup: setup->raw.bmRequestType = %u\n", setup->raw.bmRequestType);
 
     switch (setup->raw.bmRequestType & USB_REQUEST_TYPE_MASK) {
         case USB_REQUEST_TYPE_STANDARD:
@@ -889,16 +1138,125 @@ static void usb_dwc2_ep0_handle_setup(dwc2_dev_t *dev)
     }
 }
 
+/*
+ * Ringbuffer watermarks drive the CDC bulk endpoints: an OUT endpoint left unarmed for lack of
+ * room is restarted as soon as the reader frees a transfer's worth, and IN starts as soon as a
+ * full transfer is queued rather than when the writer finds the ring full.
+ */
+static void usb_dwc2_ring_drained(ringbuffer_t *ring, void *opaque)
+{
+    dwc2_dev_t *dev = opaque;
+
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
+        u8 ep = dev->pipe[i].ep_out;
+
+        if (dev->pipe[i].host2device != ring || !dev->endpoints[ep].ring_full)
+            continue;
+
+        u32 flags = irq_save();
+        usb_dwc2_cdc_start_bulk_out_xfer(dev, ep);
+        irq_restore(flags);
+    }
+}
+
+static void usb_dwc2_ring_filled(ringbuffer_t *ring, void *opaque)
+{
+    dwc2_dev_t *dev = opaque;
+
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
+        if (dev->pipe[i].device2host != ring)
+            continue;
+
+        u32 flags = irq_save();
+        usb_dwc2_cdc_start_bulk_in_xfer(dev, dev->pipe[i].ep_in);
+        irq_restore(flags);
+    }
+}
+
+static void usb_dwc2_ring_set_watermarks(dwc2_dev_t *dev, ringbuffer_t *ring, bool host2device)
+{
+    if (host2device)
+        ringbuffer_set_low_watermark(ring, ring->len - XFER_SIZE, usb_dwc2_ring_drained, dev);
+    else
+        ringbuffer_set_high_watermark(ring, XFER_SIZE, usb_dwc2_ring_filled, dev);
+}
+
+/*
+ * Allocate the ringbuffers of a pipe on first use. This has to happen in the foreground since
+ * the allocator is not IRQ safe, the OUT endpoint that could not be armed without them is
+ * started here.
+ */
+static bool usb_dwc2_pipe_alloc(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
+{
+    if (dev->pipe[pipe].host2device)
+        return true;
+
+    ringbuffer_t *host2device = ringbuffer_alloc(dev->pipe[pipe].host2device_size);
+    ringbuffer_t *device2host = ringbuffer_alloc(dev->pipe[pipe].device2host_size);
+    if (!host2device || !device2host) {
+        usb_error_printf("failed to allocate ringbuffers for pipe %d\n", pipe);
+        ringbuffer_free(host2device);
+        ringbuffer_free(device2host);
+        return false;
+    }
+
+    usb_dwc2_ring_set_watermarks(dev, host2device, true);
+    usb_dwc2_ring_set_watermarks(dev, device2host, false);
+
+    u32 flags = irq_save();
+    bool lost = dev->pipe[pipe].host2device != NULL;
+    if (!lost) {
+        dev->pipe[pipe].device2host = device2host;
+        dev->pipe[pipe].host2device = host2device;
+        if (dev->pipe[pipe].ready)
+            usb_dwc2_cdc_start_bulk_out_xfer(dev, dev->pipe[pipe].ep_out);
+    }
+    irq_restore(flags);
+
+    /* another caller got there first */
+    if (lost) {
+        ringbuffer_free(host2device);
+        ringbuffer_free(device2host);
+    }
+
+    return true;
+}
+
+/* free the ring a resize replaced once the transfer that was running over it is over */
+static void usb_dwc2_free_retired_ring(dwc2_dev_t *dev, u8 ep)
+{
+    dwc2_endpoint_t *endpoint = &dev->endpoints[ep];
+    ringbuffer_t *retired = NULL;
+
+    u32 flags = irq_save();
+    if (!endpoint->xfer_in_progress || !endpoint->xfer_direct ||
+        endpoint->xfer_ring != endpoint->retired_ring) {
+        retired = endpoint->retired_ring;
+        endpoint->retired_ring = NULL;
+    }
+    irq_restore(flags);
+
+    ringbuffer_free(retired);
+}
+
 void usb_dwc2_handle_events(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("------checking int-----\n");
+    u32 flags = irq_save();
     usb_dwc2_handle_interrupts(dev);
+    irq_restore(flags);
+
+    for (int i = 0; i < USB_PIPE_MAX; i++)
+        if (dev->pipe[i].ready)
+            usb_dwc2_pipe_alloc(dev, i);
+
+    for (u8 ep = 0; ep < MAX_ENDPOINTS; ep++)
+        usb_dwc2_free_retired_ring(dev, ep);
 }
 
 static void usb_dwc2_ep0_handle_xfer_done(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("ep0_handle_xfer_done: %d, %s\n",
-    //     dev->ep0_state, ep0_state_names[dev->ep0_state]);
+    usb_debug_printf("ep0_handle_xfer_done: %d, %s\n", dev->ep0_state,
+                     ep0_state_names[dev->ep0_state]);
     switch (dev->ep0_state) {
         case USB_DWC2_EP0_STATE_SETUP_HANDLE:
             usb_dwc2_ep0_handle_setup(dev);
@@ -931,8 +1289,8 @@ static void usb_dwc2_ep0_handle_xfer_done(dwc2_dev_t *dev)
 
 static void usb_dwc2_ep0_handle_xfer_not_ready(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("ep0_handle_xfer_not_ready: %d, %s\n",
-    //                          dev->ep0_state, ep0_state_names[dev->ep0_state]);
+    usb_debug_printf("ep0_handle_xfer_not_ready: %d, %s\n", dev->ep0_state,
+                     ep0_state_names[dev->ep0_state]);
     switch (dev->ep0_state) {
         case USB_DWC2_EP0_STATE_SETUP_HANDLE:
         case USB_DWC2_EP0_STATE_DATA_SEND_STATUS_DONE:
@@ -974,62 +1332,376 @@ static void usb_dwc2_ep0_handle_xfer_not_ready(dwc2_dev_t *dev)
     }
 }
 
-ringbuffer_t *usb_dwc2_cdc_get_ringbuffer(dwc2_dev_t *dev, u8 endpoint_number)
+static void usb_dwc2_stats_xfer(dwc2_dev_t *dev, u8 ep, u32 len)
+{
+    struct usb_dwc2_ep_stats *stats = &dev->stats.ep[ep];
+
+    stats->bytes += len;
+    stats->xfers++;
+    if (!len)
+        stats->zlps++;
+    else if (len % BULK_EP_MAX_PACKET_SIZE)
+        stats->short_pkts++;
+}
+
+/* account the time an endpoint sat idle between completion and being armed again */
+static void usb_dwc2_stats_rearm(dwc2_dev_t *dev, u8 ep)
+{
+    struct usb_dwc2_ep_stats *stats = &dev->stats.ep[ep];
+
+    if (!dev->endpoints[ep].done_ticks)
+        return;
+
+    u32 gap = get_ticks() - dev->endpoints[ep].done_ticks;
+    dev->endpoints[ep].done_ticks = 0;
+    stats->rearm_gap_total += gap;
+    stats->rearm_gap_max = max(stats->rearm_gap_max, gap);
+    stats->rearm_count++;
+}
+
+static bool usb_dwc2_is_source_sink(dwc2_dev_t *dev, u8 ep)
+{
+    return dev->source_sink.enabled &&
+           (ep == dev->pipe[USB_BULK_PIPE].ep_in || ep == dev->pipe[USB_BULK_PIPE].ep_out);
+}
+
+static inline u8 usb_dwc2_source_sink_byte(u64 offset)
+{
+    return (offset / 4) >> (8 * (offset % 4));
+}
+
+static void usb_dwc2_source_start(dwc2_dev_t *dev, u8 ep)
+{
+    u32 *p = dev->endpoints[ep].xfer_buffer;
+    u32 word = dev->source_sink.stats.tx_bytes / 4;
+
+    for (u32 i = 0; i < XFER_SIZE / 4; i++)
+        p[i] = word++;
+
+    usb_dwc2_ep_hw_send(dev, ep, XFER_SIZE, XFER_SIZE / 512);
+    dev->endpoints[ep].xfer_in_progress = true;
+}
+
+static void usb_dwc2_sink_xfer_done(dwc2_dev_t *dev, u8 ep)
+{
+    u8 *p = dev->endpoints[ep].xfer_buffer;
+    u64 offset = dev->source_sink.stats.rx_bytes;
+    size_t len = usb_dwc2_ep_out_xfer_size(dev, ep);
+    size_t i = 0;
+
+    if (!(offset % 4)) {
+        u32 word = offset / 4;
+        for (; i + 4 <= len; i += 4)
+            if (*(u32 *)(p + i) != word++)
+                dev->source_sink.stats.rx_errors++;
+    }
+    for (; i < len; i++)
+        if (p[i] != usb_dwc2_source_sink_byte(offset + i))
+            dev->source_sink.stats.rx_errors++;
+
+    dev->source_sink.stats.rx_bytes += len;
+    dev->endpoints[ep].xfer_in_progress = false;
+    usb_dwc2_stats_xfer(dev, ep, len);
+}
+
+static bool usb_dwc2_is_msc(dwc2_dev_t *dev, u8 ep)
+{
+    return dev->msc.enabled &&
+           (ep == dev->pipe[USB_BULK_PIPE].ep_in || ep == dev->pipe[USB_BULK_PIPE].ep_out);
+}
+
+static void usb_dwc2_msc_recv_cbw(dwc2_dev_t *dev)
+{
+    u8 ep = USB_LEP_BULK_OUT;
+
+    dev->msc.state = USB_DWC2_MSC_STATE_CBW;
+    usb_dwc2_stats_rearm(dev, ep);
+    usb_dwc2_ep_hw_recv(dev, ep, BULK_EP_MAX_PACKET_SIZE, 1);
+    dev->endpoints[ep].xfer_in_progress = true;
+}
+
+static void usb_dwc2_msc_send_csw(dwc2_dev_t *dev)
+{
+    u8 ep = USB_LEP_BULK_IN;
+    struct usb_msc_csw *csw = dev->endpoints[ep].xfer_buffer;
+    u32 transferred = min(dev->msc.done, dev->msc.useful);
+
+    usb_msc_complete(&dev->msc.scsi, &dev->msc.data, transferred);
+
+    csw->dCSWSignature = USB_MSC_CSW_SIGNATURE;
+    csw->dCSWTag = dev->msc.cbw.dCBWTag;
+    csw->dCSWDataResidue = dev->msc.cbw.dCBWDataTransferLength - transferred;
+    csw->bCSWStatus = dev->msc.status;
+
+    dev->msc.state = USB_DWC2_MSC_STATE_CSW;
+    usb_dwc2_stats_rearm(dev, ep);
+    usb_dwc2_ep_hw_send(dev, ep, USB_MSC_CSW_SIZE, 1);
+    dev->endpoints[ep].xfer_in_progress = true;
+}
+
+/* arm the next chunk of the data stage, straight from/to the window while there is data */
+static void usb_dwc2_msc_data_xfer(dwc2_dev_t *dev)
+{
+    bool dir_in = dev->msc.state == USB_DWC2_MSC_STATE_DATA_IN;
+    u8 ep = dir_in ? USB_LEP_BULK_IN : USB_LEP_BULK_OUT;
+    u8 *buf;
+    int ret;
+
+    if (dev->msc.done < dev->msc.useful) {
+        buf = dev->msc.data.buf + dev->msc.done;
+        dev->msc.chunk = min(dev->msc.useful - dev->msc.done, MSC_MAX_XFER_SIZE);
+    } else {
+        buf = dev->endpoints[ep].xfer_buffer;
+        dev->msc.chunk = min(dev->msc.total - dev->msc.done, XFER_SIZE);
+        if (dir_in)
+            memset(buf, 0, dev->msc.chunk);
+    }
+
+    u32 pkt_count = (dev->msc.chunk + BULK_EP_MAX_PACKET_SIZE - 1) / BULK_EP_MAX_PACKET_SIZE;
+    usb_dwc2_stats_rearm(dev, ep);
+    if (dir_in)
+        ret = usb_dwc2_ep_hw_send_buf(dev, ep, buf, dev->msc.chunk, pkt_count);
+    else
+        ret = usb_dwc2_ep_hw_recv_buf(dev, ep, buf, pkt_count * BULK_EP_MAX_PACKET_SIZE,
+                                      pkt_count);
+    if (!ret)
+        dev->endpoints[ep].xfer_in_progress = true;
+}
+
+static void usb_dwc2_msc_handle_cbw(dwc2_dev_t *dev)
+{
+    u8 ep = USB_LEP_BULK_OUT;
+    struct usb_msc_cbw *cbw = &dev->msc.cbw;
+    u32 len = usb_dwc2_ep_out_xfer_size(dev, ep);
+
+    memcpy(cbw, dev->endpoints[ep].xfer_buffer, sizeof(*cbw));
+    usb_dwc2_stats_xfer(dev, ep, len);
+    if (len != USB_MSC_CBW_SIZE || cbw->dCBWSignature != USB_MSC_CBW_SIGNATURE) {
+        usb_error_printf("invalid CBW (%u bytes, signature 0x%x)\n", len, cbw->dCBWSignature);
+        usb_dwc2_msc_recv_cbw(dev);
+        return;
+    }
+
+    bool dir_in = cbw->bmCBWFlags & USB_MSC_CBW_DIR_IN;
+    struct usb_msc_data *data = &dev->msc.data;
+    dev->msc.status = usb_msc_command(&dev->msc.scsi, cbw,
+                                      dev->endpoints[USB_LEP_BULK_IN].xfer_buffer, data);
+
+    dev->msc.useful = 0;
+    dev->msc.done = 0;
+    if (data->len) {
+        if (!cbw->dCBWDataTransferLength || data->dir_in != dir_in)
+            dev->msc.status = USB_MSC_CSW_PHASE_ERROR;
+        else
+            dev->msc.useful = min(data->len, cbw->dCBWDataTransferLength);
+    }
+
+    /*
+     * the host takes a short packet as the end of an IN data stage, only a stage ending on
+     * a packet boundary has to be padded to the length it asked for
+     */
+    dev->msc.total = cbw->dCBWDataTransferLength;
+    if (dir_in && (dev->msc.useful % BULK_EP_MAX_PACKET_SIZE))
+        dev->msc.total = dev->msc.useful;
+
+    if (!dev->msc.total) {
+        usb_dwc2_msc_send_csw(dev);
+        return;
+    }
+
+    dev->msc.state = dir_in ? USB_DWC2_MSC_STATE_DATA_IN : USB_DWC2_MSC_STATE_DATA_OUT;
+    usb_dwc2_msc_data_xfer(dev);
+}
+
+static void usb_dwc2_msc_handle_out_xfer_done(dwc2_dev_t *dev, u8 ep)
+{
+    dev->endpoints[ep].xfer_in_progress = false;
+
+    switch (dev->msc.state) {
+        case USB_DWC2_MSC_STATE_CBW:
+            usb_dwc2_msc_handle_cbw(dev);
+            break;
+
+        case USB_DWC2_MSC_STATE_DATA_OUT: {
+            u32 len = min(usb_dwc2_ep_out_xfer_size(dev, ep), dev->msc.chunk);
+            /* drop lines speculatively refilled from the window while the DMA ran */
+            if (dev->msc.done < dev->msc.useful)
+                dc_ivac_range(dev->msc.data.buf + dev->msc.done, len);
+            usb_dwc2_stats_xfer(dev, ep, len);
+            dev->msc.done += len;
+            if (len < dev->msc.chunk || dev->msc.done >= dev->msc.total)
+                usb_dwc2_msc_send_csw(dev);
+            else
+                usb_dwc2_msc_data_xfer(dev);
+            break;
+        }
+
+        default:
+            usb_error_printf("unexpected MSC OUT transfer in state %d\n", dev->msc.state);
+    }
+}
+
+static void usb_dwc2_msc_handle_in_xfer_done(dwc2_dev_t *dev, u8 ep)
 {
-    switch (endpoint_number) {
-        case USB_LEP_CDC_BULK_IN:
-            return dev->pipe[CDC_ACM_PIPE_0].device2host;
-        case USB_LEP_CDC_BULK_OUT:
-            return dev->pipe[CDC_ACM_PIPE_0].host2device;
-        case USB_LEP_CDC_BULK_IN_2:
-            return dev->pipe[CDC_ACM_PIPE_1].device2host;
-        case USB_LEP_CDC_BULK_OUT_2:
-            return dev->pipe[CDC_ACM_PIPE_1].host2device;
+    switch (dev->msc.state) {
+        case USB_DWC2_MSC_STATE_DATA_IN:
+            usb_dwc2_stats_xfer(dev, ep, dev->msc.chunk);
+            dev->msc.done += dev->msc.chunk;
+            if (dev->msc.done >= dev->msc.total)
+                usb_dwc2_msc_send_csw(dev);
+            else
+                usb_dwc2_msc_data_xfer(dev);
+            break;
+
+        case USB_DWC2_MSC_STATE_CSW:
+            usb_dwc2_msc_recv_cbw(dev);
+            break;
+
         default:
-            return NULL;
+            usb_error_printf("unexpected MSC IN transfer in state %d\n", dev->msc.state);
+    }
+}
+
+/* bulk-only mass storage reset: drop whatever command was in flight and wait for a CBW */
+static void usb_dwc2_msc_reset(dwc2_dev_t *dev)
+{
+    usb_dwc2_ep_abort(dev, USB_LEP_BULK_IN);
+    usb_dwc2_ep_abort(dev, USB_LEP_BULK_OUT);
+    usb_dwc2_msc_recv_cbw(dev);
+}
+
+ringbuffer_t *usb_dwc2_cdc_get_ringbuffer(dwc2_dev_t *dev, u8 endpoint_number)
+{
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
+        if (endpoint_number == dev->pipe[i].ep_in)
+            return dev->pipe[i].device2host;
+        if (endpoint_number == dev->pipe[i].ep_out)
+            return dev->pipe[i].host2device;
     }
+
+    return NULL;
+}
+
+/*
+ * Collect the ring data an IN transfer can send in place: the span up to the end of the ring
+ * and, when that one ends on a packet boundary, the wrapped part at its start. Returns 0 when
+ * there is nothing to send or it does not start DMA aligned.
+ */
+static u32 usb_dwc2_ring_in_spans(ringbuffer_t *ring, struct dwc2_span *spans)
+{
+    const u8 *data;
+    size_t used = min(ringbuffer_get_used(ring), (size_t)RING_MAX_XFER_SIZE);
+    size_t len = min(ringbuffer_peek(ring, &data), used);
+
+    if (!len || ((uintptr_t)data % 4))
+        return 0;
+
+    spans[0] = (struct dwc2_span){(void *)data, len};
+    if (len == used || (len % BULK_EP_MAX_PACKET_SIZE))
+        return 1;
+
+    spans[1] = (struct dwc2_span){ring->buffer, used - len};
+    return 2;
 }
 
 static void usb_dwc2_cdc_start_bulk_out_xfer(dwc2_dev_t *dev, u8 endpoint_number)
 {
-    if (dev->endpoints[endpoint_number].xfer_in_progress)
+    if (dev->endpoints[endpoint_number].xfer_in_progress || usb_dwc2_is_msc(dev, endpoint_number))
         return;
-    // usb_debug_printf("cdc_start_bulk_out_xfer:###recving on %u\n", endpoint_number);
+    usb_debug_printf("cdc_start_bulk_out_xfer:###recving on %u\n", endpoint_number);
     ringbuffer_t *host2device = usb_dwc2_cdc_get_ringbuffer(dev, endpoint_number);
     if (!host2device)
         return;
 
-    if (ringbuffer_get_free(host2device) < XFER_SIZE)
+    if (ringbuffer_get_free(host2device) < XFER_SIZE) {
+        if (!dev->endpoints[endpoint_number].ring_full)
+            dev->stats.ep[endpoint_number].ring_full++;
+        dev->endpoints[endpoint_number].ring_full = true;
         return;
+    }
+
+    dev->endpoints[endpoint_number].ring_full = false;
+    usb_dwc2_stats_rearm(dev, endpoint_number);
+
+    /* with descriptor DMA, receive straight into the free span of the ring when it is aligned */
+    if (dev->desc_dma) {
+        u8 *span;
+        size_t room = min(ringbuffer_reserve(host2device, &span), (size_t)RING_MAX_XFER_SIZE);
+
+        room = ALIGN_DOWN(room, BULK_EP_MAX_PACKET_SIZE);
+        if (room && !((uintptr_t)span % 4)) {
+            dev->endpoints[endpoint_number].xfer_direct = true;
+            dev->endpoints[endpoint_number].xfer_ring = host2device;
+            if (!usb_dwc2_ep_hw_recv_buf(dev, endpoint_number, span, room,
+                                         room / BULK_EP_MAX_PACKET_SIZE))
+                dev->endpoints[endpoint_number].xfer_in_progress = true;
+            return;
+        }
+    }
 
+    dev->endpoints[endpoint_number].xfer_direct = false;
     memset(dev->endpoints[endpoint_number].xfer_buffer, 0xaa, XFER_SIZE);
-    usb_dwc2_ep_hw_recv(dev, endpoint_number, 512, 1);
+    if (dev->desc_dma)
+        usb_dwc2_ep_hw_recv(dev, endpoint_number, XFER_SIZE, XFER_SIZE / 512);
+    else
+        usb_dwc2_ep_hw_recv(dev, endpoint_number, 512, 1);
     dev->endpoints[endpoint_number].xfer_in_progress = true;
 }
 
 static void usb_dwc2_cdc_start_bulk_in_xfer(dwc2_dev_t *dev, u8 endpoint_number)
 {
-    if (dev->endpoints[endpoint_number].xfer_in_progress)
+    if (dev->endpoints[endpoint_number].xfer_in_progress || usb_dwc2_is_msc(dev, endpoint_number))
+        return;
+
+    if (usb_dwc2_is_source_sink(dev, endpoint_number)) {
+        usb_dwc2_stats_rearm(dev, endpoint_number);
+        usb_dwc2_source_start(dev, endpoint_number);
         return;
+    }
 
     ringbuffer_t *device2host = usb_dwc2_cdc_get_ringbuffer(dev, endpoint_number);
     if (!device2host)
         return;
 
-    size_t len =
-        ringbuffer_read(dev->endpoints[endpoint_number].xfer_buffer, XFER_SIZE, device2host);
+    /*
+     * with descriptor DMA, send straight from the ring when the data starts aligned, otherwise
+     * copy it out and cut the copy so that the next transfer starts aligned again
+     */
+    dwc2_endpoint_t *endpoint = &dev->endpoints[endpoint_number];
+    struct dwc2_span spans[2];
+    u32 nspans = dev->desc_dma ? usb_dwc2_ring_in_spans(device2host, spans) : 0;
+    size_t len = 0;
+
+    endpoint->xfer_direct = nspans > 0;
+    endpoint->xfer_ring = device2host;
+    if (nspans) {
+        for (u32 i = 0; i < nspans; i++)
+            len += spans[i].len;
+    } else {
+        const u8 *data;
+        size_t max_len = XFER_SIZE;
+
+        if (dev->desc_dma && ringbuffer_peek(device2host, &data))
+            max_len -= (uintptr_t)data % 4;
+        len = ringbuffer_read(endpoint->xfer_buffer, max_len, device2host);
+        spans[0] = (struct dwc2_span){endpoint->xfer_buffer, len};
+        nspans = 1;
+    }
 
     if (!len && !dev->endpoints[endpoint_number].zlp_pending)
         return;
 
-    u32 pkt_count = (len + 511) / 512;
-    if (dev->ep0_buffer_len % 512 == 0) {
-        pkt_count++;
-        dev->endpoints[endpoint_number].zlp_pending = 1;
-    }
-    usb_debug_printf("cdc_start_bulk_in_xfer: hw_send(%lu, %u) from endpoint_index=%u\n", len,
+    /*
+     * a transfer ending on a packet boundary is only terminated once the ring runs dry,
+     * in which case the next call sends a single zero length packet
+     */
+    u32 pkt_count = max((len + 511) / 512, 1);
+    dev->endpoints[endpoint_number].zlp_pending = len && !(len % 512);
+    usb_dwc2_stats_rearm(dev, endpoint_number);
+    usb_debug_printf("cdc_start_bulk_in_xfer: hw_send(%zu, %u) from endpoint_index=%u\n", len,
                      pkt_count, endpoint_number);
-    usb_dwc2_ep_hw_send(dev, endpoint_number, len, pkt_count);
+    if (usb_dwc2_ep_hw_send_spans(dev, endpoint_number, spans, nspans, pkt_count))
+        return;
     dev->endpoints[endpoint_number].xfer_in_progress = true;
     // dev->endpoints[endpoint_number].zlp_pending = (len % 512) == 0;
     // USB_DEBUG_PRINT_REGISTERS(dev);
@@ -1037,26 +1709,35 @@ static void usb_dwc2_cdc_start_bulk_in_xfer(dwc2_dev_t *dev, u8 endpoint_number)
 
 static void usb_dwc2_cdc_handle_bulk_out_xfer_done(dwc2_dev_t *dev, u8 ep)
 {
+    if (usb_dwc2_is_source_sink(dev, ep)) {
+        usb_dwc2_sink_xfer_done(dev, ep);
+        return;
+    }
+
     ringbuffer_t *host2device = usb_dwc2_cdc_get_ringbuffer(dev, ep);
     if (!host2device)
         return;
-    u8 ipep = phyEndpoints[USB_LEP_CDC_BULK_OUT];
-    ;
-    if (ep == USB_LEP_CDC_BULK_OUT_2)
-        ipep = phyEndpoints[USB_LEP_CDC_BULK_OUT_2];
-    size_t xfer_siz = 0x200 - (read32(dev->regs + DWC2_DOEPTSIZ(ipep)) & 0x7fff);
-    if (ringbuffer_get_free(host2device) < xfer_siz) {
-        usb_debug_printf("out_xfer_buffer size overflow\n");
-        xfer_siz = ringbuffer_get_free(host2device);
-    }
-    ringbuffer_write(dev->endpoints[ep].xfer_buffer, xfer_siz, host2device);
+    size_t xfer_siz = usb_dwc2_ep_out_xfer_size(dev, ep);
+    u8 *data = dev->endpoints[ep].xfer_buffer;
+    if (dev->endpoints[ep].xfer_direct) {
+        /* drop lines speculatively refilled from the ring while the DMA ran */
+        ringbuffer_reserve(dev->endpoints[ep].xfer_ring, &data);
+        dc_ivac_range(data, xfer_siz);
+    }
+    if (dev->endpoints[ep].xfer_direct && dev->endpoints[ep].xfer_ring == host2device) {
+        ringbuffer_commit(host2device, xfer_siz);
+    } else {
+        /* the bounce buffer, or a ring that a resize replaced while the transfer ran */
+        if (ringbuffer_get_free(host2device) < xfer_siz) {
+            usb_debug_printf("out_xfer_buffer size overflow\n");
+            xfer_siz = ringbuffer_get_free(host2device);
+        }
+        ringbuffer_write(data, xfer_siz, host2device);
+    }
+    usb_dwc2_stats_xfer(dev, ep, xfer_siz);
     usb_debug_printf("handle_bulk_out_xfer_done: recvd %zd bytes from bulk out\n", xfer_siz);
     // hexdump(dev->endpoints[ep].xfer_buffer, xfer_siz);
     dev->endpoints[ep].xfer_in_progress = false;
-
-    // usb_debug_printf("handle_bulk_out_xfer_done: DWC2_DOEPTSIZ(2)=%x\n", read32(dev->regs +
-    // DWC2_DOEPTSIZ(2))); usb_debug_printf("handle_bulk_out_xfer_done: ep's buffer=%p\n",
-    // dev->endpoints[ep].xfer_buffer); while(1) {}
 }
 
 static int usb_dwc2_start_status_phase(dwc2_dev_t *dev, u8 ep)
@@ -1085,17 +1766,88 @@ static int usb_dwc2_start_status_phase(dwc2_dev_t *dev, u8 ep)
 //     return 0;
 // }
 
-static void usb_dwc2_handle_interrupts_ep(dwc2_dev_t *dev)
+static void usb_dwc2_cdc_handle_bulk_out_int(dwc2_dev_t *dev, u8 ep)
 {
-    u32 daint = read32(dev->regs + DWC2_DAINT);
-    if (daint && !(daint & (BIT(16) | BIT(0)))) // timing requirements
-        usb_debug_printf("handle_interrupts_ep: DAINT = %x\n", daint);
-    // dispatch handler for each endpoints
-    if (daint & BIT(0)) { // ep0_in
-        u32 diepint = read32(dev->regs + DWC2_DIEPINT(0));
-        write32(dev->regs + DWC2_DIEPINT(0), diepint);
-        usb_debug_printf("ep0_in_handle_interrupt:  DWC2_DIEPINT(0)=%x\n", diepint);
-        if (diepint & DWC2_DOEPINT_XFER_COMPL) { // XferCompl
+    u8 pep = phyEndpoints[ep];
+    u32 doepint = read32(dev->regs + DWC2_DOEPINT(pep));
+    write32(dev->regs + DWC2_DOEPINT(pep), doepint);
+    usb_debug_printf("bulk_out_handle_interrupt: DWC2_DOEPINT(%u)=%x\n", pep, doepint);
+    if (doepint & DWC2_DOEPINT_BNA)
+        usb_dwc2_ep_rearm_desc(dev, ep);
+    if (doepint & DWC2_DOEPINT_XFER_COMPL) {
+        /* The bit can be set before the transfer actually completes on some devices... */
+        udelay(2);
+
+        dev->endpoints[ep].done_ticks = get_ticks();
+        if (usb_dwc2_is_msc(dev, ep)) {
+            usb_dwc2_msc_handle_out_xfer_done(dev, ep);
+            return;
+        }
+        usb_dwc2_cdc_handle_bulk_out_xfer_done(dev, ep);
+        usb_dwc2_cdc_start_bulk_out_xfer(dev, ep);
+    }
+}
+
+static void usb_dwc2_cdc_handle_bulk_in_int(dwc2_dev_t *dev, u8 ep)
+{
+    u8 pep = phyEndpoints[ep] & 0xf;
+    u32 diepint = read32(dev->regs + DWC2_DIEPINT(pep));
+    write32(dev->regs + DWC2_DIEPINT(pep), diepint);
+    usb_debug_printf("bulk_in_handle_interrupt: DWC2_DIEPINT(%u)=%x\n", pep, diepint);
+    if (diepint & DWC2_DIEPINT_BNA) {
+        usb_dwc2_ep_rearm_desc(dev, ep);
+        return;
+    }
+    /* a transfer sending from the ring has to finish before that data is released */
+    if (dev->endpoints[ep].xfer_direct && !(diepint & DWC2_DIEPINT_XferCompl))
+        return;
+    /* the source stream only goes on from a completed transfer, errors are just noted */
+    if (usb_dwc2_is_source_sink(dev, ep) && !(diepint & DWC2_DIEPINT_XferCompl)) {
+        if (diepint & (DWC2_DIEPINT_AHBErr | DWC2_DIEPINT_TimeOUT)) {
+            dev->source_sink.stats.tx_errors++;
+            usb_error_printf("EP%u IN source: DIEPINT 0x%x\n", pep, diepint);
+        }
+        return;
+    }
+    dev->endpoints[ep].xfer_in_progress = false;
+    if (usb_dwc2_is_msc(dev, ep)) {
+        if (diepint & DWC2_DIEPINT_XferCompl) {
+            dev->endpoints[ep].done_ticks = get_ticks();
+            usb_dwc2_msc_handle_in_xfer_done(dev, ep);
+        }
+    } else if (usb_dwc2_is_source_sink(dev, ep)) {
+        dev->source_sink.stats.tx_bytes += XFER_SIZE;
+        usb_dwc2_stats_xfer(dev, ep, XFER_SIZE);
+        dev->endpoints[ep].done_ticks = get_ticks();
+        usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
+    } else {
+        ringbuffer_t *device2host = usb_dwc2_cdc_get_ringbuffer(dev, ep);
+        if (diepint & DWC2_DIEPINT_XferCompl)
+            usb_dwc2_stats_xfer(dev, ep, dev->endpoints[ep].xfer_len);
+        /* the sent data is still at the head, even if a resize moved it to a new ring */
+        if (dev->endpoints[ep].xfer_direct && device2host)
+            ringbuffer_consume(device2host, dev->endpoints[ep].xfer_len);
+        dev->endpoints[ep].xfer_direct = false;
+        if ((device2host && ringbuffer_get_used(device2host)) || dev->endpoints[ep].zlp_pending) {
+            dev->endpoints[ep].done_ticks = get_ticks();
+            usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
+        }
+    }
+}
+
+static void usb_dwc2_handle_interrupts_ep(dwc2_dev_t *dev)
+{
+    u32 daint = read32(dev->regs + DWC2_DAINT);
+    if (daint && !(daint & (BIT(16) | BIT(0)))) // timing requirements
+        usb_debug_printf("handle_interrupts_ep: DAINT = %x\n", daint);
+    // dispatch handler for each endpoints
+    if (daint & BIT(0)) { // ep0_in
+        u32 diepint = read32(dev->regs + DWC2_DIEPINT(0));
+        write32(dev->regs + DWC2_DIEPINT(0), diepint);
+        usb_debug_printf("ep0_in_handle_interrupt:  DWC2_DIEPINT(0)=%x\n", diepint);
+        if (diepint & DWC2_DIEPINT_BNA)
+            usb_dwc2_ep_rearm_desc(dev, USB_LEP_CTRL_IN);
+        if (diepint & DWC2_DOEPINT_XFER_COMPL) { // XferCompl
             usb_dwc2_ep0_handle_xfer_done(dev);
             usb_dwc2_ep0_handle_xfer_not_ready(dev);
         }
@@ -1105,30 +1857,32 @@ static void usb_dwc2_handle_interrupts_ep(dwc2_dev_t *dev)
     if (daint & BIT(16 + 0)) { // ep0_out
         u32 doepint = read32(dev->regs + DWC2_DOEPINT(0));
         write32(dev->regs + DWC2_DOEPINT(0), doepint);
-        // usb_debug_printf("ep0_out_handle_interrupt: DWC2_DOEPINT(0)=%x\n", doepint);
+        usb_debug_printf("ep0_out_handle_interrupt: DWC2_DOEPINT(0)=%x\n", doepint);
+        if (doepint & DWC2_DOEPINT_BNA)
+            usb_dwc2_ep_rearm_desc(dev, USB_LEP_CTRL_OUT);
         bool setup_packet_recvd = doepint & DWC2_DOEPINT_STUP_PKT_RCVD;
         bool setup_phase_done = doepint & DWC2_DOEPINT_SETUP;
         if (setup_packet_recvd || setup_phase_done) {
-            // usb_debug_printf("got (part of) setup_packet DMA done now with %s, doepint=%x\n",
-            // ep0_state_names[dev->ep0_state], doepint);
+            usb_debug_printf("got (part of) setup_packet DMA done now with %s, doepint=%x\n",
+                             ep0_state_names[dev->ep0_state], doepint);
             if (dev->ep0_state == USB_DWC2_EP0_STATE_SETUP_HANDLE)
                 dev->ep0_state = USB_DWC2_EP0_STATE_SETUP_PENDING;
         }
         if (setup_phase_done) {
-            // usb_debug_printf("setup_phase_done now with %s, doepint=%x\n",
-            // ep0_state_names[dev->ep0_state], doepint);
+            usb_debug_printf("setup_phase_done now with %s, doepint=%x\n",
+                             ep0_state_names[dev->ep0_state], doepint);
             assert(dev->ep0_state == USB_DWC2_EP0_STATE_SETUP_PENDING);
             dev->ep0_state = USB_DWC2_EP0_STATE_SETUP_HANDLE;
             usb_dwc2_ep0_handle_xfer_done(dev);
             usb_dwc2_ep0_handle_xfer_not_ready(dev);
         } else if (doepint & DWC2_DOEPINT_XFER_COMPL) {
             if (dev->ep0_state == USB_DWC2_EP0_STATE_DATA_RECV_STATUS_DONE) {
-                // usb_debug_printf("DWC2_DOEPINT_XFER_COMPL now with %s, doepint=%x\n",
-                // ep0_state_names[dev->ep0_state], doepint);
+                usb_debug_printf("DWC2_DOEPINT_XFER_COMPL now with %s, doepint=%x\n",
+                                 ep0_state_names[dev->ep0_state], doepint);
                 usb_dwc2_ep0_handle_xfer_done(dev);
             } else if (dev->ep0_state == USB_DWC2_EP0_STATE_DATA_RECV_DONE) {
-                // usb_debug_printf("DWC2_DOEPINT_XFER_COMPL2 now with %s, doepint=%x\n",
-                // ep0_state_names[dev->ep0_state], doepint);
+                usb_debug_printf("DWC2_DOEPINT_XFER_COMPL2 now with %s, doepint=%x\n",
+                                 ep0_state_names[dev->ep0_state], doepint);
                 usb_dwc2_ep0_handle_xfer_done(dev);      // process data_packet in data Stage
                 usb_dwc2_ep0_handle_xfer_not_ready(dev); // send status in
             } else if (!setup_packet_recvd) {
@@ -1142,124 +1896,310 @@ static void usb_dwc2_handle_interrupts_ep(dwc2_dev_t *dev)
                 // set32(dev->regs + DWC2_DOEPCTL(0), BIT(26));
             }
         }
-        // usb_debug_printf("OUT DONE: state=%s\n", ep0_state_names[dev->ep0_state]);
-    }
-    if (daint & BIT(16 + 2)) { // USB_LEP_CDC_BULK_OUT
-        u32 doepint = read32(dev->regs + DWC2_DOEPINT(2));
-        write32(dev->regs + DWC2_DOEPINT(2), doepint);
-        usb_debug_printf("ep0_out_handle_interrupt: DWC2_DOEPINT(2)=%x#USB_LEP_CDC_BULK_OUT\n",
-                         doepint);
-        if (doepint & DWC2_DOEPINT_XFER_COMPL) {
-            /* The bit can be set before the transfer actually completes on some devices... */
-            udelay(2);
-
-            usb_dwc2_cdc_handle_bulk_out_xfer_done(dev, USB_LEP_CDC_BULK_OUT);
-            usb_dwc2_cdc_start_bulk_out_xfer(dev, USB_LEP_CDC_BULK_OUT);
-        }
+        usb_debug_printf("OUT DONE: state=%s\n", ep0_state_names[dev->ep0_state]);
     }
-    if (daint & BIT(0 + 3)) { // USB_LEP_CDC_BULK_IN
-        u32 diepint = read32(dev->regs + DWC2_DIEPINT(3));
-        write32(dev->regs + DWC2_DIEPINT(3), diepint);
-        usb_debug_printf("ep0_out_handle_interrupt: DWC2_DIEPINT(3)=%x#USB_LEP_CDC_BULK_IN\n",
-                         diepint);
-        // usb_debug_printf("dev->endpoints[USB_LEP_CDC_BULK_OUT].xfer_buffer at %p\n",
-        //                  dev->endpoints[USB_LEP_CDC_BULK_OUT].xfer_buffer);
-        dev->endpoints[USB_LEP_CDC_BULK_IN].xfer_in_progress = false;
-        // usb_dwc2_cdc_start_bulk_out_xfer(dev, USB_LEP_CDC_BULK_OUT);
-        // usb_debug_printf("ep1 send done, remain %u bytes\n",
-        // ringbuffer_get_used(usb_dwc2_cdc_get_ringbuffer(dev, USB_LEP_CDC_BULK_IN)) );
-        if (ringbuffer_get_used(usb_dwc2_cdc_get_ringbuffer(dev, USB_LEP_CDC_BULK_IN))) {
-            usb_dwc2_cdc_start_bulk_in_xfer(dev, USB_LEP_CDC_BULK_IN);
-        }
-    }
-    if (daint & BIT(16 + 5)) { // USB_LEP_CDC_BULK_OUT_2
-        u32 doepint = read32(dev->regs + DWC2_DOEPINT(5));
-        write32(dev->regs + DWC2_DOEPINT(5), doepint);
-        usb_debug_printf("ep0_out_handle_interrupt: DWC2_DOEPINT(5)=%x#USB_LEP_CDC_BULK_OUT_2\n",
-                         doepint);
-        if (doepint & DWC2_DOEPINT_XFER_COMPL) {
-            /* The bit can be set before the transfer actually completes on some devices... */
-            udelay(2);
-
-            usb_dwc2_cdc_handle_bulk_out_xfer_done(dev, USB_LEP_CDC_BULK_OUT_2);
-            usb_dwc2_cdc_start_bulk_out_xfer(dev, USB_LEP_CDC_BULK_OUT_2);
-        }
-    }
-    if (daint & BIT(0 + 6)) { // USB_LEP_CDC_BULK_IN_2
-        u32 diepint = read32(dev->regs + DWC2_DIEPINT(6));
-        write32(dev->regs + DWC2_DIEPINT(6), diepint);
-        usb_debug_printf("ep0_out_handle_interrupt: DWC2_DIEPINT(6)=%x#USB_LEP_CDC_BULK_IN_2\n",
-                         diepint);
-        // usb_debug_printf("dev->endpoints[USB_LEP_CDC_BULK_OUT_2].xfer_buffer at %p\n",
-        //                  dev->endpoints[USB_LEP_CDC_BULK_OUT_2].xfer_buffer);
-        dev->endpoints[USB_LEP_CDC_BULK_IN_2].xfer_in_progress = false;
-        // usb_dwc2_cdc_start_bulk_out_xfer(dev, USB_LEP_CDC_BULK_OUT_2);
-        // usb_debug_printf("ep1 send done, remain %u bytes\n",
-        // ringbuffer_get_used(usb_dwc2_cdc_get_ringbuffer(dev, USB_LEP_CDC_BULK_IN_2)) );
-        if (ringbuffer_get_used(usb_dwc2_cdc_get_ringbuffer(dev, USB_LEP_CDC_BULK_IN_2))) {
-            usb_dwc2_cdc_start_bulk_in_xfer(dev, USB_LEP_CDC_BULK_IN_2);
-        }
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
+        if (daint & BIT(16 + phyEndpoints[dev->pipe[i].ep_out]))
+            usb_dwc2_cdc_handle_bulk_out_int(dev, dev->pipe[i].ep_out);
+        if (daint & BIT(phyEndpoints[dev->pipe[i].ep_in] & 0xf))
+            usb_dwc2_cdc_handle_bulk_in_int(dev, dev->pipe[i].ep_in);
     }
 }
 
 static void usb_set_address(dwc2_dev_t *dev, u8 address)
 {
-    // usb_debug_printf("Set address %u\n", address);
+    usb_debug_printf("Set address %u\n", address);
     u32 dcfg = read32(dev->regs + DWC2_DCFG);
     dcfg = (dcfg & ~0x7f0) | (((u32)address << 4) & 0x7f0);
     write32(dev->regs + DWC2_DCFG, dcfg);
 }
 
-static void usb_dwc2_ep_hw_recv(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count)
+/* a full size transfer split over a ring wrap has to fit, a ZLP gets the spare descriptor */
+static_assert((MSC_MAX_XFER_SIZE + DESC_SEG_SIZE - 1) / DESC_SEG_SIZE + 1 <= DESCS_PER_EP,
+              "DESCS_PER_EP too small for MSC_MAX_XFER_SIZE");
+
+/*
+ * Build the descriptor chain for a transfer over spans, each one split into DESC_SEG_SIZE
+ * segments, with a trailing zero length descriptor if a ZLP was requested. Every span but the
+ * last has to be a whole number of packets, OUT spans are rounded up to one. Returns -1 if the
+ * transfer does not fit the chain.
+ */
+static int usb_dwc2_ep_fill_desc(dwc2_dev_t *dev, u8 ep, const struct dwc2_span *spans,
+                                 u32 nspans, u32 packet_count)
+{
+    dwc2_endpoint_t *endpoint = &dev->endpoints[ep];
+    bool dir_in = phyEndpoints[ep] & 0x80;
+    u32 mps = endpoint->max_packet_size ? endpoint->max_packet_size : EP0_MAX_PACKET_SIZE;
+    u32 total = 0, count = 0;
+    uintptr_t buf = 0;
+
+    for (u32 i = 0; i < nspans; i++)
+        total += spans[i].len;
+    bool zlp = total && packet_count > (total + mps - 1) / mps;
+
+    for (u32 i = 0; i < nspans; i++) {
+        u32 len = spans[i].len;
+        bool last = i == nspans - 1;
+
+        /* a zero length OUT (the EP0 status stage) still needs room for one packet */
+        if (!dir_in)
+            len = ALIGN_UP(max(len, 1U), mps);
+
+        buf = (uintptr_t)spans[i].buf;
+        do {
+            if (count == DESCS_PER_EP) {
+                usb_error_printf("EP%u: %u byte transfer does not fit %u descriptors\n",
+                                 phyEndpoints[ep] & 0xf, total, DESCS_PER_EP);
+                return -1;
+            }
+
+            u32 seg = min(len, (u32)DESC_SEG_SIZE);
+            u32 status = FIELD_PREP(DWC2_DMA_DESC_BS_MASK, DWC2_DMA_DESC_BS_HOST_READY) |
+                         FIELD_PREP(DWC2_DMA_DESC_NBYTES_MASK, seg);
+
+            len -= seg;
+            if (!len && last && !zlp) {
+                status |= DWC2_DMA_DESC_L | DWC2_DMA_DESC_IOC;
+                if (dir_in && (seg % mps))
+                    status |= DWC2_DMA_DESC_SP;
+            }
+
+            endpoint->desc[count].buf = buf;
+            endpoint->desc[count].status = status;
+            buf += seg;
+            count++;
+        } while (len);
+    }
+
+    if (zlp) {
+        endpoint->desc[count].buf = buf;
+        endpoint->desc[count].status = DWC2_DMA_DESC_L | DWC2_DMA_DESC_IOC;
+        count++;
+    }
+
+    endpoint->desc_count = count;
+    dma_wmb();
+    return 0;
+}
+
+/*
+ * Buffer Not Available: the core fetched a descriptor that was not host ready and disabled the
+ * endpoint. Hand the part of the chain it has not completed back to it and re-enable it.
+ */
+static void usb_dwc2_ep_rearm_desc(dwc2_dev_t *dev, u8 ep)
+{
+    dwc2_endpoint_t *endpoint = &dev->endpoints[ep];
+    u8 pep = phyEndpoints[ep];
+    u32 first;
+
+    if (!dev->desc_dma)
+        return;
+
+    dma_rmb();
+    for (first = 0; first < endpoint->desc_count; first++)
+        if (FIELD_GET(DWC2_DMA_DESC_BS_MASK, endpoint->desc[first].status) !=
+            DWC2_DMA_DESC_BS_DMA_DONE)
+            break;
+    if (first == endpoint->desc_count)
+        return;
+
+    usb_error_printf("EP%u %s: buffer not available, re-arming descriptor %u\n", pep & 0xf,
+                     (pep & 0x80) ? "IN" : "OUT", first);
+    for (u32 i = first; i < endpoint->desc_count; i++)
+        endpoint->desc[i].status = (endpoint->desc[i].status & ~DWC2_DMA_DESC_BS_MASK) |
+                                   FIELD_PREP(DWC2_DMA_DESC_BS_MASK, DWC2_DMA_DESC_BS_HOST_READY);
+    dma_wmb();
+
+    if (pep & 0x80) {
+        u8 in = pep & 0xf;
+        write32(dev->regs + DWC2_DIEPDMA(in), (uintptr_t)&endpoint->desc[first]);
+        set32(dev->regs + DWC2_DIEPCTL(in), DWC2_DXEPCTLi_EnableEP | DWC2_DXEPCTL_ClearNAK);
+    } else {
+        write32(dev->regs + DWC2_DOEPDMA(pep), (uintptr_t)&endpoint->desc[first]);
+        set32(dev->regs + DWC2_DOEPCTL(pep), DWC2_DXEPCTLi_EnableEP | DWC2_DXEPCTL_ClearNAK);
+    }
+}
+
+static u32 usb_dwc2_ep_out_xfer_size(dwc2_dev_t *dev, u8 ep)
+{
+    dwc2_endpoint_t *endpoint = &dev->endpoints[ep];
+    u32 residue;
+
+    dma_rmb();
+    if (dev->desc_dma) {
+        residue = 0;
+        for (u32 i = 0; i < endpoint->desc_count; i++)
+            residue += FIELD_GET(DWC2_DMA_DESC_NBYTES_MASK, endpoint->desc[i].status);
+    } else
+        residue = read32(dev->regs + DWC2_DOEPTSIZ(phyEndpoints[ep])) & 0x7ffff;
+
+    return endpoint->xfer_len - min(residue, endpoint->xfer_len);
+}
+
+static int usb_dwc2_ep_hw_recv_buf(dwc2_dev_t *dev, u8 ep, void *buf, u32 hw_xfer_size,
+                                   u32 packet_count)
 {
-    // usb_debug_printf("ep_hw_recv with endpoint_index = %u, %u | %u \n", ep, hw_xfer_size,
-    // packet_count);
+    usb_debug_printf("ep_hw_recv with endpoint_index = %u, %u | %u \n", ep, hw_xfer_size,
+                     packet_count);
     if (phyEndpoints[ep] & 0x80) { // dir_in
         usb_error_printf("ep_hw_recv with dir_in endpoint =%u \n", phyEndpoints[ep]);
-        return;
+        return -1;
     }
 
+    /* buffers outside the DMA pool (the MSC window) must not have lines that get written back */
+    if (!dma_is_coherent(buf))
+        dc_civac_range(buf, hw_xfer_size);
+
     dma_rmb();
     u8 pep = phyEndpoints[ep];
+    dev->endpoints[ep].xfer_len = hw_xfer_size;
+
+    if (dev->desc_dma) {
+        struct dwc2_span span = {buf, hw_xfer_size};
 
-    // write the lower 32 bits the high bit is handled at the PHY level
-    write32(dev->regs + DWC2_DOEPDMA(pep), (uintptr_t)dev->endpoints[ep].xfer_buffer);
-    write32(dev->regs + DWC2_DOEPTSIZ(pep), (packet_count << 19) | hw_xfer_size);
+        if (usb_dwc2_ep_fill_desc(dev, ep, &span, 1, packet_count))
+            return -1;
+        write32(dev->regs + DWC2_DOEPDMA(pep), (uintptr_t)dev->endpoints[ep].desc);
+    } else {
+        // write the lower 32 bits the high bit is handled at the PHY level
+        write32(dev->regs + DWC2_DOEPDMA(pep), (uintptr_t)buf);
+        write32(dev->regs + DWC2_DOEPTSIZ(pep), (packet_count << 19) | hw_xfer_size);
+    }
     if (!ep) { // EP0
-        // usb_debug_printf("usb_dwc2_ep_hw_recv with EP0out now:  state=%s\n",
-        // ep0_state_names[dev->ep0_state]);
+        usb_debug_printf("usb_dwc2_ep_hw_recv with EP0out now:  state=%s\n",
+                         ep0_state_names[dev->ep0_state]);
         if (dev->ep0_state == USB_DWC2_EP0_STATE_DATA_RECV)
             set32(dev->regs + DWC2_DOEPCTL(pep), DWC2_DXEPCTLi_EnableEP | DWC2_DXEPCTL_ClearNAK);
         else
             set32(dev->regs + DWC2_DOEPCTL(pep), DWC2_DXEPCTLi_EnableEP);
     } else
         set32(dev->regs + DWC2_DOEPCTL(pep), DWC2_DXEPCTLi_EnableEP | DWC2_DXEPCTL_ClearNAK);
+    return 0;
 }
 
-static void usb_dwc2_ep_hw_send(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count)
+static void usb_dwc2_ep_hw_recv(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count)
+{
+    usb_dwc2_ep_hw_recv_buf(dev, ep, dev->endpoints[ep].xfer_buffer, hw_xfer_size, packet_count);
+}
+
+/* send spans as one transfer, buffer DMA only takes a single one */
+static int usb_dwc2_ep_hw_send_spans(dwc2_dev_t *dev, u8 ep, const struct dwc2_span *spans,
+                                     u32 nspans, u32 packet_count)
 {
     u8 pep = phyEndpoints[ep] & 0xf;
+    u32 hw_xfer_size = 0;
+
+    for (u32 i = 0; i < nspans; i++)
+        hw_xfer_size += spans[i].len;
+
     if (ep == USB_LEP_CDC_BULK_IN_2)
         usb_debug_printf("ep_hw_send with EP%u endpoint_index = %u, %u | %u \n", pep, ep,
                          hw_xfer_size, packet_count);
     if (!(phyEndpoints[ep] & 0x80)) { // dir_out
         usb_error_printf("usb_dwc2_ep_hw_send with dir_out endpoint =%u E \n", phyEndpoints[ep]);
-        return;
+        return -1;
     }
+    if (!dev->desc_dma && nspans != 1) {
+        usb_error_printf("EP%u: buffer DMA can't send %u spans\n", pep, nspans);
+        return -1;
+    }
+
+    for (u32 i = 0; i < nspans; i++)
+        if (!dma_is_coherent(spans[i].buf))
+            dc_cvac_range(spans[i].buf, spans[i].len);
 
     dma_rmb();
-    write32(dev->regs + DWC2_DIEPDMA(pep), (uintptr_t)dev->endpoints[ep].xfer_buffer);
-    write32(dev->regs + DWC2_DIEPTSIZ(pep), (packet_count << 19) | hw_xfer_size);
+    dev->endpoints[ep].xfer_len = hw_xfer_size;
+
+    if (dev->desc_dma) {
+        if (usb_dwc2_ep_fill_desc(dev, ep, spans, nspans, packet_count))
+            return -1;
+        write32(dev->regs + DWC2_DIEPDMA(pep), (uintptr_t)dev->endpoints[ep].desc);
+    } else {
+        write32(dev->regs + DWC2_DIEPDMA(pep), (uintptr_t)spans[0].buf);
+        write32(dev->regs + DWC2_DIEPTSIZ(pep), (packet_count << 19) | hw_xfer_size);
+    }
     set32(dev->regs + DWC2_DIEPCTL(pep), DWC2_DXEPCTLi_EnableEP | DWC2_DXEPCTL_ClearNAK);
     if (pep == 0)
         set32(dev->regs + DWC2_DOEPCTL(pep), DWC2_DXEPCTL_ClearNAK); // set cak
     dev->endpoints[ep].in_flight = hw_xfer_size;
+    return 0;
+}
+
+static int usb_dwc2_ep_hw_send_buf(dwc2_dev_t *dev, u8 ep, void *buf, u32 hw_xfer_size,
+                                   u32 packet_count)
+{
+    struct dwc2_span span = {buf, hw_xfer_size};
+
+    return usb_dwc2_ep_hw_send_spans(dev, ep, &span, 1, packet_count);
+}
+
+static void usb_dwc2_ep_hw_send(dwc2_dev_t *dev, u8 ep, u32 hw_xfer_size, u32 packet_count)
+{
+    usb_dwc2_ep_hw_send_buf(dev, ep, dev->endpoints[ep].xfer_buffer, hw_xfer_size, packet_count);
+}
+
+static void usb_dwc2_fifo_setup(dwc2_dev_t *dev)
+{
+    u32 depth = FIELD_GET(DWC2_GHWCFG3_DFIFO_DEPTH, read32(dev->regs + DWC2_GHWCFG3));
+    u32 limit = depth - (dev->desc_dma ? EP_INFO_SIZE : 0);
+    u32 addr = RX_FIFO_SIZE + EP0_TX_FIFO_SIZE;
+    u32 bulk_size = BULK_TX_FIFO_MIN;
+    u32 bulk_count = 0;
+
+    /* EP0 IN (0x80) has its TX FIFO set up through GNPTXFSIZ, only the others get a DTXFSIZ */
+    for (int i = 1; i < MAX_ENDPOINTS; i++) {
+        if (!(phyEndpoints[i] & 0x80) || !(phyEndpoints[i] & 0xf))
+            continue;
+        if (i == USB_LEP_CDC_INTR_IN || i == USB_LEP_CDC_INTR_IN_2)
+            addr += INTR_TX_FIFO_SIZE;
+        else
+            bulk_count++;
+    }
+
+    if (limit >= addr + bulk_count * BULK_TX_FIFO_MIN) {
+        bulk_size = ALIGN_DOWN((limit - addr) / bulk_count, BULK_EP_MAX_PACKET_SIZE / 4);
+        bulk_size = min(bulk_size, BULK_TX_FIFO_MAX);
+    } else {
+        usb_error_printf("FIFO RAM too small (%u words), bulk IN FIFOs may overlap\n", depth);
+    }
+
+    write32(dev->regs + DWC2_GRXFSIZ, RX_FIFO_SIZE);
+    write32(dev->regs + DWC2_GNPTXFSIZ, FIELD_PREP(DWC2_FIFOSIZE_DEPTH, EP0_TX_FIFO_SIZE) |
+                                            FIELD_PREP(DWC2_FIFOSIZE_START, RX_FIFO_SIZE));
+
+    addr = RX_FIFO_SIZE + EP0_TX_FIFO_SIZE;
+    for (int i = 1; i < MAX_ENDPOINTS; i++) {
+        u8 pep = phyEndpoints[i];
+        if (!(pep & 0x80) || !(pep & 0xf))
+            continue;
+
+        u32 size = bulk_size;
+        if (i == USB_LEP_CDC_INTR_IN || i == USB_LEP_CDC_INTR_IN_2)
+            size = INTR_TX_FIFO_SIZE;
+
+        u32 txfsiz = FIELD_PREP(DWC2_FIFOSIZE_DEPTH, size) | FIELD_PREP(DWC2_FIFOSIZE_START, addr);
+        write32(dev->regs + DWC2_DTXFSIZ(pep & 0xf), txfsiz);
+        addr += size;
+    }
+
+    if (dev->desc_dma)
+        write32(dev->regs + DWC2_GDFIFOCFG, FIELD_PREP(DWC2_GDFIFOCFG_GDFIFOCFG, depth) |
+                                                FIELD_PREP(DWC2_GDFIFOCFG_EPINFOBASE, addr));
+
+    usb_debug_printf("FIFO: %u words, rx %u, bulk tx %u x %u, %u used\n", depth, RX_FIFO_SIZE,
+                     bulk_count, bulk_size, addr);
+
+    /* the old layout may have left data behind, start from empty FIFOs */
+    write32(dev->regs + DWC2_GRSTCTL, DWC2_GRSTCTL_RXFFLSH | DWC2_GRSTCTL_TXFFLSH |
+                                          FIELD_PREP(DWC2_GRSTCTL_TXFNUM, DWC2_GRSTCTL_TXFALL));
+    if (poll32(dev->regs + DWC2_GRSTCTL, DWC2_GRSTCTL_RXFFLSH | DWC2_GRSTCTL_TXFFLSH, 0, 1000))
+        usb_error_printf("FIFO flush timed out\n");
 }
 
 static void usb_dwc2_handle_usbrst(dwc2_dev_t *dev)
 {
-    // usb_debug_printf("handle_usbrst: Reset now\n");
-    next_tx_fifo_addr = TX_FIFO_SIZE + RX_FIFO_SIZE; // EP0_TX+RX
+    usb_debug_printf("handle_usbrst: Reset now\n");
     dev->endpoints[0].xfer_in_progress = false;
     // for (int i = 1; i < MAX_ENDPOINTS; ++i) {
     //     dev->endpoints[i].xfer_in_progress = false;
@@ -1277,36 +2217,34 @@ static void usb_dwc2_handle_usbrst(dwc2_dev_t *dev)
                                              DWC2_DIEPINT_InTokenTXFifoEmpty);
     write32(dev->regs + DWC2_DOEPINT(0), DWC2_DOEPINT_XFER_COMPL | DWC2_DOEPINT_EPDisabled |
                                              DWC2_DOEPINT_AHBErr | DWC2_DOEPINT_SETUP);
-    write32(dev->regs + DWC2_GRXFSIZ, RX_FIFO_SIZE);
-    write32(dev->regs + DWC2_GNPTXFSIZ, (TX_FIFO_SIZE << 16) | RX_FIFO_SIZE); //   64 bytes
-    write32(dev->regs + DWC2_DTXFSIZ(1), 0x0040022b);                         //  256 bytes
-    write32(dev->regs + DWC2_DTXFSIZ(2), 0x0040022b);                         // 256 bytes
-    write32(dev->regs + DWC2_DTXFSIZ(3), 0x0040022b);                         // 256 bytes
-    write32(dev->regs + DWC2_DTXFSIZ(4), 0x0040022b);                         // 256 bytes
+    usb_dwc2_fifo_setup(dev);
     write32(dev->regs + DWC2_DOEPCTL(0), 0);
     write32(dev->regs + DWC2_DIEPCTL(0), 0);
-    write32(dev->regs + DWC2_GINTSTS,
-            read32(dev->regs + DWC2_GINTSTS)); // write bit 1 to clear int status before enable it
+    // write bit 1 to clear int status before enable it
+    write32(dev->regs + DWC2_GINTSTS, read32(dev->regs + DWC2_GINTSTS));
     set32(dev->regs + DWC2_GINTMSK, DWC2_GINTMSK_IEPIntMsk | DWC2_GINTMSK_OEPIntMsk);
     write32(dev->regs + DWC2_DOEPMSK,
-            DWC2_DOEPMSK_XferComplMsk | DWC2_DOEPMSK_AHBErrMsk | DWC2_DOEPMSK_SetUPMsk);
+            DWC2_DOEPMSK_XferComplMsk | DWC2_DOEPMSK_AHBErrMsk | DWC2_DOEPMSK_SetUPMsk |
+                (dev->desc_dma ? DWC2_DOEPMSK_BNAMsk : 0));
     write32(dev->regs + DWC2_DIEPMSK,
-            DWC2_DIEPMSK_XferComplMsk | DWC2_DIEPMSK_AHBErrMsk | DWC2_DIEPMSK_TimeOUTMsk);
+            DWC2_DIEPMSK_XferComplMsk | DWC2_DIEPMSK_AHBErrMsk | DWC2_DIEPMSK_TimeOUTMsk |
+                (dev->desc_dma ? DWC2_DIEPMSK_BNAMsk : 0));
     write32(dev->regs + DWC2_DAINTMSK, 0);
     // usb_dwc2_ep_enable_recv(dev, USB_LEP_CTRL_OUT);
     /* clear STALL mode for all endpoints */
     // USB_DEBUG_PRINT_REGISTERS(dev);
-    // usb_debug_printf("GINTMSK=%x after rst\n", read32(dev->regs + DWC2_GINTMSK));
+    usb_debug_printf("GINTMSK=%x after rst\n", read32(dev->regs + DWC2_GINTMSK));
 }
 
 static void usb_dwc2_ep_abort(dwc2_dev_t *dev, u8 ep)
 {
     dev->endpoints[ep].in_flight = 0;
     dev->endpoints[ep].xfer_in_progress = 0;
+    dev->endpoints[ep].xfer_direct = false;
     u8 pep = phyEndpoints[ep];
     if (pep & 0x80) { // dir_in
         pep &= 0xf;
-        // usb_debug_printf("EP%u IN abort\n", pep);
+        usb_debug_printf("EP%u IN abort\n", pep);
         if (read32(dev->regs + DWC2_DIEPCTL(pep)) & DWC2_DXEPCTLi_EnableEP) {
             set32(dev->regs + DWC2_DIEPCTL(pep), DWC2_DXEPCTLi_DisableEP);
             while (1) {
@@ -1318,7 +2256,7 @@ static void usb_dwc2_ep_abort(dwc2_dev_t *dev, u8 ep)
         write32(dev->regs + DWC2_DIEPINT(pep), read32(dev->regs + DWC2_DIEPINT(pep)));
         return;
     }
-    // usb_debug_printf("EP%u OUT abort\n", pep); // dir_out
+    usb_debug_printf("EP%u OUT abort\n", pep); // dir_out
     if (read32(dev->regs + DWC2_DOEPCTL(pep)) & DWC2_DXEPCTLi_EnableEP) {
         write32(dev->regs + DWC2_GINTSTS, DWC2_GINTSTS_GOUTNakEff);
         set32(dev->regs + DWC2_DCTL, DWC2_DCTL_SGOUTNak);
@@ -1343,7 +2281,7 @@ static void usb_dwc2_handle_event_connect_done(dwc2_dev_t *dev)
 {
     u32 speed = read32(dev->regs + DWC2_DSTS) & DWC2_DSTS_CONNECTSPD;
 
-    // usb_debug_printf("current speed %x from DSTS\n", speed);
+    usb_debug_printf("current speed %x from DSTS\n", speed);
 
     if (speed != DWC2_DSTS_HIGHSPEED) {
         usb_error_printf(
@@ -1351,7 +2289,7 @@ static void usb_dwc2_handle_event_connect_done(dwc2_dev_t *dev)
             read32(dev->regs + DWC2_DSTS));
         return;
     }
-    // usb_debug_printf("enum done; receive next packet on EP0 OUT\n");
+    usb_debug_printf("enum done; receive next packet on EP0 OUT\n");
     usb_dwc2_ep_activate(dev, USB_LEP_CTRL_OUT, 0, EP0_MAX_PACKET_SIZE);
     usb_dwc2_ep_activate(dev, USB_LEP_CTRL_IN, 0, EP0_MAX_PACKET_SIZE);
     usb_dwc2_start_setup_phase(dev); // recving packet on EP0-OUT
@@ -1367,10 +2305,12 @@ void usb_dwc2_handle_interrupts(dwc2_dev_t *dev)
     if (!dev)
         return;
 
+    u64 start = get_ticks();
     u32 gintsts = 0;
+    trace_begin("usb_dwc2_irq", dev->regs);
     while (1) {
         u32 val = read32(dev->regs + DWC2_GINTSTS);
-        // usb_debug_printf("DWC2_GINTSTS=%x DAINT=%x\n", val, read32(dev->regs + DWC2_DAINT));
+        usb_debug_printf("DWC2_GINTSTS=%x DAINT=%x\n", val, read32(dev->regs + DWC2_DAINT));
         write32(dev->regs + DWC2_GINTSTS,
                 val & SUPPORTED_GINST); // clear supported flags,set 1 to clear
         gintsts = gintsts | val;        // current sts
@@ -1383,19 +2323,202 @@ void usb_dwc2_handle_interrupts(dwc2_dev_t *dev)
         }
         if (gintsts & (DWC2_GINTSTS_OEPInt | DWC2_GINTSTS_IEPInt)) {
             usb_dwc2_handle_interrupts_ep(dev);
-            // usb_debug_printf("daintmask=0x%x\n", read32(dev->regs + DWC2_DAINTMSK));
             // EP interrupt
         }
         if (!(gintsts & SUPPORTED_GINST)) {
-            // usb_debug_printf("non supported interrupt happened, gintsts=0x%x\n", gintsts);
+            usb_debug_printf("non supported interrupt happened, gintsts=0x%x\n", gintsts);
             break;
         } else {
             gintsts &= ~SUPPORTED_GINST; // clear supported interrupt flag
         }
     }
+
+    dev->stats.irq_ticks += get_ticks() - start;
+    dev->stats.irq_count++;
+    trace_end("usb_dwc2_irq", dev->regs);
 }
 
-dwc2_dev_t *usb_dwc2_init(uintptr_t regs)
+void usb_dwc2_source_sink(dwc2_dev_t *dev, bool enable, struct usb_dwc2_source_sink_stats *stats)
+{
+    u32 flags = irq_save();
+
+    if (stats)
+        memcpy(stats, &dev->source_sink.stats, sizeof(*stats));
+
+    if (enable != dev->source_sink.enabled) {
+        u8 ep_in = dev->pipe[USB_BULK_PIPE].ep_in;
+
+        /* a transfer armed in the other mode is left to complete on its own */
+        memset(&dev->source_sink.stats, 0, sizeof(dev->source_sink.stats));
+        dev->source_sink.enabled = enable;
+        if (enable && dev->pipe[USB_BULK_PIPE].ready)
+            usb_dwc2_cdc_start_bulk_in_xfer(dev, ep_in);
+    }
+
+    irq_restore(flags);
+}
+
+/* drop off the bus and come back, so the host enumerates us again with new descriptors */
+static void usb_dwc2_reconnect(dwc2_dev_t *dev)
+{
+    u32 flags = irq_save();
+    for (int i = 0; i < USB_PIPE_MAX; i++)
+        dev->pipe[i].ready = false;
+
+    set32(dev->regs + DWC2_DCTL, DWC2_DCTL_SftDisCon);
+    irq_restore(flags);
+
+    /* the IRQ handler keeps servicing the controller while the host notices we are gone */
+    mdelay(RECONNECT_DELAY_MS);
+
+    clear32(dev->regs + DWC2_DCTL, DWC2_DCTL_SftDisCon);
+}
+
+int usb_dwc2_msc_start(dwc2_dev_t *dev, void *base, size_t size)
+{
+    if ((uintptr_t)base % MSC_WINDOW_ALIGN || size % MSC_WINDOW_ALIGN ||
+        size < USB_MSC_BLOCK_SIZE) {
+        usb_error_printf("invalid MSC window %p size 0x%x\n", base, size);
+        return -1;
+    }
+
+    u32 flags = irq_save();
+    usb_msc_init(&dev->msc.scsi, base, size);
+    dev->msc.enabled = true;
+    irq_restore(flags);
+
+    usb_dwc2_reconnect(dev);
+
+    return 0;
+}
+
+void usb_dwc2_msc_stop(dwc2_dev_t *dev)
+{
+    u32 flags = irq_save();
+    bool was_enabled = dev->msc.enabled;
+    dev->msc.enabled = false;
+    irq_restore(flags);
+
+    if (was_enabled)
+        usb_dwc2_reconnect(dev);
+}
+
+int usb_dwc2_msc_status(dwc2_dev_t *dev, struct usb_msc_status *status)
+{
+    int ret = -1;
+
+    u32 flags = irq_save();
+    if (dev->msc.enabled) {
+        memcpy(status, &dev->msc.scsi.status, sizeof(*status));
+        ret = 0;
+    }
+    irq_restore(flags);
+
+    return ret;
+}
+
+/* move a ringbuffer's contents into a new one of a different size */
+static int usb_dwc2_ringbuffer_resize(dwc2_dev_t *dev, ringbuffer_t **ring, size_t size,
+                                      bool host2device, u8 ep)
+{
+    dwc2_endpoint_t *endpoint = &dev->endpoints[ep];
+    ringbuffer_t *old = *ring;
+    const u8 *data;
+    size_t len;
+
+    if (!old)
+        return 0;
+
+    usb_dwc2_free_retired_ring(dev, ep);
+
+    ringbuffer_t *new = ringbuffer_alloc(size);
+    if (!new)
+        return -1;
+
+    if (new->len == old->len) {
+        ringbuffer_free(new);
+        return 0;
+    }
+
+    usb_dwc2_ring_set_watermarks(dev, new, host2device);
+
+    /*
+     * a transfer running straight over the old ring keeps it alive until it is over, its data
+     * then goes to (OUT) or is released from (IN) the new one
+     */
+    u32 flags = irq_save();
+    bool busy = endpoint->xfer_in_progress && endpoint->xfer_direct && endpoint->xfer_ring == old;
+    if (ringbuffer_get_used(old) > new->len || (busy && endpoint->retired_ring)) {
+        irq_restore(flags);
+        ringbuffer_free(new);
+        return -1;
+    }
+
+    while ((len = ringbuffer_peek(old, &data))) {
+        ringbuffer_write(data, len, new);
+        ringbuffer_consume(old, len);
+    }
+    *ring = new;
+    if (busy)
+        endpoint->retired_ring = old;
+    irq_restore(flags);
+
+    if (!busy)
+        ringbuffer_free(old);
+    return 0;
+}
+
+/*
+ * Change the ringbuffer sizes of a pipe, 0 keeps the current size. Pipes that were never
+ * ready only remember them for the allocation, live ones are reallocated keeping their data.
+ */
+int usb_dwc2_set_buffer_size(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, size_t host2device_size,
+                             size_t device2host_size)
+{
+    if (pipe >= USB_PIPE_MAX)
+        return -1;
+
+    if (!host2device_size)
+        host2device_size = dev->pipe[pipe].host2device_size;
+    if (!device2host_size)
+        device2host_size = dev->pipe[pipe].device2host_size;
+
+    if (host2device_size < MIN_BUFFER_SIZE || device2host_size < MIN_BUFFER_SIZE) {
+        usb_error_printf("ringbuffers must be at least 0x%x bytes\n", MIN_BUFFER_SIZE);
+        return -1;
+    }
+
+    if (usb_dwc2_ringbuffer_resize(dev, &dev->pipe[pipe].host2device, host2device_size, true,
+                                   dev->pipe[pipe].ep_out) ||
+        usb_dwc2_ringbuffer_resize(dev, &dev->pipe[pipe].device2host, device2host_size, false,
+                                   dev->pipe[pipe].ep_in)) {
+        usb_error_printf("failed to resize ringbuffers for pipe %d\n", pipe);
+        return -1;
+    }
+
+    dev->pipe[pipe].host2device_size = host2device_size;
+    dev->pipe[pipe].device2host_size = device2host_size;
+
+    /* the OUT endpoint may have been waiting for room */
+    u32 flags = irq_save();
+    if (dev->pipe[pipe].ready)
+        usb_dwc2_cdc_start_bulk_out_xfer(dev, dev->pipe[pipe].ep_out);
+    irq_restore(flags);
+
+    return 0;
+}
+
+void usb_dwc2_get_stats(dwc2_dev_t *dev, struct usb_dwc2_stats *stats, bool reset)
+{
+    u32 flags = irq_save();
+    memcpy(stats, &dev->stats, sizeof(*stats));
+    stats->num_endpoints = MAX_ENDPOINTS;
+    if (reset)
+        memset(&dev->stats, 0, sizeof(dev->stats));
+    irq_restore(flags);
+}
+
+dwc2_dev_t *usb_dwc2_init(uintptr_t regs, bool desc_dma)
 {
     /* version check */
     u32 snpsid = read32(regs + DWC2_GSNPSID);
@@ -1406,6 +2529,14 @@ dwc2_dev_t *usb_dwc2_init(uintptr_t regs)
 
     uart_printf("usb-dwc2: Core version %04x\n", snpsid & 0xffff);
 
+    if (desc_dma &&
+        (FIELD_GET(DWC2_GHWCFG2_ARCH_MASK, read32(regs + DWC2_GHWCFG2)) !=
+             DWC2_GHWCFG2_ARCH_INT_DMA ||
+         !(read32(regs + DWC2_GHWCFG4) & DWC2_GHWCFG4_DESC_DMA))) {
+        uart_printf("usb-dwc2: descriptor DMA not supported, using buffer DMA\n");
+        desc_dma = false;
+    }
+
     dwc2_dev_t *dev = calloc(1, sizeof(*dev));
     if (!dev)
         return NULL;
@@ -1416,11 +2547,11 @@ dwc2_dev_t *usb_dwc2_init(uintptr_t regs)
                sizeof(cdc_default_line_coding));
 
     dev->regs = regs;
+    dev->desc_dma = desc_dma;
 #ifdef LOG_REGISTER_RW
     debug_reg_base = regs;
 #endif
-
-    dev->dma_page_p = memalign(SZ_16K, max(DMA_BUFFER_SIZE * MAX_ENDPOINTS, SZ_16K));
+    dev->dma_page_p = dma_alloc(max(DMA_BUFFER_SIZE * MAX_ENDPOINTS, SZ_16K), SZ_16K);
     if (!dev->dma_page_p)
         goto error;
 
@@ -1436,6 +2567,19 @@ dwc2_dev_t *usb_dwc2_init(uintptr_t regs)
         dev->endpoints[i].xfer_buffer = dev->dma_page_p + xferbuffer_offset;
     }
 
+    /* one extra descriptor per endpoint for a trailing ZLP */
+    if (desc_dma) {
+        size_t desc_size = sizeof(struct dwc2_dma_desc) * (DESCS_PER_EP + 1) * MAX_ENDPOINTS;
+        dev->desc_page_p = dma_alloc(desc_size, SZ_4K);
+        if (!dev->desc_page_p)
+            goto error;
+
+        memset(dev->desc_page_p, 0, desc_size);
+        for (int i = 0; i < MAX_ENDPOINTS; ++i)
+            dev->endpoints[i].desc = &dev->desc_page_p[i * (DESCS_PER_EP + 1)];
+        usb_debug_printf("allocated descriptors at %p\n", dev->desc_page_p);
+    }
+
     /* prepare CDC ACM interfaces */
     dev->pipe[CDC_ACM_PIPE_0].ep_intr = USB_LEP_CDC_INTR_IN;
     dev->pipe[CDC_ACM_PIPE_0].ep_in = USB_LEP_CDC_BULK_IN;
@@ -1445,19 +2589,20 @@ dwc2_dev_t *usb_dwc2_init(uintptr_t regs)
     dev->pipe[CDC_ACM_PIPE_1].ep_in = USB_LEP_CDC_BULK_IN_2;
     dev->pipe[CDC_ACM_PIPE_1].ep_out = USB_LEP_CDC_BULK_OUT_2;
 
-    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
-        dev->pipe[i].host2device = ringbuffer_alloc(CDC_BUFFER_SIZE);
-        if (!dev->pipe[i].host2device)
-            goto error;
-        dev->pipe[i].device2host = ringbuffer_alloc(CDC_BUFFER_SIZE);
-        if (!dev->pipe[i].device2host)
-            goto error;
+    /* prepare raw bulk interface */
+    dev->pipe[USB_BULK_PIPE].ep_in = USB_LEP_BULK_IN;
+    dev->pipe[USB_BULK_PIPE].ep_out = USB_LEP_BULK_OUT;
+
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
+        dev->pipe[i].host2device_size = default_buffer_size[i];
+        dev->pipe[i].device2host_size = default_buffer_size[i];
     }
 
     set32(regs + DWC2_DCTL, DWC2_DCTL_SftDisCon);
-    write32(regs + DWC2_GAHBCFG, FIELD_PREP(DWC2_GAHBCFG_HBSTLEN_MASK, 7) | DWC2_GAHBCFG_DMA_EN);
+    write32(regs + DWC2_GAHBCFG, FIELD_PREP(DWC2_GAHBCFG_HBSTLEN_MASK, 7) | DWC2_GAHBCFG_DMA_EN |
+                                     DWC2_GAHBCFG_GLBL_INTR_EN);
     write32(regs + DWC2_GUSBCFG, DWC2_GUSBCFG_PHYIF16 | FIELD_PREP(GUSBCFG_USBTRDTIM_MASK, 5));
-    write32(regs + DWC2_DCFG, DCFG_NZ_STS_OUT_HSHK);
+    write32(regs + DWC2_DCFG, DCFG_NZ_STS_OUT_HSHK | (desc_dma ? DCFG_DESC_DMA : 0));
     write32(regs + DWC2_GINTMSK, 0);
     write32(regs + DWC2_DOEPMSK, 0);
     write32(regs + DWC2_DIEPMSK, 0);
@@ -1489,7 +2634,9 @@ error:
 
 void usb_dwc2_shutdown(dwc2_dev_t *dev)
 {
-    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++)
+    clear32(dev->regs + DWC2_GAHBCFG, DWC2_GAHBCFG_GLBL_INTR_EN);
+
+    for (int i = 0; i < USB_PIPE_MAX; i++)
         dev->pipe[i].ready = false;
 
     /* Disconnect USB gadget */
@@ -1504,43 +2651,66 @@ void usb_dwc2_shutdown(dwc2_dev_t *dev)
     if (poll32(dev->regs + DWC2_GRSTCTL, DWC2_GRSTCTL_CSFTRST, 0, 10000))
         usb_error_printf("Failed to reset the controller\n");
 
-    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
+    for (int i = 0; i < USB_PIPE_MAX; i++) {
         ringbuffer_free(dev->pipe[i].device2host);
         ringbuffer_free(dev->pipe[i].host2device);
     }
+    for (int i = 0; i < MAX_ENDPOINTS; i++)
+        ringbuffer_free(dev->endpoints[i].retired_ring);
 
-    free(dev->dma_page_p);
+    dma_free(dev->desc_page_p);
+    dma_free(dev->dma_page_p);
     free(dev);
 }
 
+/*
+ * The foreground entry points below share the ringbuffers and endpoint state with
+ * usb_dwc2_handle_interrupts(), which may also run from the IRQ vector. Every access is done
+ * with IRQs masked, and the busy loops unmask between iterations so the handler can make
+ * progress.
+ */
 u8 usb_dwc2_getbyte(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
 {
-    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
-    if (!host2device)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return 0;
 
+    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
+
     u8 ep = dev->pipe[pipe].ep_out;
 
     u8 c;
-    while (ringbuffer_read(&c, 1, host2device) < 1) {
-        usb_dwc2_handle_events(dev);
-        usb_dwc2_cdc_start_bulk_out_xfer(dev, ep);
-    }
+    size_t read;
+    do {
+        u32 flags = irq_save();
+        read = ringbuffer_read(&c, 1, host2device);
+        if (!read) {
+            usb_dwc2_handle_interrupts(dev);
+            usb_dwc2_cdc_start_bulk_out_xfer(dev, ep);
+        }
+        irq_restore(flags);
+    } while (!read);
     return c;
 }
 
 void usb_dwc2_putbyte(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, u8 byte)
 {
-    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
-    if (!device2host)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return;
 
+    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
+
     u8 ep = dev->pipe[pipe].ep_in;
 
-    while (ringbuffer_write(&byte, 1, device2host) < 1) {
-        usb_dwc2_handle_events(dev);
-        usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
-    }
+    size_t wrote;
+    do {
+        u32 flags = irq_save();
+        wrote = ringbuffer_write(&byte, 1, device2host);
+        if (!wrote) {
+            usb_dwc2_handle_interrupts(dev);
+            usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
+        }
+        irq_restore(flags);
+    } while (!wrote);
 }
 
 size_t usb_dwc2_queue(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count)
@@ -1551,21 +2721,24 @@ size_t usb_dwc2_queue(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf,
     if (!dev || !dev->pipe[pipe].ready)
         return 0;
 
-    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
-    if (!device2host)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return 0;
 
+    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
+
     u8 ep = dev->pipe[pipe].ep_in;
 
     while (count) {
+        u32 flags = irq_save();
         wrote = ringbuffer_write(p, count, device2host);
         count -= wrote;
         p += wrote;
         sent += wrote;
         if (count) {
-            usb_dwc2_handle_events(dev);
+            usb_dwc2_handle_interrupts(dev);
             usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
         }
+        irq_restore(flags);
     }
 
     return sent;
@@ -1576,38 +2749,89 @@ size_t usb_dwc2_write(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf,
     if (!dev)
         return -1;
 
-    // usb_debug_printf("***dwc2_write,count=%u\n", count);
+    usb_debug_printf("***dwc2_write,count=%zu\n", count);
     u8 ep = dev->pipe[pipe].ep_in;
     size_t ret = usb_dwc2_queue(dev, pipe, buf, count);
 
+    u32 flags = irq_save();
     usb_dwc2_cdc_start_bulk_in_xfer(dev, ep);
+    irq_restore(flags);
     // USB_DEBUG_PRINT_REGISTERS(dev);
 
     return ret;
 }
 
+/* Write without waiting for the host: only what fits in the device2host ringbuffer is taken */
+/* reached from IRQ context through the console drain, so this must not allocate the rings */
+size_t usb_dwc2_try_write(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count)
+{
+    if (!dev || !dev->pipe[pipe].ready || !dev->pipe[pipe].device2host)
+        return 0;
+
+    u32 flags = irq_save();
+    size_t wrote = ringbuffer_write(buf, count, dev->pipe[pipe].device2host);
+    usb_dwc2_cdc_start_bulk_in_xfer(dev, dev->pipe[pipe].ep_in);
+    irq_restore(flags);
+
+    return wrote;
+}
+
+/*
+ * Like usb_dwc2_try_write(), but what does not fit is dropped and counted: the free space in
+ * the ringbuffer is the credit. Used for pipes that a host may never drain, so that their
+ * writers can not stall the rest of the device. All of buf is consumed, so callers never
+ * retry (and count) the dropped part again.
+ */
+size_t usb_dwc2_write_nonblock(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf,
+                               size_t count)
+{
+    if (!dev)
+        return 0;
+
+    size_t wrote = usb_dwc2_try_write(dev, pipe, buf, count);
+    dev->stats.tx_dropped[pipe] += count - wrote;
+
+    return count;
+}
+
+/* number of bytes usb_dwc2_write_nonblock() would currently take without dropping any */
+size_t usb_dwc2_write_room(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
+{
+    if (!dev || !dev->pipe[pipe].ready || !dev->pipe[pipe].device2host)
+        return 0;
+
+    u32 flags = irq_save();
+    size_t room = ringbuffer_get_free(dev->pipe[pipe].device2host);
+    irq_restore(flags);
+
+    return room;
+}
+
 size_t usb_dwc2_read(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, void *buf, size_t count)
 {
-    // usb_debug_printf("***dwc2_read,count=%u\n", count);
+    usb_debug_printf("***dwc2_read,count=%zu\n", count);
     u8 *p = buf;
     size_t read, recvd = 0;
 
     if (!dev || !dev->pipe[pipe].ready)
         return 0;
 
-    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
-    if (!host2device)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return 0;
 
+    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
+
     u8 ep = dev->pipe[pipe].ep_out;
 
     while (count) {
+        u32 flags = irq_save();
         read = ringbuffer_read(p, count, host2device);
         count -= read;
         p += read;
         recvd += read;
-        usb_dwc2_handle_events(dev);
+        usb_dwc2_handle_interrupts(dev);
         usb_dwc2_cdc_start_bulk_out_xfer(dev, ep);
+        irq_restore(flags);
     }
 
     return recvd;
@@ -1618,11 +2842,16 @@ ssize_t usb_dwc2_can_read(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
     if (!dev || !dev->pipe[pipe].ready)
         return 0;
 
-    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
-    if (!host2device)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return 0;
 
-    return ringbuffer_get_used(host2device);
+    ringbuffer_t *host2device = dev->pipe[pipe].host2device;
+
+    u32 flags = irq_save();
+    ssize_t used = ringbuffer_get_used(host2device);
+    irq_restore(flags);
+
+    return used;
 }
 
 bool usb_dwc2_can_write(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
@@ -1639,13 +2868,20 @@ void usb_dwc2_flush(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe)
     if (!dev || !dev->pipe[pipe].ready)
         return;
 
-    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
-    if (!device2host)
+    if (!usb_dwc2_pipe_alloc(dev, pipe))
         return;
 
+    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
+
     u8 ep = dev->pipe[pipe].ep_in;
 
-    while (ringbuffer_get_used(device2host) != 0 || dev->endpoints[ep].xfer_in_progress) {
-        usb_dwc2_handle_events(dev);
+    while (1) {
+        u32 flags = irq_save();
+        bool busy = ringbuffer_get_used(device2host) != 0 || dev->endpoints[ep].xfer_in_progress;
+        if (busy)
+            usb_dwc2_handle_interrupts(dev);
+        irq_restore(flags);
+        if (!busy)
+            break;
     }
 }
@@ -4,13 +4,44 @@
 #define USB_DWC2_H
 
 #include "types.h"
+#include "usb_msc.h"
 #include "usb_types.h"
 
-#define EP0_MAX_PACKET_SIZE 64
+#define EP0_MAX_PACKET_SIZE    64
+#define USB_DWC2_MAX_ENDPOINTS 10
 
 typedef struct dwc2_dev dwc2_dev_t;
 
-dwc2_dev_t *usb_dwc2_init(uintptr_t regs);
+/* performance counters, layout shared with the proxyclient; times are in timer ticks */
+struct usb_dwc2_ep_stats {
+    u64 bytes;
+    u32 xfers;
+    u32 short_pkts;
+    u32 zlps;
+    u32 ring_full;
+    u32 rearm_gap_max;
+    u32 rearm_count;
+    u64 rearm_gap_total;
+} PACKED;
+
+struct usb_dwc2_source_sink_stats {
+    u64 rx_bytes;
+    u64 tx_bytes;
+    u32 rx_errors;
+    /* AHB error and timeout interrupts on the IN endpoint */
+    u32 tx_errors;
+} PACKED;
+
+struct usb_dwc2_stats {
+    u64 irq_ticks;
+    u32 irq_count;
+    u32 num_endpoints;
+    struct usb_dwc2_ep_stats ep[USB_DWC2_MAX_ENDPOINTS];
+    /* bytes thrown away by usb_dwc2_write_nonblock() because the ringbuffer was full */
+    u64 tx_dropped[USB_PIPE_MAX];
+} PACKED;
+
+dwc2_dev_t *usb_dwc2_init(uintptr_t regs, bool desc_dma);
 void usb_dwc2_shutdown(dwc2_dev_t *dev);
 
 void usb_dwc2_handle_events(dwc2_dev_t *dev);
@@ -24,6 +55,17 @@ void usb_dwc2_putbyte(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, u8 byte);
 size_t usb_dwc2_read(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, void *buf, size_t count);
 size_t usb_dwc2_write(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count);
 size_t usb_dwc2_queue(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count);
+size_t usb_dwc2_try_write(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count);
+size_t usb_dwc2_write_nonblock(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf,
+                               size_t count);
+size_t usb_dwc2_write_room(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe);
 void usb_dwc2_flush(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe);
 void usb_dwc2_handle_interrupts(dwc2_dev_t *dev);
+void usb_dwc2_get_stats(dwc2_dev_t *dev, struct usb_dwc2_stats *stats, bool reset);
+void usb_dwc2_source_sink(dwc2_dev_t *dev, bool enable, struct usb_dwc2_source_sink_stats *stats);
+int usb_dwc2_set_buffer_size(dwc2_dev_t *dev, cdc_acm_pipe_id_t pipe, size_t host2device_size,
+                             size_t device2host_size);
+int usb_dwc2_msc_start(dwc2_dev_t *dev, void *base, size_t size);
+void usb_dwc2_msc_stop(dwc2_dev_t *dev);
+int usb_dwc2_msc_status(dwc2_dev_t *dev, struct usb_msc_status *status);
 #endif
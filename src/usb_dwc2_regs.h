@@ -25,6 +25,7 @@
 #define DWC2_GOTGINT 0x004
 
 #define DWC2_GAHBCFG              0x008
+#define DWC2_GAHBCFG_GLBL_INTR_EN BIT(0)
 #define DWC2_GAHBCFG_HBSTLEN_MASK GENMASK(4, 1)
 #define DWC2_GAHBCFG_HBSTLEN(x)   ((x & 0xf) << 1)
 #define DWC2_GAHBCFG_DMA_EN       BIT(5)
@@ -35,6 +36,11 @@
 
 #define DWC2_GRSTCTL         0x010
 #define DWC2_GRSTCTL_CSFTRST BIT(0)
+#define DWC2_GRSTCTL_RXFFLSH BIT(4)
+#define DWC2_GRSTCTL_TXFFLSH BIT(5)
+#define DWC2_GRSTCTL_TXFNUM  GENMASK(10, 6)
+#define DWC2_GRSTCTL_TXFALL  0x10
+#define DWC2_GRSTCTL_AHBIDLE BIT(31)
 
 #define DWC2_GINTSTS            0x014
 #define DWC2_GINTSTS_GOUTNakEff BIT(7)
@@ -63,26 +69,40 @@
 #define DWC2_GSNPSID      0x040
 #define DWC2_GSNPSID_MASK 0xffff0000
 
-#define DWC2_GHWCFG1   0x044
-#define DWC2_GHWCFG2   0x048
-#define DWC2_GHWCFG3   0x04c
-#define DWC2_GHWCFG4   0x050
-#define DWC2_GLPMCFG   0x054
-#define DWC2_GPWRDN    0x058
-#define DWC2_GDFIFOCFG 0x05c
+#define DWC2_GHWCFG1 0x044
+
+#define DWC2_GHWCFG2              0x048
+#define DWC2_GHWCFG2_ARCH_MASK    GENMASK(4, 3)
+#define DWC2_GHWCFG2_ARCH_INT_DMA 2
+
+#define DWC2_GHWCFG3             0x04c
+#define DWC2_GHWCFG3_DFIFO_DEPTH GENMASK(31, 16)
+
+#define DWC2_GHWCFG4          0x050
+#define DWC2_GHWCFG4_DESC_DMA BIT(30)
+
+#define DWC2_GLPMCFG 0x054
+#define DWC2_GPWRDN  0x058
+
+#define DWC2_GDFIFOCFG            0x05c
+#define DWC2_GDFIFOCFG_GDFIFOCFG  GENMASK(15, 0)
+#define DWC2_GDFIFOCFG_EPINFOBASE GENMASK(31, 16)
 
 /* Attachment detection control register */
 #define DWC2_ADPCTL (0x060)
 
 /* Host registers */
-#define DWC2_HPTXFSIZ   0x100
-#define DWC2_DTXFSIZ(n) (0x104 + 0x4 * (n - 1))
-#define DWC2_HPTXSIZ    0x400
-#define DWC2_HPRT0      0x440
+#define DWC2_HPTXFSIZ       0x100
+#define DWC2_DTXFSIZ(n)     (0x104 + 0x4 * ((n) - 1))
+#define DWC2_FIFOSIZE_DEPTH GENMASK(31, 16)
+#define DWC2_FIFOSIZE_START GENMASK(15, 0)
+#define DWC2_HPTXSIZ        0x400
+#define DWC2_HPRT0          0x440
 
 /* Device registers */
 #define DWC2_DCFG            0x800
 #define DCFG_NZ_STS_OUT_HSHK BIT(2)
+#define DCFG_DESC_DMA        BIT(23)
 
 #define DWC2_DCTL           0x804
 #define DWC2_DCTL_SftDisCon BIT(1)
@@ -95,11 +115,13 @@
 #define DWC2_DIEPMSK_XferComplMsk BIT(0)
 #define DWC2_DIEPMSK_AHBErrMsk    BIT(2)
 #define DWC2_DIEPMSK_TimeOUTMsk   BIT(3)
+#define DWC2_DIEPMSK_BNAMsk       BIT(9)
 
 #define DWC2_DOEPMSK              0x814
 #define DWC2_DOEPMSK_XferComplMsk BIT(0)
 #define DWC2_DOEPMSK_AHBErrMsk    BIT(2)
 #define DWC2_DOEPMSK_SetUPMsk     BIT(3)
+#define DWC2_DOEPMSK_BNAMsk       BIT(9)
 
 #define DWC2_DAINT    (0x818)
 #define DWC2_DAINTMSK (0x81c)
@@ -114,6 +136,7 @@
 #define DWC2_DXEPCTL_ActivateEP BIT(15)
 
 #define DWC2_DIEPINT(ep)                (0x908 + 0x20 * ep)
+#define DWC2_DIEPINT_BNA                BIT(9)
 #define DWC2_DIEPINT_InTokenTXFifoEmpty BIT(4)
 #define DWC2_DIEPINT_TimeOUT            BIT(3)
 #define DWC2_DIEPINT_AHBErr             BIT(2)
@@ -128,6 +151,7 @@
 #define DWC2_DOEPCTL(ep)            (0xb00 + 0x20 * ep)
 #define DWC2_DOEPINT(ep)            (0xb08 + 0x20 * ep)
 #define DWC2_DOEPINT_STUP_PKT_RCVD  BIT(15)
+#define DWC2_DOEPINT_BNA            BIT(9)
 #define DWC2_DOEPINT_STS_PHASE_RCVD BIT(5)
 #define DWC2_DOEPINT_SETUP          BIT(3)
 #define DWC2_DOEPINT_AHBErr         BIT(2)
@@ -137,4 +161,24 @@
 #define DWC2_DOEPTSIZ(ep) (0xb10 + 0x20 * ep)
 #define DWC2_DOEPDMA(ep)  (0xb14 + 0x20 * ep)
 #define DWC2_DOEPDMAB(ep) (0xb1c + 0x20 * ep)
+
+/* Scatter/gather DMA descriptors (DCFG.DescDMA) */
+#define DWC2_DMA_DESC_BS_MASK       GENMASK(31, 30)
+#define DWC2_DMA_DESC_BS_HOST_READY 0
+#define DWC2_DMA_DESC_BS_DMA_BUSY   1
+#define DWC2_DMA_DESC_BS_DMA_DONE   2
+#define DWC2_DMA_DESC_BS_HOST_BUSY  3
+#define DWC2_DMA_DESC_RTS_MASK      GENMASK(29, 28)
+#define DWC2_DMA_DESC_L             BIT(27)
+#define DWC2_DMA_DESC_SP            BIT(26)
+#define DWC2_DMA_DESC_IOC           BIT(25)
+#define DWC2_DMA_DESC_SR            BIT(24)
+#define DWC2_DMA_DESC_MTRF          BIT(23)
+#define DWC2_DMA_DESC_NBYTES_MASK   GENMASK(15, 0)
+
+struct dwc2_dma_desc {
+    u32 status;
+    u32 buf;
+} PACKED;
+
 #endif
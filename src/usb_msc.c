@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Minimal SCSI block device on top of a RAM window, for the USB mass-storage mode. Only the
+ * commands hosts send to a removable direct-access device during enumeration and plain
+ * reads/writes are implemented, everything else fails with ILLEGAL REQUEST.
+ */
+
+#include "usb_msc.h"
+#include "string.h"
+#include "utils.h"
+
+#define SCSI_TEST_UNIT_READY   0x00
+#define SCSI_REQUEST_SENSE     0x03
+#define SCSI_INQUIRY           0x12
+#define SCSI_MODE_SENSE_6      0x1a
+#define SCSI_START_STOP_UNIT   0x1b
+#define SCSI_PREVENT_ALLOW     0x1e
+#define SCSI_READ_FORMAT_CAPS  0x23
+#define SCSI_READ_CAPACITY_10  0x25
+#define SCSI_READ_10           0x28
+#define SCSI_WRITE_10          0x2a
+#define SCSI_VERIFY_10         0x2f
+#define SCSI_SYNCHRONIZE_CACHE 0x35
+
+#define SENSE_NONE            0x00
+#define SENSE_ILLEGAL_REQUEST 0x05
+
+#define ASC_INVALID_COMMAND  0x20
+#define ASC_LBA_OUT_OF_RANGE 0x21
+#define ASC_INVALID_FIELD    0x24
+
+/* vendor (8), product (16) and revision (4), space padded */
+#define MSC_INQUIRY_ID   "Haywire mini RAM window 1.0 "
+#define MSC_INQUIRY_SIZE 36
+
+static inline u16 get_be16(const u8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline u32 get_be32(const u8 *p)
+{
+    return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be32(u8 *p, u32 val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+void usb_msc_init(usb_msc_t *msc, void *base, size_t size)
+{
+    memset(msc, 0, sizeof(*msc));
+    msc->base = base;
+    msc->blocks = size / USB_MSC_BLOCK_SIZE;
+    msc->status.base = (uintptr_t)base;
+    msc->status.size = (u64)msc->blocks * USB_MSC_BLOCK_SIZE;
+    msc->status.lba_first = ~0;
+}
+
+static u8 usb_msc_fail(usb_msc_t *msc, u8 sense_key, u8 asc)
+{
+    msc->sense_key = sense_key;
+    msc->asc = asc;
+    msc->status.errors++;
+    return USB_MSC_CSW_FAILED;
+}
+
+static u8 usb_msc_reply(struct usb_msc_data *data, u8 *resp, u32 len, u32 alloc_len)
+{
+    data->buf = resp;
+    data->len = min(len, alloc_len);
+    data->dir_in = true;
+    return USB_MSC_CSW_PASSED;
+}
+
+static u8 usb_msc_rw(usb_msc_t *msc, const u8 *cb, struct usb_msc_data *data, bool dir_in)
+{
+    u32 lba = get_be32(&cb[2]);
+    u32 count = get_be16(&cb[7]);
+
+    if (lba > msc->blocks || count > msc->blocks - lba)
+        return usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+
+    data->buf = msc->base + (size_t)lba * USB_MSC_BLOCK_SIZE;
+    data->len = count * USB_MSC_BLOCK_SIZE;
+    data->lba = lba;
+    data->dir_in = dir_in;
+    data->media = true;
+    return USB_MSC_CSW_PASSED;
+}
+
+u8 usb_msc_command(usb_msc_t *msc, const struct usb_msc_cbw *cbw, u8 *resp,
+                   struct usb_msc_data *data)
+{
+    const u8 *cb = cbw->CBWCB;
+
+    memset(data, 0, sizeof(*data));
+    msc->status.commands++;
+
+    if (cbw->bCBWLUN)
+        return usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+
+    switch (cb[0]) {
+        case SCSI_TEST_UNIT_READY:
+        case SCSI_START_STOP_UNIT:
+        case SCSI_PREVENT_ALLOW:
+        case SCSI_VERIFY_10:
+        case SCSI_SYNCHRONIZE_CACHE:
+            return USB_MSC_CSW_PASSED;
+
+        case SCSI_REQUEST_SENSE:
+            memset(resp, 0, 18);
+            resp[0] = 0x70; // current error, fixed format
+            resp[2] = msc->sense_key;
+            resp[7] = 18 - 8;
+            resp[12] = msc->asc;
+            msc->sense_key = SENSE_NONE;
+            msc->asc = 0;
+            return usb_msc_reply(data, resp, 18, cb[4]);
+
+        case SCSI_INQUIRY:
+            if (cb[1] & 1) // EVPD
+                return usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+            memset(resp, 0, MSC_INQUIRY_SIZE);
+            resp[1] = 0x80; // removable
+            resp[2] = 0x04; // SPC-2
+            resp[3] = 0x02; // response data format
+            resp[4] = MSC_INQUIRY_SIZE - 5;
+            memcpy(&resp[8], MSC_INQUIRY_ID, MSC_INQUIRY_SIZE - 8);
+            return usb_msc_reply(data, resp, MSC_INQUIRY_SIZE, get_be16(&cb[3]));
+
+        case SCSI_MODE_SENSE_6:
+            /* header only: no block descriptors, no mode pages, not write protected */
+            memset(resp, 0, 4);
+            resp[0] = 3;
+            return usb_msc_reply(data, resp, 4, cb[4]);
+
+        case SCSI_READ_FORMAT_CAPS:
+            memset(resp, 0, 12);
+            resp[3] = 8;
+            put_be32(&resp[4], msc->blocks);
+            put_be32(&resp[8], USB_MSC_BLOCK_SIZE);
+            resp[8] = 0x02; // formatted media, shares a word with the 24 bit block length
+            return usb_msc_reply(data, resp, 12, get_be16(&cb[7]));
+
+        case SCSI_READ_CAPACITY_10:
+            put_be32(&resp[0], msc->blocks - 1);
+            put_be32(&resp[4], USB_MSC_BLOCK_SIZE);
+            return usb_msc_reply(data, resp, 8, 8);
+
+        case SCSI_READ_10:
+            return usb_msc_rw(msc, cb, data, true);
+
+        case SCSI_WRITE_10:
+            return usb_msc_rw(msc, cb, data, false);
+
+        default:
+            return usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+    }
+}
+
+/* account a finished data stage, transferred only counts bytes that reached buf */
+void usb_msc_complete(usb_msc_t *msc, const struct usb_msc_data *data, u32 transferred)
+{
+    if (!data->media)
+        return;
+
+    if (data->dir_in) {
+        msc->status.bytes_read += transferred;
+        return;
+    }
+
+    msc->status.bytes_written += transferred;
+    if (transferred < USB_MSC_BLOCK_SIZE)
+        return;
+
+    u32 last = data->lba + transferred / USB_MSC_BLOCK_SIZE - 1;
+    msc->status.lba_first = min(msc->status.lba_first, data->lba);
+    msc->status.lba_last = max(msc->status.lba_last, last);
+}
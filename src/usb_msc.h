@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef USB_MSC_H
+#define USB_MSC_H
+
+#include "types.h"
+
+#define USB_MSC_BLOCK_SIZE 512
+
+#define USB_MSC_CBW_SIGNATURE 0x43425355
+#define USB_MSC_CBW_SIZE      31
+#define USB_MSC_CBW_DIR_IN    0x80
+#define USB_MSC_CSW_SIGNATURE 0x53425355
+#define USB_MSC_CSW_SIZE      13
+
+#define USB_MSC_CSW_PASSED      0
+#define USB_MSC_CSW_FAILED      1
+#define USB_MSC_CSW_PHASE_ERROR 2
+
+/* bulk-only transport command and status wrappers */
+struct usb_msc_cbw {
+    u32 dCBWSignature;
+    u32 dCBWTag;
+    u32 dCBWDataTransferLength;
+    u8 bmCBWFlags;
+    u8 bCBWLUN;
+    u8 bCBWCBLength;
+    u8 CBWCB[16];
+} PACKED;
+
+struct usb_msc_csw {
+    u32 dCSWSignature;
+    u32 dCSWTag;
+    u32 dCSWDataResidue;
+    u8 bCSWStatus;
+} PACKED;
+
+/* status and counters, layout shared with the proxyclient */
+struct usb_msc_status {
+    u64 base;
+    u64 size;
+    u64 bytes_read;
+    u64 bytes_written;
+    u32 commands;
+    u32 errors;
+    /* range of blocks written since the window was exposed, first > last if none */
+    u32 lba_first;
+    u32 lba_last;
+} PACKED;
+
+typedef struct {
+    u8 *base;
+    u32 blocks;
+    u8 sense_key;
+    u8 asc;
+    struct usb_msc_status status;
+} usb_msc_t;
+
+/*
+ * Data stage of a command as decided by usb_msc_command(). buf is either the response in
+ * the caller's buffer or a pointer into the RAM window, and len may be shorter than what the
+ * host asked for. The transport pads or discards the difference.
+ */
+struct usb_msc_data {
+    u8 *buf;
+    u32 len;
+    u32 lba;
+    bool dir_in;
+    bool media;
+};
+
+void usb_msc_init(usb_msc_t *msc, void *base, size_t size);
+u8 usb_msc_command(usb_msc_t *msc, const struct usb_msc_cbw *cbw, u8 *resp,
+                   struct usb_msc_data *data);
+void usb_msc_complete(usb_msc_t *msc, const struct usb_msc_data *data, u32 transferred);
+
+#endif
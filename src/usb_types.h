@@ -44,7 +44,10 @@
 typedef enum _cdc_acm_pipe_id_t {
     CDC_ACM_PIPE_0,
     CDC_ACM_PIPE_1,
-    CDC_ACM_PIPE_MAX
+    CDC_ACM_PIPE_MAX,
+    /* vendor-specific raw bulk interface, a pipe without any ACM control requests */
+    USB_BULK_PIPE = CDC_ACM_PIPE_MAX,
+    USB_PIPE_MAX
 } cdc_acm_pipe_id_t;
 
 typedef enum _usb_type_t { USB_TYPE_DWC2, USB_TYPE_DWC3 } usb_type_t;
@@ -2,7 +2,9 @@
 
 #include "utils.h"
 #include "assert.h"
+#include "atomic.h"
 #include "iodev.h"
+#include "memory.h"
 #include "smp.h"
 #include "timer.h"
 #include "uart.h"
@@ -15,17 +17,56 @@ void spin_init(spinlock_t *lock)
     lock->count = 0;
 }
 
+/*
+ * lock holds the owning CPU (or -1) and is claimed with LDREX/STREX, waiters sleep in WFE until
+ * the owner's SEV. The exclusive monitor only works on Normal memory; before the MMU is up only
+ * the boot CPU runs, so the owner is simply stored.
+ */
 void spin_lock(spinlock_t *lock)
 {
-    assert(lock->lock == -1 || lock->lock == smp_id());
-    lock->lock = smp_id();
+    s32 me = smp_id();
+    s32 tmp;
+    u32 fail;
+
+    if (atomic_load_acquire(&lock->lock) == me) {
+        lock->count++;
+        return;
+    }
+
+    if (!mmu_active()) {
+        assert(lock->lock == -1);
+        atomic_store_release(&lock->lock, me);
+        lock->count++;
+        return;
+    }
+
+    __asm__ volatile("1:\n"
+                     "\tldrex\t%0, [%2]\n"
+                     "\tcmn\t%0, #1\n"
+                     "\twfene\n"
+                     "\tbne\t1b\n"
+                     "\tstrex\t%1, %3, [%2]\n"
+                     "\tcmp\t%1, #0\n"
+                     "\tbne\t1b\n"
+                     "\tdmb\n"
+                     : "=&r"(tmp), "=&r"(fail)
+                     : "r"(&lock->lock), "r"(me)
+                     : "cc", "memory");
+
     lock->count++;
 }
 
 void spin_unlock(spinlock_t *lock)
 {
-    lock->count--;
-    assert(lock->count >= 0);
+    assert(lock->lock == smp_id());
+    assert(lock->count > 0);
+
+    if (--lock->count)
+        return;
+
+    atomic_store_release(&lock->lock, -1);
+    sysop("dsb");
+    sysop("sev");
 }
 
 int debug_printf(const char *fmt, ...)
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+#include "arm_cpu_regs.h"
 #include "sysreg_access.h"
 #include "types.h"
 
@@ -337,4 +338,36 @@ static inline bool is_boot_cpu(void)
     return true;
 }
 
+/* mask IRQs on the local CPU, returning the previous CPSR.I state for irq_restore() */
+static inline u32 irq_save(void)
+{
+    u32 flags = mrs(cpsr) & CPSR_I;
+    sysop("cpsid i");
+    return flags;
+}
+
+static inline void irq_restore(u32 flags)
+{
+    if (!flags)
+        sysop("cpsie i");
+}
+
+/*
+ * spin_lock() is recursive per CPU, so on its own it does not keep out an IRQ handler on the
+ * same core. State an IRQ handler also touches needs these, held only for short non-blocking
+ * sections.
+ */
+static inline u32 spin_lock_irqsave(spinlock_t *lock)
+{
+    u32 flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, u32 flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "vic.h"
+#include "adt.h"
+#include "string.h"
+#include "utils.h"
+
+/* ARM PL192 vectored interrupt controllers, 32 lines each */
+#define VIC_IRQSTATUS    0x000
+#define VIC_FIQSTATUS    0x004
+#define VIC_RAWINTR      0x008
+#define VIC_INTSELECT    0x00c
+#define VIC_INTENABLE    0x010
+#define VIC_INTENCLEAR   0x014
+#define VIC_SOFTINT      0x018
+#define VIC_SOFTINTCLEAR 0x01c
+#define VIC_PROTECTION   0x020
+#define VIC_ADDRESS      0xf00
+
+#define VIC_MAX      4
+#define VIC_IRQS     32
+#define VIC_MAX_IRQS (VIC_MAX * VIC_IRQS)
+#define VIC_IRQ_BANK 5
+#define VIC_IRQ_MASK 0x1f
+
+static uintptr_t vic_base[VIC_MAX];
+static int vic_count = 0;
+
+static struct {
+    irq_handler_t handler;
+    void *opaque;
+} vic_handlers[VIC_MAX_IRQS];
+
+int vic_init(void)
+{
+    int path[8];
+
+    if (adt_path_offset_trace(adt, "/arm-io/vic", path) < 0) {
+        printf("VIC: Error getting /arm-io/vic node\n");
+        return -1;
+    }
+
+    for (vic_count = 0; vic_count < VIC_MAX; vic_count++) {
+        if (adt_get_reg(adt, path, "reg", vic_count, &vic_base[vic_count], NULL) < 0)
+            break;
+    }
+
+    if (!vic_count) {
+        printf("VIC: Error getting /arm-io/vic reg\n");
+        return -1;
+    }
+
+    for (int i = 0; i < vic_count; i++) {
+        write32(vic_base[i] + VIC_INTENCLEAR, ~0);
+        write32(vic_base[i] + VIC_INTSELECT, 0);
+        write32(vic_base[i] + VIC_SOFTINTCLEAR, ~0);
+        write32(vic_base[i] + VIC_ADDRESS, 0);
+    }
+
+    printf("VIC: %d controllers @ 0x%x\n", vic_count, vic_base[0]);
+    return 0;
+}
+
+void vic_shutdown(void)
+{
+    for (int i = 0; i < vic_count; i++)
+        write32(vic_base[i] + VIC_INTENCLEAR, ~0);
+
+    memset(vic_handlers, 0, sizeof(vic_handlers));
+}
+
+int vic_register_irq(u32 irq, irq_handler_t handler, void *opaque)
+{
+    if ((irq >> VIC_IRQ_BANK) >= (u32)vic_count)
+        return -1;
+
+    vic_handlers[irq].opaque = opaque;
+    vic_handlers[irq].handler = handler;
+    return 0;
+}
+
+void vic_unregister_irq(u32 irq)
+{
+    if ((irq >> VIC_IRQ_BANK) >= (u32)vic_count)
+        return;
+
+    vic_disable_irq(irq);
+    vic_handlers[irq].handler = NULL;
+    vic_handlers[irq].opaque = NULL;
+}
+
+void vic_enable_irq(u32 irq)
+{
+    if ((irq >> VIC_IRQ_BANK) >= (u32)vic_count)
+        return;
+
+    write32(vic_base[irq >> VIC_IRQ_BANK] + VIC_INTENABLE, BIT(irq & VIC_IRQ_MASK));
+}
+
+void vic_disable_irq(u32 irq)
+{
+    if ((irq >> VIC_IRQ_BANK) >= (u32)vic_count)
+        return;
+
+    write32(vic_base[irq >> VIC_IRQ_BANK] + VIC_INTENCLEAR, BIT(irq & VIC_IRQ_MASK));
+}
+
+/* returns the idx-th entry of the "interrupts" property of an ADT node */
+int vic_get_irq(const char *path, int idx)
+{
+    int node = adt_path_offset(adt, path);
+    if (node < 0)
+        return -1;
+
+    u32 len;
+    const u32 *irqs = adt_getprop(adt, node, "interrupts", &len);
+    if (!irqs || (u32)idx >= len / sizeof(u32))
+        return -1;
+
+    return irqs[idx];
+}
+
+/* called from the IRQ vector with IRQs masked */
+void vic_handle_irq(void)
+{
+    for (int i = 0; i < vic_count; i++) {
+        u32 status;
+
+        while ((status = read32(vic_base[i] + VIC_IRQSTATUS))) {
+            u32 irq = i * VIC_IRQS + __builtin_ctz(status);
+
+            if (vic_handlers[irq].handler) {
+                vic_handlers[irq].handler(vic_handlers[irq].opaque);
+            } else {
+                printf("VIC: unhandled IRQ %u, masking\n", irq);
+                vic_disable_irq(irq);
+            }
+        }
+
+        write32(vic_base[i] + VIC_ADDRESS, 0);
+    }
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef VIC_H
+#define VIC_H
+
+#include "types.h"
+
+typedef void (*irq_handler_t)(void *opaque);
+
+int vic_init(void);
+void vic_shutdown(void);
+
+int vic_register_irq(u32 irq, irq_handler_t handler, void *opaque);
+void vic_unregister_irq(u32 irq);
+void vic_enable_irq(u32 irq);
+void vic_disable_irq(u32 irq);
+
+int vic_get_irq(const char *path, int idx);
+
+void vic_handle_irq(void);
+
+#endif